@@ -49,6 +49,9 @@
 #include "pub_core_tooliface.h"
 #include "pub_core_translate.h"        // for VG_(translate)()
 #include "pub_core_xarray.h"           // VG_(xaprintf) et al
+#ifdef RECORD_REPLAY
+#include "pub_core_recordreplay.h"     // VG_(RR_FastForwarding)
+#endif
 
 /*------------------------------------------------------------*/
 /*--- Globals                                              ---*/
@@ -676,6 +679,13 @@ void VG_(maybe_record_error) ( ThreadId tid,
    static Bool   stopping_message = False;
    static Bool   slowdown_message = False;
 
+#ifdef RECORD_REPLAY
+   /* The tool's shadow state means nothing before a replay
+      fast-forward ends, nor do the errors it finds. */
+   if (VG_(RR_FastForwarding)())
+      return;
+#endif
+
    /* After M_COLLECT_NO_ERRORS_AFTER_SHOWN different errors have
       been found, or M_COLLECT_NO_ERRORS_AFTER_FOUND total errors
       have been found, just refuse to collect any more.  This stops
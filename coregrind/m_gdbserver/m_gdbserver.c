@@ -50,6 +50,9 @@
 #include "pub_core_debuginfo.h"
 #include "pub_core_scheduler.h"
 #include "pub_core_syswrap.h"
+#ifdef RECORD_REPLAY
+#include "pub_core_recordreplay.h"
+#endif
 
 #include "server.h"
 
@@ -602,19 +605,10 @@ void VG_(gdbserver_prerun_action) (ThreadId tid)
    }
 }
 
-/* when fork is done, various cleanup is needed in the child process.
-   In particular, child must have its own connection to avoid stealing 
-   data from its parent */
-static void gdbserver_cleanup_in_child_after_fork(ThreadId me)
+/* Drops the break and watch points of a gdbserver that another process
+   has set up. */
+static void forget_gdbserver(void)
 {
-   dlog(1, "thread %d gdbserver_cleanup_in_child_after_fork pid %d\n",
-        me, VG_(getpid) ());
-
-   /* finish connection inheritated from parent */
-   remote_finish(reset_after_fork);
-
-   /* ensure next call to gdbserver will be considered as a brand
-      new call that will initialize a fresh gdbserver. */
    if (gdbserver_called) {
       gdbserver_called = 0;
       vg_assert (gs_addresses != NULL);
@@ -627,13 +621,113 @@ static void gdbserver_cleanup_in_child_after_fork(ThreadId me)
       vg_assert (gs_addresses == NULL);
       vg_assert (gs_watches == NULL);
    }
+}
+
+static void gdbserver_cleanup_in_child_after_fork(ThreadId me);
+
+/* Creates the tables of gdbserved addresses and watches, on the first
+   call to gdbserver. */
+static void setup_gdbserved_tables(void)
+{
+   vg_assert (gs_addresses == NULL);
+   vg_assert (gs_watches == NULL);
+   gs_addresses = VG_(HT_construct)( "gdbserved_addresses" );
+   gs_watches = VG_(newXA)(gs_alloc,
+                           "gdbserved_watches",
+                           gs_free,
+                           sizeof(GS_Watch*));
+   VG_(atfork)(NULL, NULL, gdbserver_cleanup_in_child_after_fork);
+}
+
+/* when fork is done, various cleanup is needed in the child process.
+   In particular, child must have its own connection to avoid stealing 
+   data from its parent */
+static void gdbserver_cleanup_in_child_after_fork(ThreadId me)
+{
+   dlog(1, "thread %d gdbserver_cleanup_in_child_after_fork pid %d\n",
+        me, VG_(getpid) ());
+
+   /* finish connection inheritated from parent */
+   remote_finish(reset_after_fork);
 
+   /* ensure next call to gdbserver will be considered as a brand
+      new call that will initialize a fresh gdbserver. */
+   forget_gdbserver();
    
    if (VG_(clo_trace_children)) {
       VG_(gdbserver_prerun_action) (me);
    }
 }
 
+Bool VG_(gdbserver_save_session) (GdbSession* s)
+{
+   GS_Address* g;
+   GS_Watch* w;
+   Word i;
+
+   VG_(memset) (s, 0, sizeof(*s));
+   s->fifo_pid = remote_fifo_pid();
+   s->noack_mode = noack_mode;
+   s->stepping = valgrind_single_stepping();
+   if (!gdbserver_called)
+      return True;
+
+   VG_(HT_ResetIter) (gs_addresses);
+   while ((g = VG_(HT_Next) (gs_addresses))) {
+      if (g->kind != GS_break)
+         continue;
+      if (s->n_points == GDBSERVER_SESSION_POINTS)
+         return False;
+      s->points[s->n_points].kind = software_breakpoint;
+      s->points[s->n_points].addr = g->addr;
+      s->points[s->n_points].len = 1;
+      s->n_points++;
+   }
+   for (i = 0; i < VG_(sizeXA) (gs_watches); i++) {
+      w = index_gs_watches(i);
+      if (s->n_points == GDBSERVER_SESSION_POINTS)
+         return False;
+      s->points[s->n_points].kind = w->kind;
+      s->points[s->n_points].addr = w->addr;
+      s->points[s->n_points].len = w->len;
+      s->n_points++;
+   }
+   return True;
+}
+
+void VG_(gdbserver_adopt_session) (ThreadId tid, const GdbSession* s,
+                                   Bool connect)
+{
+   Int i;
+
+   dlog(1, "adopting gdbserver session of pid %d, %d points, connect %d\n",
+        s->fifo_pid, s->n_points, connect);
+
+   /* whatever this process did before, e.g. with --trace-children=yes */
+   remote_finish(reset_after_fork);
+   forget_gdbserver();
+
+   setup_gdbserved_tables();
+   gdbserver_called++;
+   gdbserver_init();
+   remote_adopt(VG_(clo_vgdb_prefix), s->fifo_pid, connect);
+   if (connect) {
+      server_resume_reply_pending(s->noack_mode);
+      replay_history_begin = s->history_begin;
+   }
+
+   for (i = 0; i < s->n_points; i++)
+      if (!VG_(gdbserver_point) (s->points[i].kind, /* insert */ True,
+                                 s->points[i].addr, s->points[i].len))
+         VG_(umsg) ("Warning: gdbserver can't insert the %s at %p again\n",
+                    VG_(ppPointKind) (s->points[i].kind),
+                    (void*) s->points[i].addr);
+
+   valgrind_set_single_stepping(s->stepping);
+   if (s->stepping)
+      invalidate_current_ip (tid, "m_gdbserver adopt session");
+}
+
 /* If reason is init_reason, creates the connection resources (e.g.
       the FIFOs) to allow a gdb connection to be detected by polling
       using remote_desc_activity.
@@ -671,16 +765,8 @@ static void call_gdbserver ( ThreadId tid , CallReason reason)
       return;
    }
 
-   if (gdbserver_called == 0) {
-      vg_assert (gs_addresses == NULL);
-      vg_assert (gs_watches == NULL);
-      gs_addresses = VG_(HT_construct)( "gdbserved_addresses" );
-      gs_watches = VG_(newXA)(gs_alloc,
-                              "gdbserved_watches",
-                              gs_free,
-                              sizeof(GS_Watch*));
-      VG_(atfork)(NULL, NULL, gdbserver_cleanup_in_child_after_fork);
-   }
+   if (gdbserver_called == 0)
+      setup_gdbserved_tables();
    vg_assert (gs_addresses != NULL);
    vg_assert (gs_watches != NULL);
    
@@ -703,7 +789,23 @@ static void call_gdbserver ( ThreadId tid , CallReason reason)
 
    stepping = valgrind_single_stepping();
 
+#ifdef RECORD_REPLAY
+   {
+      RRStopKind kind = RRStop_Other;
+      Bool hidden_step;
+
+      if (reason == watch_reason)
+         kind = RRStop_Watch;
+      else if (reason == break_reason)
+         kind = stepping ? RRStop_Step : RRStop_Breakpoint;
+      if (VG_(RR_HideGdbStop) (tid, kind, &hidden_step))
+         server_hidden_stop (hidden_step);
+      else
+         server_main();
+   }
+#else
    server_main();
+#endif
 
    ignore_this_break_once = valgrind_get_ignore_break_once();
    if (ignore_this_break_once)
@@ -34,6 +34,7 @@
 #  endif
 
 Bool noack_mode;
+Bool replay_history_begin;
 
 static int readchar (int single);
 
@@ -53,6 +54,9 @@ static int pid_from_to_creator;
 /* only this pid will remove the FIFOs: if an exec fails, we must avoid
    that the exiting child believes it has to remove the FIFOs of its parent */
 static int mknod_done = 0;
+/* pid the FIFOs are named after when they were taken over from another
+   process of a replay (see remote_adopt), 0 for our own pid. */
+static int fifo_pid = 0;
 
 static char *from_gdb = NULL;
 static char *to_gdb = NULL;
@@ -209,31 +213,14 @@ void safe_mknod (char *nod)
    }
 }
 
-/* Open a connection to a remote debugger.
-   NAME is the filename used for communication.  
-   For Valgrind, name is the prefix for the two read and write FIFOs
-   The two FIFOs names will be build by appending 
-   -from-vgdb-to-pid-by-user-on-host and -to-vgdb-from-pid-by-user-on-host
-   with pid being the pidnr of the valgrind process These two FIFOs
-   will be created if not existing yet. They will be removed when
-   the gdbserver connection is closed or the process exits */
-
-void remote_open (const HChar *name)
+/* Builds the names of the FIFOs and of the shared memory file
+   of the process pid. */
+static
+void set_fifo_names (const HChar *name, int pid)
 {
    const HChar *user, *host;
-   int save_fcntl_flags, len;
-   VgdbShared vgdbinit = 
-      {0, 0, (Addr) VG_(invoke_gdbserver),
-       (Addr) VG_(threads), sizeof(ThreadState), 
-       offsetof(ThreadState, status),
-       offsetof(ThreadState, os_state) + offsetof(ThreadOSstate, lwpid),
-       0};
-   const int pid = VG_(getpid)();
-   const int name_default = strcmp(name, VG_(vgdb_prefix_default)()) == 0;
-   Addr addr_shared;
-   SysRes o;
-   int shared_mem_fd = INVALID_DESCRIPTOR;
-   
+   int len;
+
    user = VG_(getenv)("LOGNAME");
    if (user == NULL) user = VG_(getenv)("USER");
    if (user == NULL) user = "???";
@@ -260,6 +247,85 @@ void remote_open (const HChar *name)
                  pid, user, host);
    VG_(sprintf) (shared_mem, "%s-shared-mem-vgdb-%d-by-%s-on-%s", name,
                  pid, user, host);
+}
+
+/* Opens the read side FIFO in non blocking mode, and then sets the fd
+   in blocking mode. */
+static
+void open_read_side (void)
+{
+   int save_fcntl_flags;
+
+   remote_desc = open_fifo ("read", from_gdb, VKI_O_RDONLY|VKI_O_NONBLOCK);
+   save_fcntl_flags = VG_(fcntl) (remote_desc, VKI_F_GETFL, 0);
+   VG_(fcntl) (remote_desc, VKI_F_SETFL, save_fcntl_flags & ~VKI_O_NONBLOCK);
+   remote_desc_pollfdread_activity.fd = remote_desc;
+   remote_desc_pollfdread_activity.events = VKI_POLLIN;
+   remote_desc_pollfdread_activity.revents = 0;
+}
+
+/* Take over the FIFOs and shared memory that the process pid of the same
+   replay has created, instead of creating our own. This process becomes
+   the one removing them. With connect, the FIFOs are opened at once on
+   both sides: gdb is connected and waiting for a resume reply, and the
+   process holding the connection until now is about to go away. */
+void remote_adopt (const HChar *name, int pid, Bool connect)
+{
+   SysRes o;
+   SysRes res;
+
+   set_fifo_names (name, pid);
+   fifo_pid = pid;
+   mknod_done = 1;
+   pid_from_to_creator = connect ? VG_(getpid)() : 0;
+
+   o = VG_(open) (shared_mem, VKI_O_RDWR, 0600);
+   if (sr_isError (o)) {
+      sr_perror(o, "cannot open shared_mem file %s\n", shared_mem);
+      fatal("");
+   }
+   res = VG_(am_shared_mmap_file_float_valgrind)
+      (sizeof(VgdbShared), VKI_PROT_READ|VKI_PROT_WRITE, 
+       sr_Res(o), (Off64T)0);
+   VG_(close) (sr_Res(o));
+   if (sr_isError(res)) {
+      sr_perror(res, "error VG_(am_shared_mmap_file_float_valgrind) %s\n",
+                shared_mem);
+      fatal("");
+   }
+   shared = (VgdbShared*) sr_Res (res);
+
+   if (!connect)
+      return;
+   open_read_side ();
+   if (!ensure_write_remote_desc())
+      warning ("remote_adopt: no write_remote_desc\n");
+}
+
+/* Open a connection to a remote debugger.
+   NAME is the filename used for communication.  
+   For Valgrind, name is the prefix for the two read and write FIFOs
+   The two FIFOs names will be build by appending 
+   -from-vgdb-to-pid-by-user-on-host and -to-vgdb-from-pid-by-user-on-host
+   with pid being the pidnr of the valgrind process These two FIFOs
+   will be created if not existing yet. They will be removed when
+   the gdbserver connection is closed or the process exits */
+
+void remote_open (const HChar *name)
+{
+   VgdbShared vgdbinit = 
+      {0, 0, (Addr) VG_(invoke_gdbserver),
+       (Addr) VG_(threads), sizeof(ThreadState), 
+       offsetof(ThreadState, status),
+       offsetof(ThreadState, os_state) + offsetof(ThreadOSstate, lwpid),
+       0};
+   const int pid = fifo_pid != 0 ? fifo_pid : VG_(getpid)();
+   const int name_default = strcmp(name, VG_(vgdb_prefix_default)()) == 0;
+   Addr addr_shared;
+   SysRes o;
+   int shared_mem_fd = INVALID_DESCRIPTOR;
+   
+   set_fifo_names (name, pid);
    if (VG_(clo_verbosity) > 1) {
       VG_(umsg)("embedded gdbserver: reading from %s\n", from_gdb);
       VG_(umsg)("embedded gdbserver: writing to   %s\n", to_gdb);
@@ -340,12 +406,12 @@ void remote_open (const HChar *name)
       in non-blocking write mode succeeds only if the fifo is already
       opened in read mode. So, we wait till we have read the first
       character from the read side before opening the write side. */
-   remote_desc = open_fifo ("read", from_gdb, VKI_O_RDONLY|VKI_O_NONBLOCK);
-   save_fcntl_flags = VG_(fcntl) (remote_desc, VKI_F_GETFL, 0);
-   VG_(fcntl) (remote_desc, VKI_F_SETFL, save_fcntl_flags & ~VKI_O_NONBLOCK);
-   remote_desc_pollfdread_activity.fd = remote_desc;
-   remote_desc_pollfdread_activity.events = VKI_POLLIN;
-   remote_desc_pollfdread_activity.revents = 0;
+   open_read_side ();
+}
+
+int remote_fifo_pid (void)
+{
+   return fifo_pid != 0 ? fifo_pid : VG_(getpid)();
 }
 
 /* sync_gdb_connection wait a time long enough to let the connection
@@ -389,8 +455,10 @@ void remote_finish (FinishReason reason)
    noack_mode = False;
    
    /* ensure the child will create its own FIFOs */
-   if (reason == reset_after_fork)
+   if (reason == reset_after_fork) {
       mknod_done = 0;
+      fifo_pid = 0;
+   }
    
    if (reason == reset_after_error)
       sync_gdb_connection();
@@ -1009,6 +1077,13 @@ void prepare_resume_reply (char *buf, char status, unsigned char sig)
          *buf++ = ';';
       }
 
+      if (replay_history_begin) {
+         /* tells gdb it can't execute backwards from here */
+         strcpy (buf, "replaylog:begin;");
+         buf += strlen (buf);
+         replay_history_begin = False;
+      }
+
       while (*regp) {
          buf = outreg (find_regno (*regp), buf);
          regp ++;
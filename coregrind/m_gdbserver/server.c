@@ -30,6 +30,9 @@
 #include "pub_core_execontext.h"
 #include "pub_core_syswrap.h"      // VG_(show_open_fds)
 #include "pub_core_scheduler.h"
+#ifdef RECORD_REPLAY
+#include "pub_core_recordreplay.h"
+#endif
 
 unsigned long cont_thread;
 unsigned long general_thread;
@@ -766,6 +769,10 @@ void handle_query (char *arg_own_buf, int *new_packet_len_p)
       
       strcat (arg_own_buf, ";QStartNoAckMode+");
       strcat (arg_own_buf, ";QPassSignals+");
+#ifdef RECORD_REPLAY
+      if (VG_(RR_CanReverse)())
+         strcat (arg_own_buf, ";ReverseContinue+;ReverseStep+");
+#endif
       if (VG_(client_auxv))
          strcat (arg_own_buf, ";qXfer:auxv:read+");
 
@@ -820,6 +827,23 @@ void myresume (int step, int sig)
    valgrind_resume (resume_info);
 }
 
+void server_hidden_stop (int step)
+{
+   char status;
+   int sig;
+
+   /* valgrind_wait sets up the current thread, and tells about any
+      signal that would have been reported. */
+   sig = valgrind_wait (&status);
+   myresume (step, sig == TARGET_SIGNAL_TRAP ? 0 : target_signal_to_host (sig));
+}
+
+void server_resume_reply_pending (Bool noack)
+{
+   noack_mode = noack;
+   resume_reply_packet_needed = True;
+}
+
 /* server_main global variables */
 static char *own_buf;
 static unsigned char *mem_buf;
@@ -1046,6 +1070,21 @@ void server_main (void)
          set_desired_inferior (0);
          myresume (1, 0);
          return; // return control to valgrind
+#ifdef RECORD_REPLAY
+      case 'b':
+         if (own_buf[1] == 'c' || own_buf[1] == 's') {
+            ThreadState *tst;
+            set_desired_inferior (0);
+            tst = (ThreadState *) inferior_target_data (current_inferior);
+            /* does not return if the replay can go backwards */
+            VG_(RR_ReverseResume) (tst->tid, own_buf[1] == 's');
+            replay_history_begin = True;
+            prepare_resume_reply (own_buf, status, zignal);
+         } else {
+            own_buf[0] = '\0';
+         }
+         break;
+#endif
       case 'Z': {
          char *lenptr;
          char *dataptr;
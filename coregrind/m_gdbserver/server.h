@@ -57,6 +57,14 @@ extern void gdbserver_init (void);
 
 extern void server_main (void);
 
+/* A stop that gdb must not see: resumes as if gdb had asked to
+   continue (or to single step if step), passing on any signal. */
+extern void server_hidden_stop (int step);
+
+/* Gdb is waiting for the reply to a resume request it sent to another
+   process of the replay: the next call to server_main sends it. */
+extern void server_resume_reply_pending (Bool noack);
+
 /* To be called to indicate that gdbserver usage is finished.
    Resources (e.g. FIFOs) will be destroyed. */
 extern void gdbserver_terminate (void);
@@ -278,10 +286,15 @@ extern VG_MINIMAL_JMP_BUF(toplevel);
 /* From remote-utils.c */
 
 extern Bool noack_mode;
+/* the next resume reply tells gdb the replay history starts here */
+extern Bool replay_history_begin;
 int putpkt (char *buf);
 int putpkt_binary (char *buf, int len);
 int getpkt (char *buf);
 void remote_open (const HChar *name);
+void remote_adopt (const HChar *name, int pid, Bool connect);
+/* pid the FIFOs of this process are named after */
+int remote_fifo_pid (void);
 void remote_close (void);
 
 void sync_gdb_connection (void);
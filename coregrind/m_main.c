@@ -120,6 +120,32 @@ static void usage_NORETURN ( Bool debug_help )
 "    --record-replay=0|1|2     record or replay a specified client program. Default tool is none [0]\n"
 "                               0 stands for no record or replay; 1, record; 2, replay\n"
 "    --log-file-rr=<file>      only for record&replay. the name of replay log <file> [./_temp_rr_.log]\n"
+"                               record: %%p is the pid; a forked or traced exec'd\n"
+"                               client records to <file>.<pid>.<number>\n"
+"    --rr-sync=none|periodic|every-switch  when to fsync the record log [periodic]\n"
+"    --rr-sync-interval=<ms>   time between two fsyncs for --rr-sync=periodic [1000]\n"
+"    --rr-compress=none|lzo    compress the record log [none]\n"
+"    --rr-dedupe=<bytes>       record: keep each distinct syscall payload of at\n"
+"                               least <bytes> once, in <log file>.store [0: never]\n"
+"    --rr-map-reads=no|yes     record: put syscall payloads of 64KB or more in\n"
+"                               <log file>.store, for replay to map them [no]\n"
+"    --rr-file-refs=no|yes     record: log large reads of unchanged regular\n"
+"                               files as references, replay reads the file [no]\n"
+"    --rr-flight-recorder=<MB> record: keep only about the last <MB> of log, and\n"
+"                               replay that window if the client crashes [0: off];\n"
+"                               the window can't be replayed after the recording,\n"
+"                               nor from a segment started with several threads\n"
+"    --rr-virtual-clock=<ms>   record: serve time, gettimeofday and clock_gettime\n"
+"                               from the TSC, asking the kernel again every <ms>;\n"
+"                               x86 and amd64 only [0: off]\n"
+"    --rr-check-state=none|hash|delta|full  record: how the guest state is\n"
+"                               logged at every syscall for replay to check [full]\n"
+"    --rr-async-write=no|yes   write the record log from a helper thread [yes]\n"
+"    --rr-seek=<number>        replay: stop in the gdbserver when <number> events are replayed\n"
+"    --rr-checkpoint-syscalls=<number>  replay: checkpoint every <number> syscalls [0]\n"
+"    --rr-checkpoint-blocks=<number>    replay: checkpoint every <number> basic blocks [0]\n"
+"    --rr-fast-forward-to=<number>  replay: run without the tool's instrumentation\n"
+"                               until <number> events are replayed [0]\n"
 #endif
 "    --tool=<name>             use the Valgrind tool named <name> [memcheck]\n"
 "\n"
@@ -526,6 +552,21 @@ void main_process_cmd_line_options ( /*OUT*/Bool* logging_to_fd,
 /* Ignore these options - already been handled in m_recordreplay/recordreplay.c */
       else if VG_STREQN(16, arg, "--record-replay=")     {}
       else if VG_STREQN(13, arg, "--log-file-rr=")       {}
+      else if VG_STREQN(10, arg, "--rr-sync=")           {}
+      else if VG_STREQN(19, arg, "--rr-sync-interval=")  {}
+      else if VG_STREQN(14, arg, "--rr-compress=")       {}
+      else if VG_STREQN(17, arg, "--rr-check-state=")    {}
+      else if VG_STREQN(12, arg, "--rr-dedupe=")         {}
+      else if VG_STREQN(15, arg, "--rr-map-reads=")      {}
+      else if VG_STREQN(15, arg, "--rr-file-refs=")      {}
+      else if VG_STREQN(21, arg, "--rr-flight-recorder=") {}
+      else if VG_STREQN(10, arg, "--rr-tree=")           {}
+      else if VG_STREQN(19, arg, "--rr-virtual-clock=")  {}
+      else if VG_STREQN(17, arg, "--rr-async-write=")    {}
+      else if VG_STREQN(10, arg, "--rr-seek=")           {}
+      else if VG_STREQN(25, arg, "--rr-checkpoint-syscalls=") {}
+      else if VG_STREQN(23, arg, "--rr-checkpoint-blocks=")   {}
+      else if VG_STREQN(21, arg, "--rr-fast-forward-to=")     {}
 #endif
       else if VG_STREQN(17, arg, "--max-stackframe=")    {}
       else if VG_STREQN(17, arg, "--main-stacksize=")    {}
@@ -1714,6 +1755,10 @@ Int valgrind_main ( Int argc, HChar **argv, HChar **envp )
    the_iicii.clstack_top = VG_(am_startup)( the_iicii.sp_at_startup );
    VG_(debugLog)(1, "main", "Address space manager is running\n");
 
+#ifdef RECORD_REPLAY
+   VG_(RR_PostAspacemInit)();
+#endif
+
    //--------------------------------------------------------------
    // Start up the dynamic memory manager
    //   p: address space management
@@ -2549,7 +2594,7 @@ void shutdown_actions_NORETURN( ThreadId tid,
 
 
 #ifdef RECORD_REPLAY
-   VG_(RR_Exit)();
+   VG_(RR_Exit)(tids_schedretcode == VgSrc_FatalSig);
 #endif
 
    if (VG_(clo_xml)) {
@@ -0,0 +1,788 @@
+/*******************************************************************
+   This file is part of Valgrind, a dynamic binary instrumentation
+   framework.
+
+   Copyright (C) 2008
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+********************************************************************/
+
+/*
+ * checkpoint.c --
+ *
+ *      Fork-based checkpoints of the replaying process, and restarting the
+ *      replay from one of them. Also the snapshots of the recording process
+ *      for --rr-flight-recorder.
+ */
+
+#include "pub_core_basics.h"
+#include "pub_core_vki.h"
+#include "pub_core_libcbase.h"
+#include "pub_core_libcassert.h"
+#include "pub_core_libcprint.h"
+#include "pub_core_libcfile.h"
+#include "pub_core_libcproc.h"
+#include "pub_core_libcsignal.h"
+#include "pub_core_options.h"
+#include "pub_core_threadstate.h"
+#include "pub_core_machine.h"
+#include "pub_core_scheduler.h"
+#include "pub_core_gdbserver.h"
+#include "pub_core_recordreplay.h"
+#include "priv_recordreplay.h"
+
+/*
+ * A checkpoint is a fork of the whole replaying process. It is taken at the
+ * top of the scheduler loop, when a single thread is left and holds the
+ * BigLock. The fork then sleeps in a read of its resume pipe, costing
+ * nothing but the pages copy-on-write takes away from it.
+ *
+ * Restarting from a checkpoint is a write to its pipe: the checkpoint forks
+ * again, so that it can be used once more, and the new process goes on with
+ * the replay while the one that asked for the restart goes away. Checkpoints
+ * taken after the one restarted from are killed, so ckpts[] of every process
+ * still alive lists exactly the checkpoints before it.
+ *
+ * The process the user started is waited for by its parent. After its first
+ * restart, it becomes a relay that sleeps until whoever finishes the replay
+ * passes on the exit code through relay_fds.
+ *
+ * Reverse execution is built on top of that. gdb's reverse-continue at
+ * position P is done in two runs from the last checkpoint before P. The
+ * first one, the scan, hides every stop from gdb and remembers the last
+ * break or watch point hit before reaching P. The second one, the seek,
+ * runs to that hit and reports it to gdb. When the scan finds nothing, the
+ * interval of the checkpoint before is scanned, and so on back to the first
+ * checkpoint. reverse-stepi is the same with the scan single stepping, so
+ * that the last hit is the instruction before P.
+ *
+ * The scan and the seek get the break and watch points gdb has inserted.
+ * The seek also takes over the gdb connection: the process gdb talked to
+ * sleeps with the FIFOs open until then, so that vgdb doesn't see them
+ * closed, and is killed by the seek.
+ */
+#define RR_MAX_CHECKPOINTS 64
+
+/*
+ * The flight recorder cuts the log into segments (see RR_SEGMENT_NAME) at 
+ * the top of the scheduler loop, once the current one is big enough. When
+ * a single thread is left, as for a checkpoint, the recording process 
+ * forks there, and the fork sleeps as the snapshot the new segment starts
+ * from: memory, guest state, fds and threads as they were. With more 
+ * threads alive, the segment is started without a snapshot: the disk use
+ * stays bounded, but a crash can only be replayed from a segment that has
+ * one. When a segment is started, the one before the previous one is 
+ * deleted, and its snapshot killed.
+ *
+ * If the client dies of a fatal signal, the snapshot of the oldest segment
+ * kept is woken up, and replays the segments from there up to the crash,
+ * with the tool and the gdbserver the recording had. Otherwise the 
+ * snapshots are killed at exit.
+ *
+ * A snapshot only lives in memory: this is crash replay within the
+ * recording, not a persisted recording. Once it is over, the segments
+ * left on disk can't be replayed (readLogHeader refuses any but the 
+ * first), and the first one is deleted as soon as the third one starts.
+ *
+ * The snapshot is forked twice, for init to be its parent: the client's
+ * wait calls don't see it, nor wait for it. Its done pipe tells its pid,
+ * then reaches EOF when it is gone, in place of a waitpid.
+ */
+#define RR_FLIGHT_SEGMENTS 2
+
+typedef struct Snapshot{
+   Int  pid;
+   Int  resume_fd;    /* write end of its resume pipe */
+   Int  done_fd;      /* read end of its done pipe */
+   UInt segment;      /* that starts from it */
+}Snapshot;
+
+static Snapshot snaps[RR_FLIGHT_SEGMENTS];
+static Int  n_snaps = 0;
+static UInt cur_segment = 0;
+static Bool rotation_disabled = False;
+static Bool threads_warned = False;
+static Int  snaps_owner = 0;      /* the recording process */
+/* in the snapshot replaying: the write end of its done pipe */
+static Int  snap_done_fd = -1;
+
+typedef struct Checkpoint{
+   Int   pid;
+   Int   resume_fd;    /* write end of its resume pipe */
+   ULong event_no;     /* events replayed when it was taken */
+   ULong n_syscalls;   /* and syscalls */
+   ULong bbs_done;     /* and basic blocks */
+   ULong bbs_entered;  /* exactly, see VG_(get_bbs_entered) */
+}Checkpoint;
+
+/* A position in the replay: the number of basic blocks entered, and the
+   guest IP in the last one. ip is 0 at the top of the scheduler loop,
+   between two runs of generated code. */
+typedef struct RRStopPos{
+   ULong bbs;
+   Addr  ip;
+}RRStopPos;
+
+/* What a restarted checkpoint is asked to do */
+enum { RR_GO_FORWARD, RR_GO_SCAN, RR_GO_SEEK };
+
+/* sent through the resume pipe */
+typedef struct RRResume{
+   Int        what;         /* RR_GO_* */
+   ULong      stop_event;   /* RR_GO_FORWARD: stop in the gdbserver there */
+   Bool       step;         /* reverse-stepi rather than reverse-continue */
+   Int        hold_pid;     /* process keeping the gdb connection, or 0 */
+   RRStopPos  target;       /* where the scan or the seek stops */
+   GdbSession gdb;
+}RRResume;
+
+static Checkpoint ckpts[RR_MAX_CHECKPOINTS];
+static Int   n_ckpts = 0;
+static ULong next_syscalls = 0;     /* when the next checkpoint is due */
+static ULong next_bbs = 0;
+static Bool  ckpts_disabled = False;
+
+static Int   relay_pid = 0;
+static Int   relay_fds[2] = { -1, -1 };
+
+/* the reverse execution this process is part of, if any */
+static RRResume  rev;            /* rev.what is RR_GO_FORWARD otherwise */
+static Int       rev_ckpt;       /* checkpoint it was restarted from */
+static Bool      rev_found = False;
+static RRStopPos rev_last;       /* last hit found by the scan */
+static Addr      rev_break = 0;  /* breakpoint of our own at the target */
+
+/* the signals that end a sleeping checkpoint or the relay, instead of being
+   left pending forever by Valgrind's blocked mask */
+static const Int term_signals[] = { VKI_SIGINT, VKI_SIGTERM, VKI_SIGHUP };
+#define N_TERM_SIGNALS (sizeof(term_signals) / sizeof(term_signals[0]))
+
+static vki_sigaction_fromK_t saved_actions[N_TERM_SIGNALS];
+static vki_sigset_t saved_mask;
+
+static void make_killable(void)
+{
+   vki_sigaction_toK_t sa;
+   vki_sigset_t set;
+   Int i;
+
+   VG_(memset)(&sa, 0, sizeof(sa));
+   sa.ksa_handler = VKI_SIG_DFL;
+   VG_(sigemptyset)(&set);
+   for(i = 0; i < N_TERM_SIGNALS; i++){
+      VG_(sigaction)(term_signals[i], &sa, &saved_actions[i]);
+      VG_(sigaddset)(&set, term_signals[i]);
+   }
+   VG_(sigprocmask)(VKI_SIG_UNBLOCK, &set, &saved_mask);
+}
+
+static void undo_make_killable(void)
+{
+   vki_sigaction_toK_t sa;
+   Int i;
+
+   VG_(sigprocmask)(VKI_SIG_SETMASK, &saved_mask, NULL);
+   for(i = 0; i < N_TERM_SIGNALS; i++){
+      VG_(convert_sigaction_fromK_to_toK)(&saved_actions[i], &sa);
+      VG_(sigaction)(term_signals[i], &sa, NULL);
+   }
+}
+
+/* The relay: pass on the exit code of the replay. Never returns. */
+static void run_relay(void)
+{
+   Int code;
+
+   make_killable();
+   VG_(close)(relay_fds[1]);
+   if(VG_(read)(relay_fds[0], &code, sizeof(code)) != sizeof(code))
+      code = 1;   /* everybody is gone without a word */
+   VG_(exit)(code);
+}
+
+static void start_reverse(ThreadId tid, Int idx, const RRResume* r);
+
+/* Sleep until asked to restart, in the checkpoint process of ckpts[idx].
+   Returns in the new process that carries on with the replay. */
+static void sleep_as_checkpoint(ThreadId tid, Int idx, Int resume_rfd)
+{
+   RRResume r;
+   Int pid;
+
+   make_killable();
+   while(True){
+      if(VG_(read)(resume_rfd, &r, sizeof(r)) != sizeof(r))
+         VG_(exit)(0);  /* nobody can restart from here any more */
+
+      VG_(do_atfork_pre)(tid);
+      pid = VG_(fork)();
+      if(pid == 0)
+         break;
+      if(pid > 0)
+         VG_(do_atfork_parent)(tid);
+      else
+         VG_(message)(Vg_UserMsg, "Warning: can't restart from the checkpoint "
+                      "at event %llu\n", ckpts[idx].event_no);
+   }
+
+   VG_(do_atfork_child)(tid);
+   undo_make_killable();
+   VG_(close)(resume_rfd);
+   n_ckpts = idx + 1;
+
+   if(r.what != RR_GO_FORWARD){
+      start_reverse(tid, idx, &r);
+      return;
+   }
+   VG_(umsg)("REPLAY -- restarted from the checkpoint at event %llu\n",
+             ckpts[idx].event_no);
+   ML_(setStopEvent)(r.stop_event);
+   VG_(gdbserver_prerun_action)(tid);
+}
+
+static void take_checkpoint(ThreadId tid, ULong bbs_done)
+{
+   Checkpoint* c = &ckpts[n_ckpts];
+   Int fds[2];
+   Int pid;
+
+   if(relay_pid == 0){
+      if(VG_(pipe)(relay_fds) < 0) {
+         ckpts_disabled = True;
+         return;
+      }
+      /* out of the client's way: its opens run natively in replay */
+      relay_fds[0] = VG_(safe_fd)(relay_fds[0]);
+      relay_fds[1] = VG_(safe_fd)(relay_fds[1]);
+      relay_pid = VG_(getpid)();
+   }
+   if(VG_(pipe)(fds) < 0)
+      return;
+   fds[0] = VG_(safe_fd)(fds[0]);
+   fds[1] = VG_(safe_fd)(fds[1]);
+
+   c->resume_fd = fds[1];
+   c->event_no = ML_(currentEvent)();
+   c->n_syscalls = ML_(currentSyscall)();
+   c->bbs_done = bbs_done;
+   c->bbs_entered = VG_(get_bbs_entered)();
+
+   VG_(do_atfork_pre)(tid);
+   pid = VG_(fork)();
+   if(pid < 0){
+      VG_(close)(fds[0]);
+      VG_(close)(fds[1]);
+      return;
+   }
+
+   if(pid == 0){
+      VG_(do_atfork_child)(tid);
+      c->pid = VG_(getpid)();
+      n_ckpts++;
+      /* keep the write end, for whoever is restarted from here later */
+      sleep_as_checkpoint(tid, n_ckpts - 1, fds[0]);
+      return;
+   }
+
+   VG_(do_atfork_parent)(tid);
+   VG_(close)(fds[0]);
+   c->pid = pid;
+   n_ckpts++;
+}
+
+void ML_(maybeCheckpoint)(ThreadId tid, ULong bbs_done)
+{
+   Bool due = False;
+
+   /* a scan is thrown away, and so would be its checkpoints */
+   if(ckpts_disabled || rev.what == RR_GO_SCAN) return;
+   if(VG_(clo_rr_checkpoint_syscalls) > 0
+      && ML_(currentSyscall)() >= next_syscalls)
+      due = True;
+   if(VG_(clo_rr_checkpoint_bbs) > 0 && bbs_done >= next_bbs)
+      due = True;
+   if(!due) return;
+
+   /* a fork only takes the calling thread along: wait for a better time */
+   if(VG_(count_living_threads)() != 1) return;
+
+   if(n_ckpts == RR_MAX_CHECKPOINTS || !ML_(logIsMapped)()){
+      /* without the mapping, checkpoints would share the read offset
+         of the log */
+      VG_(message)(Vg_UserMsg, "Warning: %s, no more checkpoints are taken\n",
+                   n_ckpts == RR_MAX_CHECKPOINTS ? "too many checkpoints"
+                                                 : "the replay log can't be mapped");
+      ckpts_disabled = True;
+      return;
+   }
+
+   take_checkpoint(tid, bbs_done);
+   next_syscalls = ML_(currentSyscall)() + VG_(clo_rr_checkpoint_syscalls);
+   next_bbs = bbs_done + VG_(clo_rr_checkpoint_bbs);
+}
+
+/* kill the checkpoints from ckpts[k] on. Those this process forked are
+   reaped, for the relay not to keep them as zombies; waitpid fails at
+   once for the others, whose parents are gone or reap them. */
+static void kill_checkpoints(Int k)
+{
+   Int status;
+
+   while(n_ckpts > k){
+      n_ckpts--;
+      VG_(kill)(ckpts[n_ckpts].pid, VKI_SIGKILL);
+      (void)VG_(waitpid)(ckpts[n_ckpts].pid, &status, 0);
+   }
+}
+
+/* Restart from ckpts[k] with what r asks for. Returns False if the
+   checkpoint can't be told to. Otherwise, this process turns into the relay,
+   or with hold sleeps until it gets killed, or exits. */
+static Bool restart(Int k, const RRResume* r, Bool hold)
+{
+   if(VG_(write)(ckpts[k].resume_fd, r, sizeof(*r)) != sizeof(*r))
+      return False;
+   kill_checkpoints(k + 1);
+
+   VG_(message_flush)();
+   if(VG_(getpid)() == relay_pid)
+      run_relay();
+   if(hold){
+      make_killable();
+      while(True)
+         VG_(poll)(NULL, 0, -1);
+   }
+   VG_(exit)(0);
+   /*NOTREACHED*/
+   return True;
+}
+
+Bool ML_(restartFromCheckpoint)(ULong event_no)
+{
+   RRResume r;
+   Int i, k = -1;
+
+   /* ckpts[] is in replay order: take the last one not after event_no */
+   for(i = 0; i < n_ckpts && ckpts[i].event_no <= event_no; i++)
+      k = i;
+   if(k < 0) return False;
+
+   VG_(memset)(&r, 0, sizeof(r));
+   r.what = RR_GO_FORWARD;
+   r.stop_event = event_no;
+   return restart(k, &r, False);
+}
+
+static void current_pos(RRStopPos* pos)
+{
+   pos->bbs = VG_(get_bbs_entered)();
+   pos->ip = VG_(in_generated_code) ? VG_(get_IP)(VG_(get_running_tid)()) : 0;
+}
+
+/* True once pos is at or after target */
+static Bool reached(const RRStopPos* pos, const RRStopPos* target)
+{
+   /* at the top of the scheduler loop, the block counted last is over */
+   if(pos->ip == 0)
+      return pos->bbs >= target->bbs;
+   return pos->bbs > target->bbs
+          || (pos->bbs == target->bbs && pos->ip == target->ip);
+}
+
+/* In the process restarted from ckpts[idx] for a reverse execution */
+static void start_reverse(ThreadId tid, Int idx, const RRResume* r)
+{
+   rev = *r;
+   rev_ckpt = idx;
+   rev_found = False;
+   rev.gdb.stepping = rev.what == RR_GO_SCAN && rev.step;
+   VG_(gdbserver_adopt_session)(tid, &rev.gdb, rev.what == RR_GO_SEEK);
+   if(rev.what == RR_GO_SEEK && rev.hold_pid != 0)
+      VG_(kill)(rev.hold_pid, VKI_SIGKILL);
+
+   /* stop at the target even when gdb has no breakpoint there */
+   rev_break = 0;
+   if(rev.target.ip != 0 && !VG_(has_gdbserver_breakpoint)(rev.target.ip)){
+      VG_(gdbserver_point)(software_breakpoint, True, rev.target.ip, 1);
+      rev_break = rev.target.ip;
+   }
+
+   if(VG_(clo_verbosity) > 1)
+      VG_(umsg)("REPLAY -- reverse execution: %s from the checkpoint at event %llu\n",
+                rev.what == RR_GO_SCAN ? "scanning" : "seeking",
+                ckpts[idx].event_no);
+}
+
+/* The scan is over: seek to the last hit it found, or scan the interval
+   before if there is none. Doesn't return. */
+static void end_scan(void)
+{
+   RRResume r = rev;
+   Int k = rev_ckpt;
+
+   if(rev_found){
+      r.what = RR_GO_SEEK;
+      r.target = rev_last;
+   }else if(k > 0){
+      r.target.bbs = ckpts[k].bbs_entered;
+      r.target.ip = 0;
+      k--;
+   }else{
+      /* nothing since the first checkpoint, and there is no going further */
+      r.what = RR_GO_SEEK;
+      r.target.bbs = ckpts[0].bbs_entered;
+      r.target.ip = 0;
+      r.gdb.history_begin = True;
+   }
+   if(!restart(k, &r, False))
+      vg_assert2(0, "reverse execution: can't restart from the checkpoint "
+                 "at event %llu\n", ckpts[k].event_no);
+}
+
+/* The seek is at its target: gdb gets to see what follows */
+static void end_seek(void)
+{
+   if(rev_break != 0)
+      VG_(gdbserver_point)(software_breakpoint, False, rev_break, 1);
+   rev_break = 0;
+   rev.what = RR_GO_FORWARD;
+}
+
+void ML_(reverseResume)(ThreadId tid, Bool step)
+{
+   RRResume r;
+   Int i, k = -1;
+
+   VG_(memset)(&r, 0, sizeof(r));
+   current_pos(&r.target);
+   for(i = 0; i < n_ckpts && ckpts[i].bbs_entered < r.target.bbs; i++)
+      k = i;
+   if(k < 0) return;
+
+   if(!VG_(gdbserver_save_session)(&r.gdb)){
+      VG_(umsg)("Warning: too many break and watch points for reverse execution\n");
+      return;
+   }
+   r.what = RR_GO_SCAN;
+   r.step = step;
+   r.hold_pid = VG_(getpid)() == relay_pid ? 0 : VG_(getpid)();
+   restart(k, &r, True);
+}
+
+Bool ML_(reverseHideStop)(ThreadId tid, RRStopKind kind, Bool* resume_step)
+{
+   RRStopPos pos;
+
+   if(rev.what == RR_GO_FORWARD) return False;
+
+   current_pos(&pos);
+   if(kind != RRStop_Other && reached(&pos, &rev.target)){
+      if(rev.what == RR_GO_SCAN)
+         end_scan();
+      end_seek();
+      return False;
+   }
+
+   /* our own breakpoint at the target is not a hit */
+   if(rev.what == RR_GO_SCAN && kind != RRStop_Other
+      && (kind != RRStop_Breakpoint || pos.ip != rev_break)){
+      rev_found = True;
+      rev_last = pos;
+   }
+   *resume_step = rev.what == RR_GO_SCAN && rev.step;
+   return True;
+}
+
+void ML_(reverseAtTop)(ThreadId tid)
+{
+   RRStopPos pos;
+
+   if(rev.what == RR_GO_FORWARD) return;
+
+   current_pos(&pos);
+   if(!reached(&pos, &rev.target)) return;
+   if(rev.what == RR_GO_SCAN)
+      end_scan();
+   end_seek();
+   VG_(gdbserver)(tid);
+}
+
+/*************** flight recorder ***************/
+
+static void segment_name(HChar* name, UInt segment)
+{
+   const HChar* log_name = (const HChar*)VG_(clo_log_name_rr);
+
+   vg_assert(VG_(strlen)(log_name) + 12 <= VKI_PATH_MAX);
+   if(segment == 0)
+      VG_(strcpy)(name, log_name);
+   else
+      VG_(sprintf)(name, RR_SEGMENT_NAME, log_name, segment);
+}
+
+/* Sleep as the snapshot segment starts from, until woken up to replay the
+   segments from there. Returns in the replaying process. */
+static void sleep_as_snapshot(UInt segment, Int resume_rfd, Int done_wfd)
+{
+   UChar go;
+   Int me = VG_(getpid)();
+
+   if(VG_(write)(done_wfd, &me, sizeof(me)) != sizeof(me))
+      VG_(exit)(0);
+   make_killable();
+   if(VG_(read)(resume_rfd, &go, 1) != 1)
+      VG_(exit)(0);  /* the recording is over without a crash */
+   undo_make_killable();
+   VG_(close)(resume_rfd);
+   n_snaps = 0;
+   snap_done_fd = done_wfd;
+
+   VG_(clo_record_replay) = REPLAYONLY;
+   ML_(leaveProcessTree)();
+   ML_(replaySegments)(segment);
+   VG_(umsg)("REPLAY -- flight recorder: replaying from the start of "
+             "segment %u\n", segment);
+}
+
+/* wait for the snapshot i to be gone: it is not our child */
+static void wait_snapshot(Int i)
+{
+   Int pid;
+
+   while(VG_(read)(snaps[i].done_fd, &pid, sizeof(pid)) > 0)
+      ;
+   VG_(close)(snaps[i].done_fd);
+}
+
+/* kill the snapshots but the n oldest ones */
+static void kill_snapshots(Int n)
+{
+   while(n_snaps > n){
+      n_snaps--;
+      VG_(close)(snaps[n_snaps].resume_fd);
+      VG_(kill)(snaps[n_snaps].pid, VKI_SIGKILL);
+      wait_snapshot(n_snaps);
+   }
+}
+
+/* kill the snapshots of the segments before first, deleted */
+static void drop_snapshots_before(UInt first)
+{
+   Int i;
+
+   while(n_snaps > 0 && snaps[0].segment < first){
+      VG_(close)(snaps[0].resume_fd);
+      VG_(kill)(snaps[0].pid, VKI_SIGKILL);
+      wait_snapshot(0);
+      for(i = 0; i + 1 < n_snaps; i++)
+         snaps[i] = snaps[i + 1];
+      n_snaps--;
+   }
+}
+
+/* Start the next segment, with a snapshot to replay it from if asked to */
+static void rotate_log(ThreadId tid, Bool want_snapshot)
+{
+   HChar name[VKI_PATH_MAX];
+   HChar old[VKI_PATH_MAX];
+   UInt segment = cur_segment + 1;
+   SysRes sres;
+   Int fds[2], done[2];
+   Int pid = -1, status, i;
+   Bool snapshot = want_snapshot;
+
+   segment_name(name, segment);
+   sres = VG_(open)(name, VKI_O_CREAT|VKI_O_WRONLY|VKI_O_TRUNC,
+                    VKI_S_IRUSR|VKI_S_IWUSR);
+   if(sr_isError(sres)){
+      VG_(message)(Vg_UserMsg, "Warning: can't start flight recorder segment "
+                   "%s, the log goes on growing\n", name);
+      rotation_disabled = True;
+      return;
+   }
+   if(snapshot && VG_(pipe)(fds) < 0)
+      snapshot = False;
+   if(snapshot && VG_(pipe)(done) < 0){
+      VG_(close)(fds[0]);
+      VG_(close)(fds[1]);
+      snapshot = False;
+   }
+   if(snapshot){
+      /* out of the client's way */
+      fds[0] = VG_(safe_fd)(fds[0]);
+      fds[1] = VG_(safe_fd)(fds[1]);
+      done[0] = VG_(safe_fd)(done[0]);
+      done[1] = VG_(safe_fd)(done[1]);
+   }
+
+   /* the previous segment must be complete before the snapshot is taken */
+   ML_(finishLog)();
+
+   /* only the last RR_FLIGHT_SEGMENTS segments are kept, with their 
+      snapshots: the first segment has none, it starts with the process */
+   if(segment >= RR_FLIGHT_SEGMENTS){
+      segment_name(old, segment - RR_FLIGHT_SEGMENTS);
+      (void)VG_(unlink)(old);
+      drop_snapshots_before(segment + 1 - RR_FLIGHT_SEGMENTS);
+   }
+
+   if(snapshot){
+      VG_(do_atfork_pre)(tid);
+      pid = VG_(fork)();
+      if(pid == 0){
+         VG_(do_atfork_child)(tid);
+         /* the snapshot is the child of this one, which exits at once */
+         if(VG_(fork)() != 0)
+            VG_(exit)(0);
+         for(i = 0; i < n_snaps; i++){
+            VG_(close)(snaps[i].resume_fd);
+            VG_(close)(snaps[i].done_fd);
+         }
+         VG_(close)(fds[1]);
+         VG_(close)(done[0]);
+         VG_(close)(sr_Res(sres));
+         sleep_as_snapshot(segment, fds[0], done[1]);
+         return;
+      }
+      VG_(do_atfork_parent)(tid);
+      VG_(close)(fds[0]);
+      VG_(close)(done[1]);
+      if(pid > 0){
+         (void)VG_(waitpid)(pid, &status, 0);
+         /* the snapshot's pid, or EOF if it could not be forked */
+         if(VG_(read)(done[0], &pid, sizeof(pid)) != sizeof(pid))
+            pid = -1;
+      }
+   }
+
+   VG_(close)(ML_(log_fd_rr));
+   ML_(startLogSegment)(VG_(safe_fd)(sr_Res(sres)), segment);
+   VG_(fcntl)(ML_(log_fd_rr), VKI_F_SETFD, VKI_FD_CLOEXEC);
+   cur_segment = segment;
+   snaps_owner = VG_(getpid)();
+
+   if(pid < 0){
+      /* the segment can't be replayed from, but the disk use stays 
+         bounded */
+      if(snapshot){
+         VG_(close)(fds[1]);
+         VG_(close)(done[0]);
+      }
+      if(want_snapshot)
+         VG_(message)(Vg_UserMsg, "Warning: can't take the snapshot of flight "
+                      "recorder segment %u\n", segment);
+      return;
+   }
+   snaps[n_snaps].pid = pid;
+   snaps[n_snaps].resume_fd = fds[1];
+   snaps[n_snaps].done_fd = done[0];
+   snaps[n_snaps].segment = segment;
+   n_snaps++;
+}
+
+void ML_(maybeRotateLog)(ThreadId tid)
+{
+   Bool single;
+
+   if(VG_(clo_rr_flight_recorder) == 0 || rotation_disabled) return;
+   /* a forked client doesn't rotate the log of its parent */
+   if(snaps_owner != 0 && VG_(getpid)() != snaps_owner) return;
+   if(ML_(logSize)() < (ULong)VG_(clo_rr_flight_recorder) * 1024 * 1024 / 2)
+      return;
+   /* a fork only takes the calling thread along: the segment goes without
+      a snapshot while others are alive */
+   single = VG_(count_living_threads)() == 1;
+   if(!single && !threads_warned){
+      VG_(message)(Vg_UserMsg, "Warning: the flight recorder takes no "
+                   "snapshot while the client has several threads: a crash "
+                   "is only replayed from a segment started single "
+                   "threaded\n");
+      threads_warned = True;
+   }
+   rotate_log(tid, single);
+}
+
+void ML_(flightRecorderAtExit)(Bool crashed)
+{
+   UChar go = 1;
+
+   if(VG_(getpid)() != snaps_owner) return;
+   if(n_snaps == 0){
+      if(crashed)
+         VG_(message)(Vg_UserMsg, "Warning: no flight recorder segment kept "
+                      "has a snapshot, the crash can't be replayed\n");
+      return;
+   }
+   kill_snapshots(crashed ? 1 : 0);
+   if(n_snaps == 0) return;
+
+   /* the replay of the window runs to its end before we are gone */
+   VG_(message_flush)();
+   if(VG_(write)(snaps[0].resume_fd, &go, 1) == 1){
+      VG_(close)(snaps[0].resume_fd);
+      wait_snapshot(0);
+      n_snaps = 0;
+      return;
+   }
+   VG_(message)(Vg_UserMsg, "Warning: can't wake up the flight recorder "
+                "snapshot of segment %u\n", snaps[0].segment);
+   kill_snapshots(0);
+}
+
+void ML_(checkpointsAtFork)(void)
+{
+   Int i;
+
+   for(i = 0; i < n_ckpts; i++)
+      VG_(close)(ckpts[i].resume_fd);
+   n_ckpts = 0;
+   ckpts_disabled = True;
+   /* the exit code the relay waits for is the parent's */
+   if(relay_pid != 0){
+      VG_(close)(relay_fds[0]);
+      VG_(close)(relay_fds[1]);
+      relay_fds[0] = relay_fds[1] = -1;
+      relay_pid = 0;
+   }
+
+   /* the child rotates a log of its own, from its first segment */
+   for(i = 0; i < n_snaps; i++){
+      VG_(close)(snaps[i].resume_fd);
+      VG_(close)(snaps[i].done_fd);
+   }
+   n_snaps = 0;
+   /* the recording waits for the replay of the snapshot, not for this */
+   if(snap_done_fd != -1){
+      VG_(close)(snap_done_fd);
+      snap_done_fd = -1;
+   }
+   cur_segment = 0;
+   snaps_owner = 0;
+}
+
+void ML_(checkpointsAtExit)(Int exitcode)
+{
+   /* the scan ran past anything it could look for */
+   if(rev.what == RR_GO_SCAN)
+      end_scan();
+
+   kill_checkpoints(0);
+
+   if(relay_pid != 0 && VG_(getpid)() != relay_pid)
+      (void)VG_(write)(relay_fds[1], &exitcode, sizeof(exitcode));
+}
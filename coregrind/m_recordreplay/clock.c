@@ -0,0 +1,260 @@
+/*******************************************************************
+   This file is part of Valgrind, a dynamic binary instrumentation
+   framework.
+
+   Copyright (C) 2008
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+********************************************************************/
+
+/*
+ * clock.c --
+ *
+ *      The virtual clock: clock reads of the client served from the TSC,
+ *      without a syscall, and replayed from the TSC values logged.
+ */
+
+#include "pub_core_basics.h"
+#include "pub_core_vki.h"
+#include "pub_core_vkiscnums.h"
+#include "pub_core_libcbase.h"
+#include "pub_core_libcassert.h"
+#include "pub_core_syscall.h"
+#include "pub_core_aspacemgr.h"
+#include "pub_core_threadstate.h"
+#include "pub_core_recordreplay.h"
+#include "priv_recordreplay.h"
+
+/*
+ * Under Valgrind the client has no vDSO, and every clock read is a
+ * syscall, logged with its guest state, return value and payload. With
+ * --rr-virtual-clock=<ms>, time, gettimeofday and clock_gettime of
+ * CLOCK_REALTIME and CLOCK_MONOTONIC are served here instead, the way the
+ * vDSO does: CLOCK_MONOTONIC is extrapolated from the last sync with the
+ * kernel's clocks by the TSC ticks since, and CLOCK_REALTIME is that plus
+ * the offset between the two at the sync. A read only logs a CLOCK entry
+ * of the TSC, a few bytes once delta encoded.
+ *
+ * The rate of the TSC is calibrated between two syncs at least
+ * RR_CLOCK_MIN_CALIB apart. Until then, and once the extrapolation would
+ * go past --rr-virtual-clock ms of ticks, the read syncs: it asks the
+ * kernel for both clocks, and logs them. So the drift is bounded by the
+ * error on the rate over that many ms, and a client that sleeps gets the
+ * kernel's time when it wakes up. CLOCK_MONOTONIC never goes back: a
+ * read that comes before the last one served returns the last one again.
+ *
+ * Replay computes the same values from the TSCs and syncs it reads from
+ * the log, with the same arithmetic, whatever --rr-virtual-clock it runs
+ * with.
+ */
+#if defined(VGA_x86) || defined(VGA_amd64)
+#define RR_CLOCK_SHIFT        32
+/* the shortest calibration period, in ns */
+#define RR_CLOCK_MIN_CALIB    1000000ULL
+/* the longest one, for (ns << RR_CLOCK_SHIFT) not to overflow */
+#define RR_CLOCK_MAX_CALIB    (1ULL << 31)
+
+#define RR_NSEC_PER_SEC       1000000000ULL
+
+static struct{
+   Bool  synced;
+   /* mono = base_mono + ((tsc - base_tsc) * mult >> RR_CLOCK_SHIFT) */
+   ULong base_tsc;
+   ULong base_mono;
+   ULong mult;          /* 0 until calibrated */
+   Long  real_off;      /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+   /* record: ticks after base_tsc the clock syncs again */
+   ULong resync_ticks;
+   /* where the current calibration period started */
+   ULong calib_tsc;
+   ULong calib_mono;
+   ULong last_mono;     /* the last CLOCK_MONOTONIC served */
+}vclock;
+
+static ULong read_tsc(void)
+{
+   UInt eax, edx;
+
+   __asm__ __volatile__("rdtsc" : "=a" (eax), "=d" (edx));
+   return (((ULong)edx) << 32) | ((ULong)eax);
+}
+
+static ULong kernel_clock(Int clk)
+{
+   struct vki_timespec ts;
+   SysRes sres;
+
+   sres = VG_(do_syscall2)(__NR_clock_gettime, clk, (UWord)&ts);
+   vg_assert(!sr_isError(sres));
+   return (ULong)ts.tv_sec * RR_NSEC_PER_SEC + (ULong)ts.tv_nsec;
+}
+
+static Bool writable(UWord addr, SizeT len)
+{
+   return VG_(am_is_valid_for_client)((Addr)addr, len, VKI_PROT_WRITE);
+}
+
+/* True when the read can be served here; real tells which clock it reads */
+static Bool servable(UInt sysno, UWord arg1, UWord arg2, Bool* real)
+{
+   switch(sysno){
+#if defined(__NR_time)
+   case __NR_time:
+      *real = True;
+      return arg1 == 0 || writable(arg1, sizeof(vki_time_t));
+#endif
+   case __NR_gettimeofday:
+      /* the timezone is left to the kernel */
+      *real = True;
+      return arg2 == 0
+             && (arg1 == 0 || writable(arg1, sizeof(struct vki_timeval)));
+   case __NR_clock_gettime:
+      if(arg1 != VKI_CLOCK_REALTIME && arg1 != VKI_CLOCK_MONOTONIC)
+         return False;
+      *real = arg1 == VKI_CLOCK_REALTIME;
+      return writable(arg2, sizeof(struct vki_timespec));
+   default:
+      return False;
+   }
+}
+
+static Bool must_sync(ULong tsc)
+{
+   return vclock.mult == 0 || tsc < vclock.base_tsc
+          || tsc - vclock.base_tsc >= vclock.resync_ticks;
+}
+
+static void sync_clock(ULong tsc, RRClockSync* s)
+{
+   ULong ns;
+
+   if(!vclock.synced || tsc <= vclock.calib_tsc || s->mono < vclock.calib_mono){
+      /* the first sync, or the TSC went back: calibrate from here */
+      vclock.calib_tsc = tsc;
+      vclock.calib_mono = s->mono;
+   } else if(s->mono - vclock.calib_mono >= RR_CLOCK_MIN_CALIB){
+      ns = s->mono - vclock.calib_mono;
+      if(ns < RR_CLOCK_MAX_CALIB && (ns << RR_CLOCK_SHIFT) >= tsc - vclock.calib_tsc){
+         vclock.mult = (ns << RR_CLOCK_SHIFT) / (tsc - vclock.calib_tsc);
+         ns = (ULong)VG_(clo_rr_virtual_clock) * 1000000ULL;
+         vclock.resync_ticks = (ns << RR_CLOCK_SHIFT) / vclock.mult;
+      }
+      vclock.calib_tsc = tsc;
+      vclock.calib_mono = s->mono;
+   }
+   vclock.base_tsc = tsc;
+   vclock.base_mono = s->mono;
+   vclock.real_off = (Long)(s->real - s->mono);
+   vclock.synced = True;
+}
+
+/* CLOCK_MONOTONIC at tsc, in ns */
+static ULong mono_at(ULong tsc)
+{
+   ULong mono = vclock.base_mono;
+
+   if(vclock.mult > 0 && tsc > vclock.base_tsc)
+      mono += ((tsc - vclock.base_tsc) * vclock.mult) >> RR_CLOCK_SHIFT;
+   if(mono < vclock.last_mono)
+      mono = vclock.last_mono;
+   vclock.last_mono = mono;
+   return mono;
+}
+
+Bool ML_(clockRead)(ThreadId tid, UInt sysno, UWord arg1, UWord arg2,
+                    SysRes* res)
+{
+   LogEntry next, entry;
+   LogEntry* le = &entry;
+   RRClockSync sync;
+   Bool real;
+   ULong ns, secs;
+
+   if(VG_(clo_record_replay) == RECORDONLY){
+      if(VG_(clo_rr_virtual_clock) == 0 || !servable(sysno, arg1, arg2, &real))
+         return False;
+   } else if(VG_(clo_record_replay) == REPLAYONLY){
+      if(!ML_(peekLog)(&next) || next.type != CLOCK)
+         return False;
+      vg_assert2(servable(sysno, arg1, arg2, &real), "Log entry not expected. "
+                 "Clock read at syscall %u\n", sysno);
+   } else
+      return False;
+
+   le->type = CLOCK;
+   le->tid = tid;
+   if(VG_(clo_record_replay) == RECORDONLY){
+      le->u.clock.tsc = read_tsc();
+      le->u.clock.sync = must_sync(le->u.clock.tsc);
+      if(le->u.clock.sync){
+         sync.mono = kernel_clock(VKI_CLOCK_MONOTONIC);
+         sync.real = kernel_clock(VKI_CLOCK_REALTIME);
+      }
+   }
+   PROCESS_LOGENTRY;
+
+   if(le->u.clock.sync){
+      ULong tsc = le->u.clock.tsc;
+
+      le->type = DATA1;
+      le->u.data.len = sizeof(RRClockSync);
+      le->u.data.addr = &sync;
+      PROCESS_LOGENTRY;
+      sync_clock(tsc, &sync);
+      ns = mono_at(tsc);
+   } else
+      ns = mono_at(le->u.clock.tsc);
+   if(real)
+      ns += vclock.real_off;
+   secs = ns / RR_NSEC_PER_SEC;
+   ns = ns % RR_NSEC_PER_SEC;
+
+   switch(sysno){
+#if defined(__NR_time)
+   case __NR_time:
+      if(arg1 != 0)
+         *(vki_time_t*)arg1 = (vki_time_t)secs;
+      *res = VG_(mk_SysRes_Success)((UWord)secs);
+      break;
+#endif
+   case __NR_gettimeofday:
+      if(arg1 != 0){
+         ((struct vki_timeval*)arg1)->tv_sec = (vki_time_t)secs;
+         ((struct vki_timeval*)arg1)->tv_usec = (vki_suseconds_t)(ns / 1000);
+      }
+      *res = VG_(mk_SysRes_Success)(0);
+      break;
+   default: /* __NR_clock_gettime */
+      ((struct vki_timespec*)arg2)->tv_sec = (vki_time_t)secs;
+      ((struct vki_timespec*)arg2)->tv_nsec = (long)ns;
+      *res = VG_(mk_SysRes_Success)(0);
+      break;
+   }
+   return True;
+}
+
+#else  /* !(VGA_x86 || VGA_amd64) */
+
+/* no TSC to serve the reads from: they stay syscalls */
+Bool ML_(clockRead)(ThreadId tid, UInt sysno, UWord arg1, UWord arg2,
+                    SysRes* res)
+{
+   return False;
+}
+
+#endif
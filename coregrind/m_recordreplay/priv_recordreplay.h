@@ -48,7 +48,11 @@ typedef enum EntryType{
    INITIMG_CLSTK,
    INITIMG_MEMLAYOUT,
    DATA2, /* addr and len are both known before reading log entry */
-   DATA1  /* only len is known before */
+   DATA1, /* only len is known before */
+   THREAD_EXIT, /* only with RR_LOG_FLAG_THREAD_EXITS */
+#if defined(VGA_x86) || defined(VGA_amd64)
+   CLOCK        /* a clock read served by the virtual clock, see clock.c */
+#endif
 }EntryType;
 
 typedef struct LogEntry{
@@ -81,6 +85,8 @@ typedef struct LogEntry{
       struct{           /* ACQUIRE_BIGLOCK */
          UInt tid;
          UInt type;
+         /* RR_LOG_FLAG_SWITCHES: the ordinal of the release it follows */
+         ULong release_no;
       }acquire_biglock;
       struct{           /* RELEASE_BIGLOCK */
          Char who[16];
@@ -90,6 +96,11 @@ typedef struct LogEntry{
          UInt eax;
          UInt edx;
       }rdtsc;
+      struct{           /* CLOCK */
+         ULong tsc;
+         /* the clock was synced: a DATA1 RRClockSync follows */
+         UInt sync;
+      }clock;
 #endif
       /* TODO: refine the following two */
       struct{
@@ -111,18 +122,358 @@ typedef struct LogEntry{
    }u;
 }LogEntry;
 
+/* for acquire_biglock.type */
+#define CALLER_NORMAL 0
+#define CALLER_SIGVKILL 1 
+#define CALLER_ASYNCHANDLER 2
+#define CALLER_UNKNOWN -1
+
 /* maximum length of client command line we support */
 #define MAX_CMDLINE_LENGTH 4096
 
+/*
+ * On-disk log format.
+ *
+ * A log starts with a LogFileHeader. Logs written before the header existed
+ * (RR_LOG_VERSION_LEGACY) are a plain sequence of LogEntry structs, each one
+ * followed by its DATA1/DATA2/CLIENT_CMDLINE payload. They can still be 
+ * replayed.
+ *
+ * From RR_LOG_VERSION_COMPACT on, every entry is encoded as:
+ *    - a tag byte: the EntryType in RR_TAG_TYPE_MASK, plus RR_TAG_* flags;
+ *    - the tid as a zigzag delta against the tid of the previous entry,
+ *      unless RR_TAG_SAME_TID is set;
+ *    - the type specific fields as LEB128 varints (see record.c/encode_entry);
+ *    - the payload, as before.
+ */
+#define RR_LOG_MAGIC            "VGRR"
+#define RR_LOG_VERSION_LEGACY   1
+#define RR_LOG_VERSION_COMPACT  2
+#define RR_LOG_VERSION          RR_LOG_VERSION_COMPACT
+
+typedef struct LogFileHeader{
+   Char  magic[4];  /* RR_LOG_MAGIC */
+   UChar version;   /* RR_LOG_VERSION_* */
+   UChar flags;     /* RR_LOG_FLAG_*: all 8 bits are taken, the next 
+                       feature flag goes in reserved */
+   UChar segment;   /* not 0 for a flight recorder segment but the first */
+   UChar reserved;  /* 0: replay refuses a log with any bit set here */
+}LogFileHeader;
+
+/*
+ * With --rr-flight-recorder=<MB>, the log is cut into segments of half 
+ * that size, and only the last two are kept. The first one is the log 
+ * file, and the nth after it is RR_SEGMENT_NAME of the log file and n. 
+ * Each segment is a log of its own, with its LogFileHeader and its index,
+ * but one other than the first starts where the process was when its 
+ * snapshot was taken (see checkpoint.c), and can only be replayed from 
+ * there. LogFileHeader.segment is then n, modulo 256.
+ */
+#define RR_SEGMENT_NAME       "%s.%u"
+
+/*
+ * With RR_LOG_FLAG_LZO, the entry stream following the LogFileHeader is cut
+ * into blocks of at most RR_LOG_BLOCK_SIZE bytes, and each one is stored as
+ * a LogFrameHeader plus its LZO1X compressed bytes (or the bytes as they are
+ * when they don't compress). A frame with len == 0 ends the stream, and is
+ * followed by the block index: one LogBlockIndexEntry per frame.
+ */
+#define RR_LOG_FLAG_LZO       0x01
+
+/*
+ * With RR_LOG_FLAG_SWITCHES, the schedule only holds the switches: there are
+ * no RELEASE_BIGLOCK entries, and an ACQUIRE_BIGLOCK entry is only written
+ * when the BigLock goes to another thread than the one that released it, or
+ * to a sigvgkill handler. Its release_no tells after which of the BigLock 
+ * releases, counted from 1 over the whole process, the switch happened; it
+ * is encoded as the delta against the previous one.
+ */
+#define RR_LOG_FLAG_SWITCHES  0x02
+
+/*
+ * With RR_LOG_FLAG_THREAD_EXITS, a THREAD_EXIT entry of the exiting thread
+ * is written when it gives up the BigLock for the last time, so replay 
+ * checks that threads exit in the recorded order.
+ */
+#define RR_LOG_FLAG_THREAD_EXITS  0x04
+
+/*
+ * With RR_LOG_FLAG_AUTO_SYSCALLS, syscalls without a record_replay wrapper
+ * are logged as well: their SYSCALL_RET, then one DATA2 entry for each 
+ * POST_MEM_WRITE of their post handler, in order.
+ */
+#define RR_LOG_FLAG_AUTO_SYSCALLS 0x08
+
+/*
+ * The RRCheckState the guest state snapshots were written with. 
+ * RR_CHECK_STATE_FULL (0) for older logs: a DATA1 entry of the whole 
+ * VexGuestArchState. With RR_CHECK_STATE_DELTA it is a DATA1 entry of the 
+ * number of changed words, followed by one of (word index, XOR) pairs. 
+ * With RR_CHECK_STATE_HASH it is a DATA1 entry of a 64-bit hash of the 
+ * checked registers, followed by their delta, in the same two entries.
+ */
+#define RR_LOG_FLAG_STATE_SHIFT   4
+#define RR_LOG_FLAG_STATE_MASK    0x30
+
+/*
+ * With RR_LOG_FLAG_STORE, a DATA2 entry with RR_TAG_AUX has no payload in 
+ * the log: its bytes are at the offset that follows its length, in the 
+ * side store, the file named like the log plus RR_STORE_SUFFIX. Each 
+ * distinct payload of at least --rr-dedupe bytes is in the store once.
+ * With --rr-map-reads=yes, each payload of at least RR_MAP_MIN_LEN bytes 
+ * is there too, at an offset with the same page offset as its buffer, so
+ * that replay can map the store pages over the buffer instead of copying.
+ */
+#define RR_LOG_FLAG_STORE         0x40
+#define RR_STORE_SUFFIX           ".store"
+#define RR_MAP_MIN_LEN            (64 * 1024)
+
+/*
+ * With RR_LOG_FLAG_FILE_REFS, a read() of at least RR_FILE_REF_MIN_LEN 
+ * bytes logs a DATA1 entry of an RRFileRef first. If isRef, the bytes are
+ * not logged: replay reads them again from the same file, which must be
+ * unchanged. Otherwise a DATA2 entry of the bytes follows, as for a 
+ * shorter read.
+ */
+#define RR_LOG_FLAG_FILE_REFS     0x80
+#define RR_FILE_REF_MIN_LEN       4096
+
+/*
+ * A file referred to that the client opens for writing, truncates or 
+ * renames another file over is first copied, as it was when read, to the
+ * file named RR_FILE_COPY_NAME of the log, its dev and its inode. Replay
+ * reads the references to it from the copy.
+ */
+#define RR_FILE_COPY_NAME         "%s.ref.%llu.%llu"
+
+typedef struct RRFileRef{
+   ULong dev;
+   ULong ino;
+   Long  size;
+   ULong mtime;
+   ULong mtime_nsec;
+   ULong off;       /* where the bytes were read */
+   ULong hash;      /* ML_(hashBytes) of them */
+   UInt  isRef;
+   UInt  pad;
+}RRFileRef;
+
+/*
+ * Every process of a recorded process tree has a log of its own (see 
+ * tree.c). The root's is the log file; that of any other process is 
+ * RR_TREE_LOG_NAME of the root's log, the pid of the process and the 
+ * number of the fork or exec it started with. The counters of the joint
+ * schedule are in the file named like the root's log plus RR_TREE_SUFFIX.
+ *
+ * A fork or an exec logs a DATA1 entry of an RRProcessEvent, with its 
+ * number in the joint schedule. For a fork, the parent logs it after the 
+ * fork, with the pid of the child, or minus the errno if it failed. For an
+ * exec, pid is that of the process.
+ */
+#define RR_TREE_LOG_NAME          "%s.%d.%u"
+#define RR_TREE_SUFFIX            ".tree"
+
+#define RR_PROC_FORK              1
+#define RR_PROC_EXEC              2   /* the new image is recorded as well */
+#define RR_PROC_EXEC_OUT          3   /* it is not (--trace-children) */
+
+typedef struct RRProcessEvent{
+   UInt seq;
+   UInt kind;       /* RR_PROC_* */
+   Int  pid;
+   UInt pad;
+}RRProcessEvent;
+
+/*
+ * With --rr-virtual-clock, time, gettimeofday and the CLOCK_REALTIME and
+ * CLOCK_MONOTONIC clock_gettime don't enter the kernel (see clock.c). Each
+ * one logs a CLOCK entry with the TSC it was served at, encoded as the 
+ * delta against the previous RDTSC or CLOCK. When the clock was synced 
+ * with the kernel's for it, a DATA1 RRClockSync of the kernel's clocks
+ * follows. Replay serves a clock read the same way when the log has a 
+ * CLOCK entry for it.
+ */
+typedef struct RRClockSync{
+   ULong mono;      /* CLOCK_MONOTONIC, in ns */
+   ULong real;      /* CLOCK_REALTIME, in ns */
+}RRClockSync;
+
+#define RR_LOG_BLOCK_SIZE     (1024 * 1024)
+/* worst case expansion of lzo1x_1_compress */
+#define RR_LZO_BOUND(len)     ((len) + (len) / 16 + 64 + 3)
+
+typedef struct LogFrameHeader{
+   UInt len;        /* uncompressed length */
+   UInt zlen;       /* stored length, == len when stored uncompressed */
+}LogFrameHeader;
+
+typedef struct LogBlockIndexEntry{
+   ULong file_off;  /* of the LogFrameHeader */
+   ULong stream_off;/* of the first uncompressed byte of the block */
+}LogBlockIndexEntry;
+
+/*
+ * Events are numbered from 0 in log order, every entry being an event. Every
+ * RR_EVENT_INDEX_EVERY events or RR_EVENT_INDEX_BYTES bytes of the entry
+ * stream, whichever comes first, the recorder notes where it is in an
+ * EventIndexEntry, along with the syscall count of every thread in the
+ * EventIndexThread table. Stream offsets count the uncompressed entry 
+ * stream, from the end of the LogFileHeader.
+ *
+ * A log finished by ML_(finishLog) ends with the block index (only with
+ * RR_LOG_FLAG_LZO), the event index, the thread table and then a 
+ * LogIndexTrailer, which locates them. A log without the trailer (the
+ * recording was killed, or it's an old one) can only be replayed.
+ */
+#define RR_EVENT_INDEX_EVERY  4096
+#define RR_EVENT_INDEX_BYTES  (1024 * 1024)
+
+typedef struct EventIndexEntry{
+   ULong stream_off;   /* of the entry of event event_no */
+   ULong event_no;
+   ULong n_syscalls;   /* SYSCALL_ARGS entries before it */
+   ULong dispatch_ctr; /* last SYSCALL_DISPATCH_CTR counter before it */
+   UInt  threads_off;  /* of its first EventIndexThread, in the table */
+   UInt  n_threads;
+}EventIndexEntry;
+
+typedef struct EventIndexThread{
+   UInt tid;
+   UInt n_syscalls;    /* SYSCALL_ARGS entries of tid before the event */
+}EventIndexThread;
+
+#define RR_LOG_INDEX_MAGIC    "RRIX"
+
+typedef struct LogIndexTrailer{
+   ULong blocks_off;   /* of the first LogBlockIndexEntry */
+   ULong events_off;   /* of the first EventIndexEntry */
+   ULong threads_off;  /* of the first EventIndexThread */
+   ULong n_events;     /* in the whole log */
+   UInt  n_blocks;
+   UInt  n_event_index;
+   UInt  n_threads;
+   Char  magic[4];     /* RR_LOG_INDEX_MAGIC */
+}LogIndexTrailer;
+
+#define RR_TAG_TYPE_MASK  0x1f
+/* Type specific: SYSCALL_ARGS: syscall_args.tid differs from tid and follows;
+   SYSCALL_DISPATCH_CTR: isBefore; ACQUIRE_BIGLOCK: type is not CALLER_NORMAL
+   and follows; RELEASE_BIGLOCK: "who" is an index into the "who" dictionary;
+   DATA2: the payload is in the side store, at the offset that follows;
+   CLOCK: clock.sync. */
+#define RR_TAG_AUX        0x40
+/* tid is the same as the previous entry's, and is not encoded */
+#define RR_TAG_SAME_TID   0x80
+
+/* maximum bytes of an encoded entry, payload excluded */
+#define RR_MAX_ENCODED_ENTRY  64
+/* distinct RELEASE_BIGLOCK "who" strings remembered by the codec */
+#define RR_WHO_DICT_SIZE      32
+
+/* State shared by consecutive entries. The encoder in record.c and the
+   decoder in replay.c must update it in exactly the same way. */
+typedef struct LogCodecState{
+   UInt  prev_tid;
+   ULong prev_tsc;         /* last RDTSC or CLOCK */
+   UWord prev_ctr;         /* last SYSCALL_DISPATCH_CTR counter */
+   ULong prev_release;     /* last ACQUIRE_BIGLOCK release_no */
+   UInt  n_who;
+   Char  who[RR_WHO_DICT_SIZE][16];
+}LogCodecState;
+
+#define RR_ZIGZAG(v)    ((((ULong)(v)) << 1) ^ (ULong)(((Long)(v)) >> 63))
+#define RR_UNZIGZAG(v)  ((Long)(((ULong)(v)) >> 1) ^ -(Long)((v) & 1))
+
 extern Int ML_(log_fd_rr); /* the fd for replay log */
 
 /*
  * Module-private global functions
  */
 
+extern void ML_(writeLogHeader)(void);
+extern void ML_(readLogHeader)(void);
+/* read the rest of the replay log through a mapping of the file */
+extern void ML_(mapLog)(void);
 extern void ML_(writeToLog)(LogEntry* entry);
 extern void ML_(readFromLog)(LogEntry* entry);
+/* the entry readFromLog will return next, without its payload; False at 
+   the end of an indexed log */
+extern Bool ML_(peekLog)(LogEntry* next);
+/* True when the replay log was written with RR_LOG_FLAG_SWITCHES */
+extern Bool ML_(logHasSwitchesOnly)(void);
+/* True when the replay log was written with RR_LOG_FLAG_THREAD_EXITS */
+extern Bool ML_(logHasThreadExits)(void);
+/* True when the replay log was written with RR_LOG_FLAG_AUTO_SYSCALLS */
+extern Bool ML_(logHasAutoSyscalls)(void);
+/* how the guest state snapshots of the replay log are written */
+extern RRCheckState ML_(logCheckState)(void);
+/* True when the replay log was written with RR_LOG_FLAG_FILE_REFS */
+extern Bool ML_(logHasFileRefs)(void);
+/* 64-bit FNV-1a of len bytes, eight at a time */
+extern ULong ML_(hashBytes)(const void* p, SizeT len);
+/* write out whatever is buffered for the record log */
+extern void ML_(flushLog) (void);
+/* flush the record log and write what ends it */
+extern void ML_(finishLog) (void);
+/* bytes of the record log so far, the buffered ones included */
+extern ULong ML_(logSize) (void);
+/* after ML_(finishLog), or in a forked child: go on recording to fd, as 
+   the segment-th segment */
+extern void ML_(startLogSegment) (Int fd, UInt segment);
+/* replay the flight recorder segments from the segment-th one on */
+extern void ML_(replaySegments) (UInt segment);
+/* in a forked child: go on replaying the log name */
+extern void ML_(replayLog) (const HChar* name);
+/* start/stop the helper thread that writes the record log, if enabled */
+extern void ML_(startLogWriter) (void);
+extern void ML_(stopLogWriter) (void);
+/* flush the record log and wait until all of it is in the file */
+extern void ML_(drainLog) (void);
+/* in a forked child: the writer thread didn't come along */
+extern void ML_(forgetLogWriter) (void);
+/* flush and fsync the record log, as --rr-sync asks for */
 extern void ML_(rrsync) (void);
+/* pick up the indexes at the end of the replay log, if there are any */
+extern void ML_(readLogIndex) (void);
+/* number of the next event readFromLog will return */
+extern ULong ML_(currentEvent) (void);
+/* number of SYSCALL_ARGS entries read so far */
+extern ULong ML_(currentSyscall) (void);
+/* True when the replay log is read through a mapping, see ML_(mapLog) */
+extern Bool ML_(logIsMapped) (void);
+/* total number of events in the replay log, 0 when it has no index */
+extern ULong ML_(numEvents) (void);
+/* lookups in the event index, see VG_(RR_FindEvent) and VG_(RR_FindSyscall) */
+extern Bool ML_(findEvent) (ULong event_no, RRLogPos* pos);
+extern Bool ML_(findSyscall) (ThreadId tid, ULong nth, RRLogPos* pos);
+/* stop in the gdbserver once event_no events are replayed, as --rr-seek */
+extern void ML_(setStopEvent) (ULong event_no);
+
+/* checkpoint.c: see VG_(RR_Checkpoint) and VG_(RR_RestartFromCheckpoint) */
+extern void ML_(maybeCheckpoint) (ThreadId tid, ULong bbs_done);
+extern Bool ML_(restartFromCheckpoint) (ULong event_no);
+/* kill the checkpoints, and pass exitcode on to the relay if there is one */
+extern void ML_(checkpointsAtExit) (Int exitcode);
+/* --rr-flight-recorder: see VG_(RR_Checkpoint) and VG_(RR_Exit) */
+extern void ML_(maybeRotateLog) (ThreadId tid);
+extern void ML_(flightRecorderAtExit) (Bool crashed);
+/* in a forked child: the checkpoints and snapshots are the parent's */
+extern void ML_(checkpointsAtFork) (void);
+/* tree.c: see VG_(RR_PreFork), VG_(RR_PostFork) and VG_(RR_Exec) */
+extern void ML_(setupLogName) (void);
+extern void ML_(preFork) (ThreadId tid);
+extern void ML_(postFork) (ThreadId tid, SysRes* res);
+extern HChar** ML_(exec) (ThreadId tid, Bool traced);
+/* a flight recorder replay doesn't wait for the rest of the tree */
+extern void ML_(leaveProcessTree) (void);
+/* clock.c: see VG_(RR_Syscall_Clock) */
+extern Bool ML_(clockRead) (ThreadId tid, UInt sysno, UWord arg1, UWord arg2,
+                            SysRes* res);
+/* reverse execution: see VG_(RR_ReverseResume) and VG_(RR_HideGdbStop) */
+extern void ML_(reverseResume) (ThreadId tid, Bool step);
+extern Bool ML_(reverseHideStop) (ThreadId tid, RRStopKind kind, Bool* resume_step);
+/* at the top of the scheduler loop: ends a scan or seek past its target */
+extern void ML_(reverseAtTop) (ThreadId tid);
 
 #define PROCESS_LOGENTRY                                \
    do{                                                  \
@@ -33,32 +33,830 @@
 #define _PRIV_RECORDREPLAY_H_
 
 #include "pub_core_basics.h"
+#include "pub_core_libcbase.h"
 #include "pub_core_libcfile.h"
 #include "pub_core_libcassert.h"
+#include "pub_core_libcproc.h"  /* for VG_(read_millisecond_timer) */
+#include "pub_core_mallocfree.h"
+#include "pub_core_xarray.h"
 #include "pub_core_syscall.h"
-#include "pub_core_vkiscnums.h" /* for __NR_fsync */
+#include "pub_core_vkiscnums.h" /* for __NR_fsync, __NR_futex */
+#include "pub_core_libcsignal.h"
+#include "pub_core_libcprint.h"
+#include "pub_core_threadstate.h" /* for VG_N_THREADS */
+#include "pub_core_hashtable.h"
 
 #include "pub_core_recordreplay.h"
 #include "priv_recordreplay.h"
 
+#include "m_debuginfo/minilzo.h"
+
+#define RR_WRITER_CLONE_FLAGS (VKI_CLONE_VM | VKI_CLONE_FS | VKI_CLONE_FILES \
+                               | VKI_CLONE_SIGHAND | VKI_CLONE_THREAD       \
+                               | VKI_CLONE_SYSVSEM)
+
+/* the clone helpers m_syswrap starts client threads with */
+#if defined(VGP_x86_linux)
+extern Int  do_syscall_clone_x86_linux   ( Word (*fn)(void *), void* stack, 
+                                           Int flags, void* arg,
+                                           Int* child_tid, Int* parent_tid,
+                                           vki_modify_ldt_t * );
+#elif defined(VGP_amd64_linux)
+extern Long do_syscall_clone_amd64_linux ( Word (*fn)(void *), void* stack, 
+                                           Long flags, void* arg,
+                                           Long* child_tid, Long* parent_tid,
+                                           vki_modify_ldt_t * );
+#endif
+
+/* 
+ * Log entries are staged in log_buf and written out in large sequential
+ * chunks, instead of one VG_(write) for every entry and every payload.
+ * The bytes reaching the log file are exactly the same as before, so replay
+ * doesn't care whether they were buffered or not.
+ *
+ * With --rr-compress=lzo, every chunk is a block of the entry stream that is
+ * compressed and framed on its own (see LogFrameHeader), and big payloads go
+ * through log_buf as well, so that no block is bigger than RR_LOG_BLOCK_SIZE.
+ *
+ * log_buf is static because the first entries (INITIMG_MEMLAYOUT) are logged
+ * before the aspacemgr and the malloc arenas are ready.
+ */
+static UChar log_buf[RR_LOG_BLOCK_SIZE];
+static UInt  log_buf_used = 0;
+/* VG_(read_millisecond_timer) at the last fsync, for --rr-sync=periodic */
+static UInt  last_sync_ms = 0;
+
+/* bytes written to the log file, and bytes of the entry stream framed so far */
+static ULong file_off = 0;
+static ULong stream_off = 0;
+
+/* for --rr-compress=lzo */
+static UChar zbuf[RR_LZO_BOUND(RR_LOG_BLOCK_SIZE)];
+static ULong lzo_wrkmem[LZO1X_1_MEM_COMPRESS / sizeof(ULong) + 1];
+/* one LogBlockIndexEntry per frame written */
+static XArray* block_index = NULL;
+
+/* for the event index, see EventIndexEntry */
+static ULong stream_len = 0;         /* bytes of the entry stream so far */
+static ULong n_events = 0;
+static ULong n_syscalls = 0;
+static UInt  n_syscalls_of[VG_N_THREADS];
+static ULong indexed_event = 0;      /* event_no of the last EventIndexEntry */
+static ULong indexed_stream = 0;     /* and its stream_off */
+static XArray* event_index = NULL;   /* of EventIndexEntry */
+static XArray* event_threads = NULL; /* of EventIndexThread */
+
+static void add_event_index_entry(void);
+
+/* 
+ * The side store for --rr-dedupe and --rr-map-reads. With --rr-dedupe, 
+ * store_table holds every distinct payload written so far, told apart by
+ * a 64-bit hash of its bytes and its length. The key of a node is the 
+ * hash folded to a word; nodes of different payloads may share a key, 
+ * VG_(HT_lookup) only finds the first one, so a payload whose key is taken
+ * by another one is just stored again.
+ */
+typedef struct StoreNode{
+   struct StoreNode* next;
+   UWord key;
+   ULong hash;
+   UWord len;
+   ULong off;       /* in the store */
+}StoreNode;
+
+static VgHashTable store_table = NULL;
+static Int   store_fd = -1;
+static ULong store_size = 0;
+
+/* 
+ * With --rr-async-write=yes, what would be written to the log file is 
+ * handed to a helper thread instead, so that the client thread holding the
+ * BigLock doesn't wait for the disk. The BigLock holder is the only producer
+ * and fills the slot at ring_head; the writer consumes the slot at ring_tail.
+ * Each of them only ever writes its own index, and they sleep on the other
+ * one's index with a futex when the ring is full or empty.
+ */
+#define RR_WRITER_SLOTS       4
+#define RR_WRITER_STACK_SIZE  (64 * 1024)
+
+typedef struct WriterSlot{
+   UInt  len;
+   Bool  sync;  /* fsync the log after writing the slot */
+   Bool  stop;  /* the writer exits after writing the slot */
+   UChar buf[sizeof(LogFrameHeader) + RR_LZO_BOUND(RR_LOG_BLOCK_SIZE)];
+}WriterSlot;
+
+static WriterSlot ring[RR_WRITER_SLOTS];
+static volatile UInt ring_head = 0;  /* slots handed over so far */
+static volatile UInt ring_tail = 0;  /* slots written out so far */
+static Bool writer_running = False;
+static UChar writer_stack[RR_WRITER_STACK_SIZE] __attribute__((aligned(16)));
+
+static void write_to_fd(const void* buf, UInt len)
+{
+   const UChar* p = buf;
+   Int ret;
+
+   while(len > 0) {
+      ret = VG_(write)(ML_(log_fd_rr), p, len);
+      vg_assert2(ret > 0, "Error in writeToLog.\n");
+      p += ret;
+      len -= ret;
+   }
+}
+
+/* sleep as long as *addr is still val */
+static void futex_wait(volatile UInt* addr, UInt val)
+{
+   SysRes sres;
+
+   sres = VG_(do_syscall3)(__NR_futex, (UWord)addr,
+                           VKI_FUTEX_WAIT | VKI_FUTEX_PRIVATE_FLAG, val);
+   vg_assert(!sr_isError(sres) || sr_Err(sres) == VKI_EAGAIN
+             || sr_Err(sres) == VKI_EINTR);
+}
+
+static void futex_wake(volatile UInt* addr)
+{
+   (void)VG_(do_syscall3)(__NR_futex, (UWord)addr,
+                          VKI_FUTEX_WAKE | VKI_FUTEX_PRIVATE_FLAG, 1);
+}
+
+/* back-pressure: wait until the writer has freed the slot at ring_head */
+static void wait_for_slot(void)
+{
+   UInt tail;
+
+   while((tail = ring_tail) + RR_WRITER_SLOTS == ring_head)
+      futex_wait(&ring_tail, tail);
+   __sync_synchronize();
+}
+
+/* hand the slot at ring_head over to the writer */
+static void submit_slot(Bool sync, Bool stop)
+{
+   WriterSlot* s;
+
+   wait_for_slot();
+   s = &ring[ring_head % RR_WRITER_SLOTS];
+   s->sync = sync;
+   s->stop = stop;
+   __sync_synchronize();
+   ring_head++;
+   futex_wake(&ring_head);
+}
+
+/* wait until everything handed over has been written */
+static void drain_ring(void)
+{
+   UInt tail;
+
+   while((tail = ring_tail) != ring_head)
+      futex_wait(&ring_tail, tail);
+   __sync_synchronize();
+}
+
+static Word log_writer(void* arg)
+{
+   WriterSlot* s;
+   UInt tail = 0;
+   Bool stop;
+
+   do {
+      while(ring_head == tail)
+         futex_wait(&ring_head, tail);
+      __sync_synchronize();
+
+      s = &ring[tail % RR_WRITER_SLOTS];
+      write_to_fd(s->buf, s->len);
+      if(s->sync)
+         (void)VG_(do_syscall1)(__NR_fsync, ML_(log_fd_rr));
+      stop = s->stop;
+      s->len = 0;
+
+      __sync_synchronize();
+      ring_tail = ++tail;
+      futex_wake(&ring_tail);
+   } while(!stop);
+
+   return 0;
+}
+
+/* everything written to the log goes through here */
+static void write_fully(const void* buf, UInt len)
+{
+   WriterSlot* s;
+
+   file_off += len;
+   if(!writer_running) {
+      write_to_fd(buf, len);
+      return;
+   }
+
+   wait_for_slot();
+   s = &ring[ring_head % RR_WRITER_SLOTS];
+   vg_assert(s->len + len <= sizeof(s->buf));
+   VG_(memcpy)(&s->buf[s->len], buf, len);
+   s->len += len;
+}
+
+/* compress one block of the entry stream and write it out as a frame */
+static void write_frame(const UChar* buf, UInt len)
+{
+   LogFrameHeader fh;
+   LogBlockIndexEntry ie;
+   lzo_uint zlen = sizeof(zbuf);
+   Int rc;
+
+   vg_assert(len > 0 && len <= RR_LOG_BLOCK_SIZE);
+   rc = lzo1x_1_compress(buf, len, zbuf, &zlen, lzo_wrkmem);
+   vg_assert2(rc == LZO_E_OK, "LZO compression of the log failed: %d\n", rc);
+
+   if(block_index == NULL)
+      block_index = VG_(newXA)(VG_(malloc), "rr.write_frame.1", VG_(free),
+                               sizeof(LogBlockIndexEntry));
+   ie.file_off = file_off;
+   ie.stream_off = stream_off;
+   VG_(addToXA)(block_index, &ie);
+   stream_off += len;
+
+   fh.len = len;
+   if(zlen < len){
+      fh.zlen = zlen;
+      write_fully(&fh, sizeof(fh));
+      write_fully(zbuf, zlen);
+   } else {
+      fh.zlen = len;
+      write_fully(&fh, sizeof(fh));
+      write_fully(buf, len);
+   }
+}
+
+static void append_to_log(const void* buf, UInt len)
+{
+   const UChar* p = buf;
+   UInt n;
+
+   stream_len += len;
+   if(log_buf_used + len > RR_LOG_BLOCK_SIZE) {
+      /* a payload that doesn't fit the buffer anyway goes out directly */
+      if(len >= RR_LOG_BLOCK_SIZE && VG_(clo_rr_compress) == RR_COMPRESS_NONE
+         && !writer_running) {
+         ML_(flushLog)();
+         write_fully(buf, len);
+         return;
+      }
+      while(log_buf_used + len > RR_LOG_BLOCK_SIZE) {
+         n = RR_LOG_BLOCK_SIZE - log_buf_used;
+         VG_(memcpy)(&log_buf[log_buf_used], p, n);
+         log_buf_used += n;
+         p += n;
+         len -= n;
+         ML_(flushLog)();
+      }
+   }
+   VG_(memcpy)(&log_buf[log_buf_used], p, len);
+   log_buf_used += len;
+}
+
+/* write out log_buf, and fsync the log if sync */
+static void flush_block(Bool sync)
+{
+   if(log_buf_used > 0) {
+      if(VG_(clo_rr_compress) == RR_COMPRESS_LZO)
+         write_frame(log_buf, log_buf_used);
+      else
+         write_fully(log_buf, log_buf_used);
+      log_buf_used = 0;
+   }
+
+   /* the entries being synced may refer to payloads in the store */
+   if(sync && store_fd != -1)
+      (void)VG_(do_syscall1)(__NR_fsync, store_fd);
+
+   if(writer_running) {
+      if(sync || ring[ring_head % RR_WRITER_SLOTS].len > 0)
+         submit_slot(sync, False);
+   } else if(sync) {
+      (void)VG_(do_syscall1)(__NR_fsync, ML_(log_fd_rr));
+   }
+}
+
+void ML_(flushLog)(void)
+{
+   if(VG_(clo_record_replay) != RECORDONLY) return;
+   flush_block(False);
+}
+
+void ML_(startLogWriter)(void)
+{
+#if defined(VGP_x86_linux) || defined(VGP_amd64_linux)
+   vki_sigset_t blockall, savedmask;
+   SysRes res;
+
+   if(VG_(clo_record_replay) != RECORDONLY || writer_running) return;
+
+   /* the writer must never get a signal meant for the client */
+   VG_(sigfillset)(&blockall);
+   VG_(sigprocmask)(VKI_SIG_SETMASK, &blockall, &savedmask);
+#  if defined(VGP_x86_linux)
+   res = VG_(mk_SysRes_x86_linux)(
+            do_syscall_clone_x86_linux(log_writer, 
+                                       &writer_stack[RR_WRITER_STACK_SIZE],
+                                       RR_WRITER_CLONE_FLAGS, NULL, 
+                                       NULL, NULL, NULL));
+#  else
+   res = VG_(mk_SysRes_amd64_linux)(
+            do_syscall_clone_amd64_linux(log_writer, 
+                                         &writer_stack[RR_WRITER_STACK_SIZE],
+                                         RR_WRITER_CLONE_FLAGS, NULL, 
+                                         NULL, NULL, NULL));
+#  endif
+   VG_(sigprocmask)(VKI_SIG_SETMASK, &savedmask, NULL);
+
+   /* not fatal: the log is then written synchronously as before */
+   if(sr_isError(res))
+      VG_(message)(Vg_UserMsg, "Warning: can't start the record log writer "
+                   "thread (error %ld), writing the log synchronously\n", 
+                   sr_Err(res));
+   else
+      writer_running = True;
+#endif
+}
+
+void ML_(stopLogWriter)(void)
+{
+   if(!writer_running) return;
+   flush_block(False);
+   submit_slot(False, True);
+   drain_ring();
+   writer_running = False;
+}
+
+void ML_(drainLog)(void)
+{
+   if(VG_(clo_record_replay) != RECORDONLY) return;
+   flush_block(False);
+   if(writer_running)
+      drain_ring();
+}
+
+void ML_(forgetLogWriter)(void)
+{
+   /* the ring is empty after ML_(drainLog), nothing is lost */
+   vg_assert(ring_head == ring_tail);
+   writer_running = False;
+}
+
+/* write out all the elements of xa, returning how many there were */
+static UInt write_XA(XArray* xa, UInt elem_size)
+{
+   UInt n = xa ? VG_(sizeXA)(xa) : 0;
+
+   if(n > 0)
+      write_fully(VG_(indexXA)(xa, 0), n * elem_size);
+   return n;
+}
+
+void ML_(finishLog)(void)
+{
+   LogFrameHeader fh;
+   LogIndexTrailer tr;
+
+   if(VG_(clo_record_replay) != RECORDONLY) return;
+   ML_(stopLogWriter)();
+   flush_block(False);
+
+   /* the last index entry has the totals */
+   if(event_index == NULL || indexed_event != n_events)
+      add_event_index_entry();
+
+   VG_(memset)(&tr, 0, sizeof(tr));
+   if(VG_(clo_rr_compress) == RR_COMPRESS_LZO) {
+      fh.len = fh.zlen = 0;
+      write_fully(&fh, sizeof(fh));
+      tr.blocks_off = file_off;
+      tr.n_blocks = write_XA(block_index, sizeof(LogBlockIndexEntry));
+   }
+
+   tr.events_off = file_off;
+   tr.n_event_index = write_XA(event_index, sizeof(EventIndexEntry));
+   tr.threads_off = file_off;
+   tr.n_threads = write_XA(event_threads, sizeof(EventIndexThread));
+   tr.n_events = n_events;
+   VG_(memcpy)(tr.magic, RR_LOG_INDEX_MAGIC, 4);
+   write_fully(&tr, sizeof(tr));
+}
+
+/* Called at every BigLock release. Whether the log is pushed to the disk
+   here depends on --rr-sync. */
 void ML_(rrsync)(void)
 {
-   (void)VG_(do_syscall1)(__NR_fsync, ML_(log_fd_rr)); 
+   UInt now;
+
+   switch(VG_(clo_rr_sync)) {
+      case RR_SYNC_NONE:
+         return;
+
+      case RR_SYNC_PERIODIC:
+         now = VG_(read_millisecond_timer)();
+         if(now - last_sync_ms < VG_(clo_rr_sync_interval))
+            return;
+         last_sync_ms = now;
+         break;
+
+      case RR_SYNC_EVERY_SWITCH:
+         break;
+
+      default:
+         vg_assert(0);
+   }
+
+   flush_block(True);
+   /* the writer would fsync it later: wait for it, the same as if the 
+      client thread did the fsync itself */
+   if(VG_(clo_rr_sync) == RR_SYNC_EVERY_SWITCH && writer_running)
+      drain_ring();
+}
+
+/*************** side store of payloads ***************/
+
+static void open_store(void)
+{
+   const HChar* log_name = (const HChar*)VG_(clo_log_name_rr);
+   HChar name[VKI_PATH_MAX];
+   SysRes sres;
+
+   vg_assert(VG_(strlen)(log_name) + sizeof(RR_STORE_SUFFIX) <= VKI_PATH_MAX);
+   VG_(sprintf)(name, "%s%s", log_name, RR_STORE_SUFFIX);
+   /* read back by same_in_store */
+   sres = VG_(open)(name, VKI_O_CREAT|VKI_O_RDWR|VKI_O_TRUNC,
+                    VKI_S_IRUSR|VKI_S_IWUSR);
+   vg_assert2(!sr_isError(sres), "Can't create the record store '%s' (%s)\n",
+              name, VG_(strerror)(sr_Err(sres)));
+   store_fd = VG_(safe_fd)(sr_Res(sres));
+   VG_(fcntl)(store_fd, VKI_F_SETFD, VKI_FD_CLOEXEC);
+   store_table = VG_(HT_construct)("rr.store");
+}
+
+static void write_store(const UChar* p, UWord len)
+{
+   Int ret;
+
+   for(; len > 0; p += ret, len -= ret) {
+      ret = VG_(write)(store_fd, p, len);
+      vg_assert2(ret > 0, "Failed to write the record store\n");
+      store_size += ret;
+   }
+}
+
+/* Are the len bytes at off in the store the same as the ones at addr? */
+static Bool same_in_store(ULong off, const void* addr, UWord len)
+{
+   UChar buf[VKI_PAGE_SIZE];
+   const UChar* p = addr;
+   SysRes sres;
+   UWord n;
+
+   /* VG_(pread) can't reach it */
+   if((ULong)(OffT)(off + len) != off + len)
+      return False;
+   for(; len > 0; off += n, p += n, len -= n) {
+      n = len < sizeof(buf) ? len : sizeof(buf);
+      sres = VG_(pread)(store_fd, buf, n, (OffT)off);
+      if(sr_isError(sres) || sr_Res(sres) != n || VG_(memcmp)(buf, p, n) != 0)
+         return False;
+   }
+   return True;
+}
+
+/* Should the DATA2 payload of len bytes go to the store? */
+static Bool to_store(UWord len)
+{
+   return (VG_(clo_rr_dedupe) > 0 && len >= VG_(clo_rr_dedupe))
+          || (VG_(clo_rr_map_reads) && len >= RR_MAP_MIN_LEN);
+}
+
+/* where the len bytes at addr are in the store, writing them there first
+   unless the same bytes already are: the hash only finds the candidate,
+   its bytes are compared before it is reused */
+static ULong store_payload(const void* addr, UWord len)
+{
+   static const UChar zeros[VKI_PAGE_SIZE];
+   Bool dedupe = VG_(clo_rr_dedupe) > 0 && len >= VG_(clo_rr_dedupe);
+   Bool align = VG_(clo_rr_map_reads) && len >= RR_MAP_MIN_LEN;
+   ULong hash = 0;
+   UWord key = 0;
+   StoreNode* node;
+   ULong off;
+
+   if(store_fd == -1)
+      open_store();
+   if(dedupe){
+      hash = ML_(hashBytes)(addr, len);
+      key = (UWord)(hash ^ (hash >> 32));
+      node = VG_(HT_lookup)(store_table, key);
+      /* a copy that can't be mapped over this buffer does not do */
+      if(node != NULL && node->hash == hash && node->len == len
+         && (!align || (node->off & (VKI_PAGE_SIZE-1)) 
+                       == ((Addr)addr & (VKI_PAGE_SIZE-1)))
+         && same_in_store(node->off, addr, len))
+         return node->off;
+   }
+
+   if(align)
+      write_store(zeros, ((Addr)addr - store_size) & (VKI_PAGE_SIZE-1));
+   off = store_size;
+   write_store(addr, len);
+
+   if(dedupe){
+      node = VG_(malloc)("rr.store.node", sizeof(StoreNode));
+      node->key = key;
+      node->hash = hash;
+      node->len = len;
+      node->off = off;
+      VG_(HT_add_node)(store_table, node);
+   }
+   return off;
+}
+
+/*************** compact encoding of log entries ***************/
+
+static LogCodecState enc;
+
+static UChar* put_uleb(UChar* p, ULong v)
+{
+   do {
+      UChar b = v & 0x7f;
+      v >>= 7;
+      *p++ = v ? (b | 0x80) : b;
+   } while(v);
+   return p;
+}
+
+static UChar* put_sleb(UChar* p, Long v)
+{
+   return put_uleb(p, RR_ZIGZAG(v));
+}
+
+/* encode the header of entry into buf, return the length; a DATA2 payload
+   is referred to at *store_off in the store, unless store_off is NULL */
+static UInt encode_entry(LogEntry* entry, ULong* store_off, UChar* buf)
+{
+   UChar* tag = &buf[0];
+   UChar* p = &buf[1];
+
+   *tag = entry->type;
+   vg_assert((*tag & RR_TAG_TYPE_MASK) == entry->type);
+
+   if(entry->tid == enc.prev_tid)
+      *tag |= RR_TAG_SAME_TID;
+   else
+      p = put_sleb(p, (Long)entry->tid - (Long)enc.prev_tid);
+   enc.prev_tid = entry->tid;
+
+   switch(entry->type){
+      case CLIENT_CMDLINE:
+         p = put_uleb(p, entry->u.client_cmdline.len);
+         break;
+
+      case SYSCALL_ARGS:
+         p = put_uleb(p, entry->u.syscall_args.sysno);
+         if(entry->u.syscall_args.tid != entry->tid){
+            *tag |= RR_TAG_AUX;
+            p = put_uleb(p, entry->u.syscall_args.tid);
+         }
+         break;
+
+      case SYSCALL_RET:
+         /* error returns are small negative numbers */
+         p = put_sleb(p, (Long)entry->u.syscall_ret);
+         break;
+
+      case SYSCALL_DISPATCH_CTR:
+         /* the counter after a syscall is mostly the one before it */
+         if(entry->u.syscall_dispatch_ctr.isBefore)
+            *tag |= RR_TAG_AUX;
+         p = put_sleb(p, (Long)entry->u.syscall_dispatch_ctr.counter - (Long)enc.prev_ctr);
+         enc.prev_ctr = entry->u.syscall_dispatch_ctr.counter;
+         break;
+
+      case THREAD_CREATE:
+         p = put_uleb(p, entry->u.thread_create.vg_tid);
+         p = put_uleb(p, entry->u.thread_create.lwpid);
+         break;
+
+      case THREAD_EXIT:
+         /* the exiting thread is the entry's tid */
+         break;
+
+      case ACQUIRE_BIGLOCK:
+         p = put_uleb(p, entry->u.acquire_biglock.tid);
+         p = put_uleb(p, entry->u.acquire_biglock.release_no - enc.prev_release);
+         enc.prev_release = entry->u.acquire_biglock.release_no;
+         if(entry->u.acquire_biglock.type != CALLER_NORMAL){
+            *tag |= RR_TAG_AUX;
+            p = put_uleb(p, entry->u.acquire_biglock.type);
+         }
+         break;
+
+      case RELEASE_BIGLOCK: {
+         /* there are only a handful of different callers, send an index 
+            for the ones already seen */
+         UInt i, len;
+         for(i = 0; i < enc.n_who; i++)
+            if(VG_(memcmp)(enc.who[i], entry->u.release_biglock.who, 16) == 0)
+               break;
+         if(i < enc.n_who){
+            *tag |= RR_TAG_AUX;
+            p = put_uleb(p, i);
+            break;
+         }
+         if(enc.n_who < RR_WHO_DICT_SIZE){
+            VG_(memcpy)(enc.who[enc.n_who], entry->u.release_biglock.who, 16);
+            enc.n_who++;
+         }
+         for(len = 0; len < 16 && entry->u.release_biglock.who[len] != 0; len++)
+            ;
+         p = put_uleb(p, len);
+         VG_(memcpy)(p, entry->u.release_biglock.who, len);
+         p += len;
+         break;
+      }
+
+#if defined(VGA_x86) || defined(VGA_amd64)
+      case RDTSC: {
+         ULong tsc = (((ULong)entry->u.rdtsc.edx) << 32) | entry->u.rdtsc.eax;
+         p = put_sleb(p, (Long)(tsc - enc.prev_tsc));
+         enc.prev_tsc = tsc;
+         break;
+      }
+
+      case CLOCK:
+         if(entry->u.clock.sync)
+            *tag |= RR_TAG_AUX;
+         p = put_sleb(p, (Long)(entry->u.clock.tsc - enc.prev_tsc));
+         enc.prev_tsc = entry->u.clock.tsc;
+         break;
+#endif
+
+      case INITIMG_CLSTK:
+         p = put_uleb(p, entry->u.initimg_clstk.stksz);
+         p = put_uleb(p, entry->u.initimg_clstk.auxv_addr);
+         break;
+
+      case INITIMG_MEMLAYOUT:
+         p = put_uleb(p, entry->u.initimg_memlayout.vstart);
+         p = put_uleb(p, entry->u.initimg_memlayout.clstk_top);
+         break;
+
+      case DATA1:
+      case DATA2:
+         /* the address is known again in replay, only the length matters */
+         p = put_uleb(p, entry->u.data.len);
+         if(store_off != NULL){
+            *tag |= RR_TAG_AUX;
+            p = put_uleb(p, *store_off);
+         }
+         break;
+
+      default:
+         vg_assert2(0, "bad log entry\n");
+   }
+
+   vg_assert(p - buf <= RR_MAX_ENCODED_ENTRY);
+   return p - buf;
+}
+
+static void write_log_header(UInt segment)
+{
+   LogFileHeader hdr;
+
+   VG_(memset)(&hdr, 0, sizeof(hdr));
+   VG_(memcpy)(hdr.magic, RR_LOG_MAGIC, 4);
+   hdr.version = RR_LOG_VERSION;
+   hdr.segment = segment;
+   hdr.flags = RR_LOG_FLAG_SWITCHES | RR_LOG_FLAG_THREAD_EXITS 
+               | RR_LOG_FLAG_AUTO_SYSCALLS;
+   if(VG_(clo_rr_compress) == RR_COMPRESS_LZO)
+      hdr.flags |= RR_LOG_FLAG_LZO;
+   if(VG_(clo_rr_dedupe) > 0 || VG_(clo_rr_map_reads))
+      hdr.flags |= RR_LOG_FLAG_STORE;
+   if(VG_(clo_rr_file_refs))
+      hdr.flags |= RR_LOG_FLAG_FILE_REFS;
+   hdr.flags |= VG_(clo_rr_check_state) << RR_LOG_FLAG_STATE_SHIFT;
+   /* the header itself is never compressed */
+   write_fully(&hdr, sizeof(hdr));
+
+   VG_(memset)(&enc, 0, sizeof(enc));
+}
+
+void ML_(writeLogHeader)(void)
+{
+   if(VG_(clo_record_replay) != RECORDONLY) return;
+   write_log_header(0);
+}
+
+ULong ML_(logSize)(void)
+{
+   return file_off + log_buf_used;
+}
+
+void ML_(startLogSegment)(Int fd, UInt segment)
+{
+   vg_assert(VG_(clo_record_replay) == RECORDONLY);
+   vg_assert(log_buf_used == 0 && !writer_running);
+
+   ML_(log_fd_rr) = fd;
+   file_off = stream_off = stream_len = 0;
+   if(block_index != NULL) {
+      VG_(deleteXA)(block_index);
+      block_index = NULL;
+   }
+   if(event_index != NULL) {
+      VG_(deleteXA)(event_index);
+      VG_(deleteXA)(event_threads);
+      event_index = event_threads = NULL;
+   }
+   n_events = n_syscalls = 0;
+   VG_(memset)(n_syscalls_of, 0, sizeof(n_syscalls_of));
+   indexed_event = indexed_stream = 0;
+   /* a forked child has a store of its own, named after its log */
+   if(store_fd != -1) {
+      VG_(close)(store_fd);
+      VG_(HT_destruct)(store_table, VG_(free));
+      store_fd = -1;
+      store_table = NULL;
+      store_size = 0;
+   }
+
+   write_log_header(segment);
+   if(VG_(clo_rr_async_write))
+      ML_(startLogWriter)();
+}
+
+/* note down where the next event (number n_events) is */
+static void add_event_index_entry(void)
+{
+   EventIndexEntry ie;
+   EventIndexThread it;
+   Int i;
+
+   if(event_index == NULL) {
+      event_index = VG_(newXA)(VG_(malloc), "rr.add_event_index_entry.1", 
+                               VG_(free), sizeof(EventIndexEntry));
+      event_threads = VG_(newXA)(VG_(malloc), "rr.add_event_index_entry.2", 
+                                 VG_(free), sizeof(EventIndexThread));
+   }
+
+   ie.stream_off = stream_len;
+   ie.event_no = n_events;
+   ie.n_syscalls = n_syscalls;
+   ie.dispatch_ctr = enc.prev_ctr;
+   ie.threads_off = VG_(sizeXA)(event_threads);
+   ie.n_threads = 0;
+   for(i = 0; i < VG_N_THREADS; i++){
+      if(n_syscalls_of[i] == 0) continue;
+      it.tid = i;
+      it.n_syscalls = n_syscalls_of[i];
+      VG_(addToXA)(event_threads, &it);
+      ie.n_threads++;
+   }
+   VG_(addToXA)(event_index, &ie);
+
+   indexed_event = n_events;
+   indexed_stream = stream_len;
 }
 
 void ML_(writeToLog)(LogEntry* entry)
 {
-   UInt ret;
+   UChar buf[RR_MAX_ENCODED_ENTRY];
+   ULong store_off;
 
    if(VG_(clo_record_replay) != RECORDONLY) return;
-   ret = VG_(write)(ML_(log_fd_rr), entry, sizeof(LogEntry));
-   vg_assert2(ret == sizeof(LogEntry), "Error in writeToLog.\n");
+
+   if(n_events - indexed_event >= RR_EVENT_INDEX_EVERY
+      || stream_len - indexed_stream >= RR_EVENT_INDEX_BYTES)
+      add_event_index_entry();
+   n_events++;
+   if(entry->type == SYSCALL_ARGS){
+      n_syscalls++;
+      vg_assert(entry->tid < VG_N_THREADS);
+      n_syscalls_of[entry->tid]++;
+   }
+
+   if(entry->type == DATA2 && to_store(entry->u.data.len)){
+      store_off = store_payload(entry->u.data.addr, entry->u.data.len);
+      append_to_log(buf, encode_entry(entry, &store_off, buf));
+      return;
+   }
+   append_to_log(buf, encode_entry(entry, NULL, buf));
 
    if((entry->type == DATA1 || entry->type == DATA2) && entry->u.data.len > 0)
-      VG_(write)(ML_(log_fd_rr), entry->u.data.addr, entry->u.data.len);
+      append_to_log(entry->u.data.addr, entry->u.data.len);
    else if(entry->type == CLIENT_CMDLINE){
       UInt len = entry->u.client_cmdline.len;
-      VG_(write)(ML_(log_fd_rr), entry->u.client_cmdline.addr, len);
+      append_to_log(entry->u.client_cmdline.addr, len);
    }
 }
 
@@ -43,6 +43,7 @@
 #include "pub_core_vki.h"
 #include "pub_core_options.h"
 #include "pub_core_threadstate.h" 
+#include "pub_core_scheduler.h" /* for VG_(replay_yield) */
 #include "pub_core_libcproc.h" /* for VG_(gettid) */
 #include "pub_core_machine.h"  /* for VG_(get_SP) */
 #include "pub_core_stacks.h"   /* for VG_(unknown_SP_update) */
@@ -50,6 +51,10 @@
 #include "pub_core_initimg.h"
 #include "pub_core_recordreplay.h"
 #include "pub_core_vkiscnums.h" /* for __NR_wait4 */
+#include "pub_core_transtab.h"  /* for VG_(discard_translations) */
+#include "pub_core_tooliface.h" /* for VG_TRACK */
+#include "pub_core_hashtable.h"
+#include "pub_core_aspacemgr.h" /* for VG_(am_is_valid_for_client) */
 //#include "pub_core_stacktrace.h"    // For VG_(get_and_pp_StackTrace)()
 
 #include "priv_recordreplay.h"
@@ -57,6 +62,21 @@
 /* Global variables */
 RRState VG_(clo_record_replay) = UNINITIALIZED; 
 Char* VG_(clo_log_name_rr) = "_temp_rr_.log";
+RRSyncPolicy VG_(clo_rr_sync) = RR_SYNC_PERIODIC;
+UInt VG_(clo_rr_sync_interval) = 1000; /* in milli-seconds */
+RRCompress VG_(clo_rr_compress) = RR_COMPRESS_NONE;
+RRCheckState VG_(clo_rr_check_state) = RR_CHECK_STATE_FULL;
+UInt VG_(clo_rr_dedupe) = 0;
+Bool VG_(clo_rr_map_reads) = False;
+Bool VG_(clo_rr_file_refs) = False;
+UInt VG_(clo_rr_flight_recorder) = 0; /* in MB */
+const HChar* VG_(clo_rr_tree) = NULL;
+UInt VG_(clo_rr_virtual_clock) = 0; /* in milli-seconds */
+Bool VG_(clo_rr_async_write) = True;
+ULong VG_(clo_rr_seek) = 0;
+ULong VG_(clo_rr_checkpoint_syscalls) = 0;
+ULong VG_(clo_rr_checkpoint_bbs) = 0;
+ULong VG_(clo_rr_fast_forward_to) = 0;
 Int ML_(log_fd_rr) = -1; //file descriptor of VG_(clo_log_name_rr)
 
 /*
@@ -71,15 +91,14 @@ typedef struct NextToSchedule{
    UInt tid;
    UInt type;
 }NextToSchedule;
-/* for NextToSchedule.type */
-#define CALLER_NORMAL 0
-#define CALLER_SIGVKILL 1 
-#define CALLER_ASYNCHANDLER 2
-#define CALLER_UNKNOWN -1
+/* for NextToSchedule.type, see CALLER_* in priv_recordreplay.h */
 
 /* maximum length of client command line we support */
 #define MAX_CMDLINE_LENGTH 4096
 
+/* how long to wait in milli-seconds for the OS kernel to finish a thread exit */
+#define RR_THREAD_EXIT_TIMEOUT 1000
+
 typedef struct RRThreadState{
    /* The following two are for thread id mapping. Meaningful only in replay */ 
    unsigned long tid_recorded;
@@ -101,15 +120,59 @@ typedef struct RRThreadState{
 static Char* client_cmdline = NULL;
 static volatile NextToSchedule nextSchedule;
 static volatile RRThreadState threads_rr[VG_N_THREADS]; 
+/* 
+ * Replay: hashed maps from recorded and from kernel thread ids to the index 
+ * of the thread in threads_rr, VG_INVALID_THREADID in an empty slot. Open 
+ * addressing with linear probing, and never more than half full.
+ */
+#define TID_MAP_SIZE (2 * VG_N_THREADS + 1)
+static ThreadId tid_by_recorded[TID_MAP_SIZE];
+static ThreadId tid_by_kernel[TID_MAP_SIZE];
 static volatile unsigned long exiting_thread;
+/* the BigLock releases so far, and the thread that did the last one */
+static ULong num_releases = 0;
+static ThreadId last_released = VG_INVALID_THREADID;
 static UInt num_guest_state_mismatch = 0; // to remember how many guest registers mismatched
+/* VG_(RR_SeekReached) is True when stop_event events are replayed */
+static Bool stop_pending = False;
+static ULong stop_event = 0;
+/* VG_(RR_FastForwarding) is True until --rr-fast-forward-to is reached */
+static Bool fast_forwarding = False;
+/* 
+ * Per thread, the guest state of its previous snapshot with 
+ * RR_CHECK_STATE_DELTA, or its checked registers with RR_CHECK_STATE_HASH:
+ * the recorded ones, in record and in replay.
+ */
+static VexGuestArchState* prev_guest_state[VG_N_THREADS];
+static UInt* prev_checked_regs[VG_N_THREADS];
+/* threads whose POST_MEM_WRITEs are the side effects of an unwrapped syscall */
+static Bool capturing_mem_writes[VG_N_THREADS];
+/* 
+ * record, --rr-file-refs: the regular files read so far, or opened for
+ * writing, by inode, as they were then. A file that is no longer so is 
+ * "changed", and is not referred to any more; neither is a file the
+ * client may write to.
+ */
+typedef struct RRFile{
+   struct RRFile* next;
+   UWord key;              /* the inode */
+   ULong dev;
+   Long  size;
+   ULong mtime;
+   ULong mtime_nsec;
+   Bool  changed;
+   Bool  referred;         /* by the log */
+   Bool  written;          /* the client may have modified it */
+   Bool  copied;           /* to RR_FILE_COPY_NAME, before that */
+   HChar* name;
+}RRFile;
+static VgHashTable rr_files = NULL;
 
 /*
- * XXX: This prototype is not included in any header files.
- * Only used by VG_(RR_Thread_Acquire). If OS schedules a wrong thread to run, 
- * VG_(RR_Thread_Acquire) calls it to yield.
+ * If OS schedules a wrong thread to run, VG_(RR_Thread_Acquire) calls 
+ * VG_(replay_yield) to sleep until VG_(RR_Thread_Release) hands the 
+ * BigLock over to it with VG_(replay_handoff).
  */
-extern void VG_(replay_yield) (ThreadId tid);
 
 /* Local fucntion prototypes */
 /* Setup record/replay arguments: VG_(clo_record_replay), VG_(clo_log_name_rr), and ML_(log_fd_rr). */
@@ -118,8 +181,27 @@ static void setupRRArgs(Int argc, HChar** argv);
 static void check_VexGuestArchState(VexGuestArchState* runtimeVex, VexGuestArchState* recordedVex);
 /* Record guest registers in record; check them in replay */
 static void RR_VexGuestArchState(VexGuestArchState* runtimeVex);
+static void canonical_VexGuestArchState(VexGuestArchState* dst, VexGuestArchState* src);
+static UInt checked_VexGuestArchState(VexGuestArchState* vex, UInt* regs);
+static UInt num_checked_regs(void);
+static void log_words_delta(ThreadId tid, UInt* now_w, UInt* prev_w, UInt n_words);
+static void RR_VexGuestArchState_hash(ThreadId tid, VexGuestArchState* runtimeVex);
+static void RR_VexGuestArchState_delta(ThreadId tid, VexGuestArchState* runtimeVex);
+static VexGuestArchState* prev_VexGuestArchState(ThreadId tid);
 /* wait for the completion of thread "exiting_thread" */
 static void wait_thread_exits();
+/* replay: the hashed thread id maps */
+static void tid_map_add(ThreadId* map, Bool by_kernel, ThreadId tid);
+static void tid_map_remove(ThreadId* map, Bool by_kernel, ThreadId tid);
+/* write out the buffered record log before a fork, so the child doesn't write it again */
+static void flush_log_before_fork(ThreadId tid);
+/* the child of a fork has no log writer thread */
+static void forget_log_writer_in_child(ThreadId tid);
+/* --rr-file-refs */
+static void make_file_ref(RRFileRef* ref, Int fd, void* buf, SizeT len);
+static void read_file_ref(RRFileRef* ref, Int fd, void* buf, SizeT len);
+static void check_file_refs(void);
+static void modify_file(Int dirfd, const HChar* path);
 
 /*********** Implementation of record/replay APIs ****************************/
 
@@ -135,7 +217,7 @@ static void wait_thread_exits();
  *       None 
  *
  * Side effects:
- *       None
+ *       In record, starts the log writer thread unless --rr-async-write=no.
  *
  *----------------------------------------------------------------------------
  */
@@ -163,6 +245,54 @@ VG_(RR_Init)(Int argc, HChar** argv, HChar** p_toolname)
 
    nextSchedule.tid = VG_INVALID_THREADID;
    nextSchedule.type = CALLER_UNKNOWN;
+
+   if(VG_(clo_record_replay) == RECORDONLY){
+      VG_(atfork)(flush_log_before_fork, NULL, forget_log_writer_in_child);
+      if(VG_(clo_rr_async_write))
+         ML_(startLogWriter)();
+   }
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_PostAspacemInit) --
+ *
+ *       Second stage of the initialization, for whatever needs the address 
+ *       space manager. Called in m_main.c right after VG_(am_startup).
+ *
+ * Results:
+ *       None 
+ *
+ * Side effects:
+ *       In replay, the log is read from a mapping of the file from now on,
+ *       and its event index is loaded.
+ *
+ *----------------------------------------------------------------------------
+ */
+void 
+VG_(RR_PostAspacemInit)(void)
+{
+   if(VG_(clo_record_replay) != REPLAYONLY)
+      return;
+
+   ML_(mapLog)();
+   ML_(readLogIndex)();
+
+   if(VG_(clo_rr_seek) > 0 && ML_(numEvents)() > 0 
+      && VG_(clo_rr_seek) > ML_(numEvents)()) {
+      VG_(fmsg_bad_option)("--rr-seek=", 
+         "The replay log only has %llu events.\n", ML_(numEvents)());
+   }
+   if(VG_(clo_rr_seek) > 0)
+      ML_(setStopEvent)(VG_(clo_rr_seek));
+
+   if(VG_(clo_rr_fast_forward_to) > 0 && ML_(numEvents)() > 0 
+      && VG_(clo_rr_fast_forward_to) > ML_(numEvents)()) {
+      VG_(fmsg_bad_option)("--rr-fast-forward-to=", 
+         "The replay log only has %llu events.\n", ML_(numEvents)());
+   }
+   fast_forwarding = VG_(clo_rr_fast_forward_to) > 0;
 }
 
 /*
@@ -172,25 +302,38 @@ VG_(RR_Init)(Int argc, HChar** argv, HChar** p_toolname)
  *
  *       Print summary of guest state divergence detected and free allocated 
  *       resources. This function is called when Valgrind is about to exit in 
- *       m_main.c/shutdown_actions_NORETURN(...).
+ *       m_main.c/shutdown_actions_NORETURN(...). crashed is True when the 
+ *       client dies of a fatal signal.
  *
  * Results:
  *       None 
  *
  * Side effects:
- *       None
+ *       In replay, the checkpoints are killed. In record, if crashed, the
+ *       window kept by --rr-flight-recorder is replayed before returning.
  *
  *----------------------------------------------------------------------------
  */
 void 
-VG_(RR_Exit)(void)
+VG_(RR_Exit)(Bool crashed)
 {
+   if(VG_(clo_record_replay) == RECORDONLY){ /* record */
+      /* whatever --rr-sync is, the log is complete on disk when we are done */
+      ML_(finishLog)();
+      check_file_refs();
+      (void)VG_(do_syscall1)(__NR_fsync, ML_(log_fd_rr));
+      ML_(flightRecorderAtExit)(crashed);
+   }
+
    /* Close the file descriptor used for record & replay */
    VG_(close) (ML_(log_fd_rr));
    if(VG_(clo_record_replay) == REPLAYONLY){ /* replay */
       VG_(printf)("REPLAY -- number of guest state mismatch: %d\n", num_guest_state_mismatch);
-      vg_assert(client_cmdline != NULL);
-      VG_(free) (client_cmdline);
+      /* a flight recorder snapshot replays without the command line */
+      if(client_cmdline != NULL)
+         VG_(free) (client_cmdline);
+      ML_(checkpointsAtExit)(VG_(running_tid) == VG_INVALID_THREADID ? 0 :
+                             VG_(threads)[VG_(running_tid)].os_state.exitcode);
    }
 
    VG_(clo_record_replay) = UNINITIALIZED;
@@ -325,6 +468,8 @@ VG_(RR_Thread_Create)(UInt vg_ptid, UInt vg_ctid, unsigned long* lwpid)
                    threads_rr[vg_ctid].tid_kernel == VG_INVALID_THREADID);
       threads_rr[vg_ctid].tid_kernel = (*lwpid);
       threads_rr[vg_ctid].tid_recorded = le->u.thread_create.lwpid;
+      tid_map_add(tid_by_kernel, True, vg_ctid);
+      tid_map_add(tid_by_recorded, False, vg_ctid);
 #if defined(VGP_x86_linux) || defined(VGP_amd64_linux)
       threads_rr[vg_ctid].clear_child_tid = NULL;
 #endif
@@ -345,19 +490,31 @@ VG_(RR_Thread_Create)(UInt vg_ptid, UInt vg_ctid, unsigned long* lwpid)
  *       None 
  *
  * Side effects:
- *       Which thread exiting is saved, and subsequent RR_Thread_Acquire should wait for
- *       completion of this exiting thread in the OS kernel part. 
+ *       The exit is logged in record and checked in replay, so threads exit 
+ *       in the same order. Which thread exiting is saved, and subsequent 
+ *       RR_Thread_Acquire should wait for completion of this exiting thread 
+ *       in the OS kernel part. 
  *
  *----------------------------------------------------------------------------
  */
 void 
 VG_(RR_Thread_Exit) (ThreadId tid)
 {
-   ThreadState* ts = VG_(get_ThreadState)(tid);
+   LogEntry* le;
 
    vg_assert(tid != VG_INVALID_THREADID);
+   if(VG_(clo_record_replay) == RECORDONLY || ML_(logHasThreadExits)()) {
+      le = alloca(sizeof(LogEntry));
+      le->type = THREAD_EXIT;
+      le->tid = tid;
+      PROCESS_LOGENTRY;
+   }
    VG_(RR_Thread_Release) (tid, "exit_thread");
    exiting_thread = tid; 
+   if(threads_rr[tid].tid_kernel != VG_INVALID_THREADID){
+      tid_map_remove(tid_by_kernel, True, tid);
+      tid_map_remove(tid_by_recorded, False, tid);
+   }
    threads_rr[tid].tid_kernel = VG_INVALID_THREADID;
    threads_rr[tid].tid_recorded = VG_INVALID_THREADID;
 }
@@ -370,8 +527,9 @@ VG_(RR_Thread_Exit) (ThreadId tid)
  *       Record/replay VG_(acquire_BigLock), which happens when a new thread is 
  *       scheduled to run by OS kernel. 
  *       
- *       Save this fact into log in record; Make sure a desired thread is selected
- *       to run after this function in replay.
+ *       Save this fact into log in record, when the BigLock goes to another 
+ *       thread than the one which released it; Make sure a desired thread is
+ *       selected to run after this function in replay.
  *
  *       If there is a thread that is about to exit, wait for its completion.
  *
@@ -404,6 +562,7 @@ VG_(RR_Thread_Acquire) (ThreadId tid, Char* who)
       le->type = ACQUIRE_BIGLOCK;
       le->tid = VG_(running_tid);
       le->u.acquire_biglock.tid = tid;
+      le->u.acquire_biglock.release_no = num_releases;
 #define VG_RR_STREQN(nn,s1,s2) (0==VG_(strncmp_ws)((s1),(s2),(nn)))
       if(VG_RR_STREQN(17,"sigvgkill_handler", who)) {
          le->u.acquire_biglock.type = CALLER_SIGVKILL;
@@ -411,7 +570,9 @@ VG_(RR_Thread_Acquire) (ThreadId tid, Char* who)
          le->u.acquire_biglock.type = CALLER_NORMAL;
       }
 
-      ML_(writeToLog)(le); 
+      /* the releasing thread getting the lock back is not a switch */
+      if(tid != last_released || le->u.acquire_biglock.type != CALLER_NORMAL)
+         ML_(writeToLog)(le); 
    }
    
 //   PROCESS_LOGENTRY;
@@ -468,9 +629,11 @@ static void
 wait_thread_exits(void)
 {
 #if defined(VGP_x86_linux) || defined(VGP_amd64_linux)
-   int num_sleeps;
-   volatile int* ptr;
-   struct vki_timespec* t;
+   volatile Int* ptr;
+   Int val;
+   UInt start, waited;
+   Bool reported = False;
+   struct vki_timespec t;
 
    if(exiting_thread == VG_INVALID_THREADID || threads_rr[exiting_thread].clear_child_tid == NULL
                                             /* Main thread may exit when there is still some thread existed. */
@@ -480,18 +643,12 @@ wait_thread_exits(void)
 
    vg_assert(exiting_thread < VG_N_THREADS);
 
-   //VG_(printf)("ptr=%X tid/exiting_tid=%d/%d next_tid=%d who=%s\n", ptr, tid, exiting_thread, nextSchedule.tid, who);
-   //VG_(do_syscall1)(__NR_fsync, 1);
-
-   num_sleeps = 0;
-   ptr = (volatile int*)threads_rr[exiting_thread].clear_child_tid;
-   t = alloca(sizeof(struct vki_timespec));
-   t->tv_sec = 0;
-   t->tv_nsec = 1000000; // 1 milli-second
+   ptr = (volatile Int*)threads_rr[exiting_thread].clear_child_tid;
+   start = VG_(read_millisecond_timer)();
 
    /* 
     * if(*ptr == 0) then the variable has been zero-ed by OS kernel. (This is a part of Linux ABI)
-    *     -- Spin on the monitored clear_child_tid, until it becomes zero.  Normal case.
+    *     -- The kernel does a FUTEX_WAKE on it right after, so sleep on it until then. Normal case.
     * if(*ptr == -1) then pthread lib has marked the exiting_thread terminated or joined. (A horribal hack of pthread lib)
     */
    /* 
@@ -500,16 +657,29 @@ wait_thread_exits(void)
     * even wait and then no syscall requested in pthread_join. When main thread reached this point, it is requesting a much 
     * later syscall.... but Valgrind record/replay is not aware of this and is using old address, so SIGSEGV
     */
-   while((*ptr) != 0 && (*ptr) != -1) {
-      //VG_(printf)("%d sleep 1 ms to wait for exiting of thread %d. addr/val=%X/%X\n", tid, exiting_thread, ptr, (*ptr));
-      VG_(do_syscall2)(__NR_nanosleep, t, NULL);
-      num_sleeps++;
-      if(num_sleeps > 10) {
-         VG_(printf)("\nRECORD/REPLAY warning: thread %d have been waited long enough time to exit."
-                     "But it seems still not completed.\n", exiting_thread);  
-         /* Let's take a chance */
-         break;
+   while((val = *ptr) != 0 && val != -1) {
+      waited = VG_(read_millisecond_timer)() - start;
+      if(waited >= RR_THREAD_EXIT_TIMEOUT) {
+         /* In record, this run goes on as it is, and the log has it. In 
+            replay, the recorded run had the thread gone by now: going on
+            without it would diverge, so keep waiting. */
+         if(VG_(clo_record_replay) != REPLAYONLY) {
+            VG_(umsg)("Warning: thread %lu is still not gone %u ms after its exit, "
+                      "going on without waiting for it\n", exiting_thread, waited);
+            break;
+         }
+         if(!reported)
+            VG_(umsg)("Warning: thread %lu is still not gone %u ms after its exit, "
+                      "the replay waits for it\n", exiting_thread, waited);
+         reported = True;
+         waited = 0;
+         start = VG_(read_millisecond_timer)();
       }
+      t.tv_sec = (RR_THREAD_EXIT_TIMEOUT - waited) / 1000;
+      t.tv_nsec = ((RR_THREAD_EXIT_TIMEOUT - waited) % 1000) * 1000000;
+      /* not a private futex: the kernel wakes it as a shared one. Whatever
+         the outcome (woken, value changed, timeout, signal), look again */
+      (void)VG_(do_syscall4)(__NR_futex, (UWord)ptr, VKI_FUTEX_WAIT, val, (UWord)&t);
    } 
 
    //threads_rr element may be reused. let's clear the record
@@ -518,6 +688,20 @@ wait_thread_exits(void)
    exiting_thread = VG_INVALID_THREADID;
 }
 
+/* replay: whether the log has the BigLock switch to a thread at this release */
+static Bool
+is_switch(void)
+{
+   LogEntry next;
+
+   if(!ML_(peekLog)(&next) || next.type != ACQUIRE_BIGLOCK)
+      return False;
+   vg_assert2(next.u.acquire_biglock.release_no >= num_releases,
+              "Log entry not expected. The switch after release %llu is "
+              "at release %llu\n", next.u.acquire_biglock.release_no, num_releases);
+   return next.u.acquire_biglock.release_no == num_releases;
+}
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -527,7 +711,8 @@ wait_thread_exits(void)
  *       is about to switch out.
  *        
  *       When in record, it syncs all the log writing activity; when in replay,
- *       it reads the log and figures out which thread is to run next.
+ *       it reads the log and figures out which thread is to run next: 
+ *       another one only if the log has a switch at this release.
  * Results:
  *       None 
  *
@@ -545,22 +730,37 @@ VG_(RR_Thread_Release) (ThreadId tid, Char* who)
    /* VG_(running_tid) is VG_INVALID_THREADID now */
    //vg_assert(VG_(running_tid) == tid);
    le = alloca(sizeof(LogEntry));
-   le->tid = tid;
-   le->type = RELEASE_BIGLOCK;
-   VG_(strncpy)(le->u.release_biglock.who, who, 16);
 
-   PROCESS_LOGENTRY;
+   num_releases++;
+   last_released = tid;
 
    if(VG_(clo_record_replay) == RECORDONLY){ /* in record */
-      /* Make sure the record log is written out */
+      /* only the switches are logged, see VG_(RR_Thread_Acquire) */
+      /* Write out the record log, if --rr-sync asks to do it now */
       ML_(rrsync)();
    }
    else if(VG_(clo_record_replay) == REPLAYONLY){ /* in replay */
+      if(!ML_(logHasSwitchesOnly)()){ /* an older log has every release */
+         le->tid = tid;
+         le->type = RELEASE_BIGLOCK;
+         VG_(strncpy)(le->u.release_biglock.who, who, 16);
+         ML_(readFromLog)(le);
+      }
+
+      if(ML_(logHasSwitchesOnly)() && !is_switch()){
+         /* the lock comes back to us */
+         nextSchedule.type = CALLER_NORMAL;
+         nextSchedule.tid = tid;
+         return;
+      }
       le->type = ACQUIRE_BIGLOCK;
       le->tid = VG_(running_tid);
       ML_(readFromLog)(le);
       nextSchedule.type = le->u.acquire_biglock.type;
       nextSchedule.tid = le->u.acquire_biglock.tid;
+      /* wake up the next thread, if it is already waiting for its turn */
+      if(nextSchedule.tid != tid)
+         VG_(replay_handoff)(nextSchedule.tid);
    }
 }
 
@@ -686,6 +886,214 @@ VG_(RR_Syscall_Mem) (Int numAddrs, ...)
    va_end(vargs);
 }
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Syscall_Auto) --
+ *
+ *       Whether syscalls without a record_replay wrapper are recorded/replayed
+ *       too. Always in record; in replay only for logs written that way.
+ *
+ * Results:
+ *       True if they are.
+ *
+ * Side effects:
+ *       None
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_Syscall_Auto) (void)
+{
+   if(VG_(clo_record_replay) == RECORDONLY)
+      return True;
+   return VG_(clo_record_replay) == REPLAYONLY && ML_(logHasAutoSyscalls)();
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Syscall_CaptureMemWrites) --
+ *
+ *       Start or stop capturing the POST_MEM_WRITEs of thread tid as the
+ *       memory side effects of its current syscall. Started once the return
+ *       value of a syscall without a record_replay wrapper is logged, and
+ *       stopped once its post handler has run.
+ *
+ * Results:
+ *       None 
+ *
+ * Side effects:
+ *       None
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_Syscall_CaptureMemWrites) (ThreadId tid, Bool capture)
+{
+   vg_assert(tid < VG_N_THREADS);
+   capturing_mem_writes[tid] = capture;
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Syscall_PostMemWrite) --
+ *
+ *       Called for every POST_MEM_WRITE of a syscall post handler. While 
+ *       tid's writes are captured, the written range is logged in record
+ *       and filled from the log in replay, as VG_(RR_Syscall_Mem) does for
+ *       the hand-written wrappers.
+ *
+ * Results:
+ *       None 
+ *
+ * Side effects:
+ *       In replay, the range is overwritten with the recorded bytes.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_Syscall_PostMemWrite) (ThreadId tid, Addr a, SizeT len)
+{
+   vg_assert(tid < VG_N_THREADS);
+   if(!capturing_mem_writes[tid] || len == 0)
+      return;
+   vg_assert(tid == VG_(running_tid));
+   VG_(RR_Syscall_Mem)(1, (void*)a, (Int)len);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Syscall_FileRead) --
+ *
+ *       Record/replay the len bytes a read() of fd wrote to buf. With 
+ *       --rr-file-refs=yes, when fd is a regular file that has not changed
+ *       since it was first read, only a reference to the bytes in the file
+ *       is logged, and replay reads them again from there.
+ *
+ * Results:
+ *       None 
+ *
+ * Side effects:
+ *       In replay, buf is filled from the log or from the file. Replay 
+ *       fails if the file is not the one recorded, or if it changed.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_Syscall_FileRead) (Int fd, void* buf, SizeT len)
+{
+   RRFileRef ref;
+   LogEntry* le;
+   Bool refs = VG_(clo_record_replay) == REPLAYONLY ? ML_(logHasFileRefs)()
+                                                    : VG_(clo_rr_file_refs);
+
+   if(!refs || len < RR_FILE_REF_MIN_LEN) {
+      VG_(RR_Syscall_Mem)(1, buf, (Int)len);
+      return;
+   }
+
+   if(VG_(clo_record_replay) == RECORDONLY)
+      make_file_ref(&ref, fd, buf, len);
+   le = alloca(sizeof(LogEntry));
+   le->type = DATA1;
+   le->tid = VG_(running_tid);
+   le->u.data.len = sizeof(RRFileRef);
+   le->u.data.addr = &ref;
+   PROCESS_LOGENTRY;
+
+   if(!ref.isRef)
+      VG_(RR_Syscall_Mem)(1, buf, (Int)len);
+   else if(VG_(clo_record_replay) == REPLAYONLY)
+      read_file_ref(&ref, fd, buf, len);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Syscall_FileModify) --
+ *
+ *       Called in record before syscall sysno, with arguments arg1 to 
+ *       arg4. With --rr-file-refs=yes, when it opens a file for writing,
+ *       truncates it or renames another file over it, the file is not 
+ *       referred to any more, and if the log refers to it already, it is
+ *       copied first for replay to read the references from.
+ *
+ * Results:
+ *       None 
+ *
+ * Side effects:
+ *       May write RR_FILE_COPY_NAME of the log.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_Syscall_FileModify)(UInt sysno, UWord arg1, UWord arg2, UWord arg3,
+                           UWord arg4)
+{
+   UWord flags;
+
+   if(VG_(clo_record_replay) != RECORDONLY || !VG_(clo_rr_file_refs))
+      return;
+
+   switch(sysno){
+   case __NR_open:
+      flags = arg2;
+      if((flags & VKI_O_ACCMODE) != VKI_O_RDONLY || (flags & VKI_O_TRUNC))
+         modify_file(VKI_AT_FDCWD, (const HChar*)arg1);
+      break;
+   case __NR_openat:
+      flags = arg3;
+      if((flags & VKI_O_ACCMODE) != VKI_O_RDONLY || (flags & VKI_O_TRUNC))
+         modify_file((Int)arg1, (const HChar*)arg2);
+      break;
+   case __NR_creat:
+   case __NR_truncate:
+#if defined(__NR_truncate64)
+   case __NR_truncate64:
+#endif
+      modify_file(VKI_AT_FDCWD, (const HChar*)arg1);
+      break;
+   case __NR_rename:
+      modify_file(VKI_AT_FDCWD, (const HChar*)arg2);
+      break;
+   case __NR_renameat:
+      modify_file((Int)arg3, (const HChar*)arg4);
+      break;
+   default:
+      break;
+   }
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Syscall_Clock) --
+ *
+ *       Serve the clock read of syscall sysno, with arguments arg1 and 
+ *       arg2, from the virtual clock (see clock.c). Called before the
+ *       syscall is logged. In record, only with --rr-virtual-clock; in 
+ *       replay, when the log has a clock read there.
+ *
+ * Results:
+ *       True if it was served, with its result in res. False if the 
+ *       syscall goes on as usual.
+ *
+ * Side effects:
+ *       The time is written where the syscall would write it.
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_Syscall_Clock)(ThreadId tid, UInt sysno, UWord arg1, UWord arg2,
+                      SysRes* res)
+{
+   vg_assert(tid == VG_(running_tid));
+   return ML_(clockRead)(tid, sysno, arg1, arg2, res);
+}
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -719,6 +1127,93 @@ VG_(RR_Syscall_DispatchCtr)(UInt ctr, Bool isBefore)
    PROCESS_LOGENTRY; 
 }
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_PreFork) --
+ *
+ *       Called by the thread tid right before the client forks. In record,
+ *       the fork takes its number in the joint schedule of the process tree.
+ *       In replay, its event is read, and the fork waits for the forks and
+ *       execs recorded before it in other processes to be replayed.
+ *
+ * Results:
+ *       None 
+ *
+ * Side effects:
+ *       In record, the log is written out, so the child doesn't write it
+ *       again.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_PreFork)(ThreadId tid)
+{
+   vg_assert(tid == VG_(running_tid));
+   ML_(preFork)(tid);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_PostFork) --
+ *
+ *       Called right after a fork of the client, in the parent and in the
+ *       child, with res the result of the fork. The parent logs the fork 
+ *       in record. The child goes on with a log of its own, see tree.c.
+ *
+ * Results:
+ *       None 
+ *
+ * Side effects:
+ *       In the parent in replay, res becomes the recorded result. The 
+ *       child forgets about the checkpoints and the flight recorder 
+ *       snapshots of its parent.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_PostFork)(ThreadId tid, SysRes* res)
+{
+   vg_assert(tid == VG_(running_tid));
+   ML_(postFork)(tid, res);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Exec) --
+ *
+ *       Called when the client is about to exec, with no other thread 
+ *       left, past the point where the exec can fail. traced tells whether
+ *       the new program runs under Valgrind as well.
+ *
+ * Results:
+ *       The options to pass on to the Valgrind of the new program, NULL 
+ *       terminated: the log it goes on with, and the root of the tree.
+ *
+ * Side effects:
+ *       In record, the log is finished and synced, and the flight recorder
+ *       snapshots are killed.
+ *
+ *----------------------------------------------------------------------------
+ */
+HChar**
+VG_(RR_Exec)(ThreadId tid, Bool traced)
+{
+   HChar** args;
+
+   vg_assert(tid == VG_(running_tid));
+   args = ML_(exec)(tid, traced);
+   if(VG_(clo_record_replay) == RECORDONLY){
+      ML_(finishLog)();
+      check_file_refs();
+      (void)VG_(do_syscall1)(__NR_fsync, ML_(log_fd_rr));
+      ML_(flightRecorderAtExit)(False);
+   }
+   return args;
+}
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -843,30 +1338,399 @@ VG_(RR_InitState_VexGuestArchState)(void* arg)
    RR_VexGuestArchState((VexGuestArchState*)arg);
 }
 
-unsigned long 
-VG_(recorded_id_to_kernel_id)(unsigned long recorded_id)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_CurrentEvent) --
+ *
+ *       Number of events replayed so far, which is also the number of the
+ *       next event to be replayed. Replay-only.
+ *
+ * Results:
+ *       The event number.
+ *
+ * Side effects:
+ *       None
+ *
+ *----------------------------------------------------------------------------
+ */
+ULong
+VG_(RR_CurrentEvent)(void)
 {
-   int i;
-
-   for(i = 0; i < VG_N_THREADS; i++){
-      if(threads_rr[i].tid_recorded == recorded_id)
-         return threads_rr[i].tid_kernel;
-   }
-   
-   return VG_INVALID_THREADID;
+   return ML_(currentEvent)();
 }
 
-unsigned long 
-VG_(kernel_id_to_recorded_id)(unsigned long kernel_id)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_FindEvent) --
+ *
+ *       Look up event "event_no" in the event index of the replay log, in
+ *       O(log n). The index is sparse: what is found is the closest indexed
+ *       position at or before the event. Replay-only.
+ *
+ * Results:
+ *       True and *pos filled up, or False when the log has no index or
+ *       fewer events.
+ *
+ * Side effects:
+ *       None
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_FindEvent)(ULong event_no, RRLogPos* pos)
 {
-   int i;
-
-   for(i = 0; i < VG_N_THREADS; i++){
-      if(threads_rr[i].tid_kernel == kernel_id)
-         return threads_rr[i].tid_recorded;
-   }
-
-   return VG_INVALID_THREADID;
+   return ML_(findEvent)(event_no, pos);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_FindSyscall) --
+ *
+ *       Like VG_(RR_FindEvent), but look up the "nth" syscall (from 0) of 
+ *       thread tid, or of the whole process when tid is VG_INVALID_THREADID.
+ *       pos->n_syscalls counts the syscalls of the same thread(s).
+ *
+ * Results:
+ *       True and *pos filled up, or False when the log has no index or
+ *       fewer syscalls.
+ *
+ * Side effects:
+ *       None
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_FindSyscall)(ThreadId tid, ULong nth, RRLogPos* pos)
+{
+   return ML_(findSyscall)(tid, nth, pos);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_SeekReached) --
+ *
+ *       Polled by the scheduler. Tells when the number of events given by 
+ *       --rr-seek has been replayed.
+ *
+ * Results:
+ *       True only once, and only when the gdbserver is enabled: the caller
+ *       is then expected to call VG_(gdbserver).
+ *
+ * Side effects:
+ *       A message is printed when the event is reached.
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_SeekReached)(void)
+{
+   if(VG_(clo_record_replay) != REPLAYONLY || !stop_pending)
+      return False;
+   if(ML_(currentEvent)() < stop_event)
+      return False;
+
+   stop_pending = False;
+   VG_(umsg)("REPLAY -- %llu events replayed\n", ML_(currentEvent)());
+   return VG_(clo_vgdb) != Vg_VgdbNo;
+}
+
+void
+ML_(setStopEvent)(ULong event_no)
+{
+   stop_event = event_no;
+   stop_pending = True;
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_FastForwarding) --
+ *
+ *       Tells whether replay is still running the client without the 
+ *       tool's instrumentation, before the event --rr-fast-forward-to 
+ *       asks for.
+ *
+ * Results:
+ *       True while fast-forwarding: translations are made without the 
+ *       tool's instrument pass and the errors the tool reports are dropped.
+ *
+ * Side effects:
+ *       None
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_FastForwarding)(void)
+{
+   return fast_forwarding;
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_MaybeEndFastForward) --
+ *
+ *       Polled by the scheduler at quiescent points. Once the event given
+ *       by --rr-fast-forward-to has been replayed, switch the tool's 
+ *       instrumentation on.
+ *
+ * Results:
+ *       None
+ *
+ * Side effects:
+ *       All translations are discarded, so the client code is translated
+ *       again with the tool. The tool is told about every thread's 
+ *       registers (post_reg_write) and gets the end_fast_forward event to
+ *       set up its shadow memory.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_MaybeEndFastForward)(void)
+{
+   ThreadId tid;
+
+   if(!fast_forwarding || ML_(currentEvent)() < VG_(clo_rr_fast_forward_to))
+      return;
+
+   fast_forwarding = False;
+   VG_(umsg)("REPLAY -- %llu events replayed, the tool is switched on\n", 
+             ML_(currentEvent)());
+
+   VG_(discard_translations)(0, ~(ULong)0, "VG_(RR_MaybeEndFastForward)");
+
+   for(tid = 1; tid < VG_N_THREADS; tid++) {
+      if(VG_(is_valid_tid)(tid))
+         VG_TRACK(post_reg_write, Vg_CoreStartup, tid, 0, 
+                  sizeof(VexGuestArchState));
+   }
+   VG_TRACK(end_fast_forward);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_Checkpoint) --
+ *
+ *       Called by the scheduler, with the BigLock held, before running a 
+ *       thread. In replay, takes a checkpoint of the process when one is due 
+ *       according to --rr-checkpoint-syscalls or --rr-checkpoint-blocks. 
+ *       bbs_done is the number of basic blocks run so far.
+ *
+ * Results:
+ *       None
+ *
+ * Side effects:
+ *       May fork the process. The checkpoint sleeps until it is restarted 
+ *       from, and then returns from here in a new process. Also where a
+ *       reverse execution ends when its target is not an instruction.
+ *       In record, where --rr-flight-recorder starts a new segment of the
+ *       log, and forks the snapshot it starts from. A snapshot woken up 
+ *       returns from here, replaying.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_Checkpoint)(ThreadId tid, ULong bbs_done)
+{
+   if(VG_(clo_record_replay) == RECORDONLY)
+      ML_(maybeRotateLog)(tid);
+   if(VG_(clo_record_replay) != REPLAYONLY)
+      return;
+   ML_(maybeCheckpoint)(tid, bbs_done);
+   ML_(reverseAtTop)(tid);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_RestartFromCheckpoint) --
+ *
+ *       Go back in the replay to the last checkpoint taken at or before
+ *       event "event_no", and replay from there until event_no, where the
+ *       gdbserver takes over as with --rr-seek.
+ *
+ * Results:
+ *       False when there is no such checkpoint. Doesn't return otherwise.
+ *
+ * Side effects:
+ *       The current process exits, and the checkpoints after the one 
+ *       restarted from are killed.
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_RestartFromCheckpoint)(ULong event_no)
+{
+   if(VG_(clo_record_replay) != REPLAYONLY)
+      return False;
+   return ML_(restartFromCheckpoint)(event_no);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_CanReverse) --
+ *
+ *       Tells the gdbserver whether it can offer reverse execution: in 
+ *       replay, with checkpoints to go back to.
+ *
+ * Results:
+ *       True if gdb may send reverse-continue and reverse-stepi.
+ *
+ * Side effects:
+ *       None
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_CanReverse)(void)
+{
+   return VG_(clo_record_replay) == REPLAYONLY
+          && (VG_(clo_rr_checkpoint_syscalls) > 0 || VG_(clo_rr_checkpoint_bbs) > 0);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_ReverseResume) --
+ *
+ *       gdb asks the thread tid, stopped in the gdbserver, to continue 
+ *       backwards to the last break or watch point hit (or with step, to 
+ *       the instruction before). The replay is restarted from the last 
+ *       checkpoint before the current position, and run up to the hit, 
+ *       which is reported to gdb by the new process.
+ *
+ * Results:
+ *       Returns only when there is no checkpoint before the current 
+ *       position: the gdbserver then tells gdb the history starts here.
+ *
+ * Side effects:
+ *       The current process sleeps until the new one takes its gdb 
+ *       connection over, and is then killed.
+ *
+ *----------------------------------------------------------------------------
+ */
+void
+VG_(RR_ReverseResume)(ThreadId tid, Bool step)
+{
+   if(VG_(RR_CanReverse)())
+      ML_(reverseResume)(tid, step);
+}
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VG_(RR_HideGdbStop) --
+ *
+ *       Called by the gdbserver before it reports a stop of the thread tid 
+ *       to gdb. While a reverse execution is scanning for the last hit or 
+ *       seeking to it, the stops before its target must not be seen by gdb.
+ *
+ * Results:
+ *       True if the stop is to be hidden: the gdbserver then resumes, and 
+ *       single steps if *resume_step is set.
+ *
+ * Side effects:
+ *       A scan reaching its target restarts from a checkpoint, and doesn't 
+ *       return.
+ *
+ *----------------------------------------------------------------------------
+ */
+Bool
+VG_(RR_HideGdbStop)(ThreadId tid, RRStopKind kind, Bool* resume_step)
+{
+   if(VG_(clo_record_replay) != REPLAYONLY)
+      return False;
+   return ML_(reverseHideStop)(tid, kind, resume_step);
+}
+
+static UInt
+tid_hash(unsigned long id)
+{
+   return (UInt)((id * 2654435761UL) % TID_MAP_SIZE);
+}
+
+static unsigned long
+tid_map_key(Bool by_kernel, ThreadId tid)
+{
+   return by_kernel ? threads_rr[tid].tid_kernel : threads_rr[tid].tid_recorded;
+}
+
+/* the slot of the thread with that id in map, or of the empty slot ending 
+   its probe sequence */
+static UInt
+tid_map_slot(ThreadId* map, Bool by_kernel, unsigned long id)
+{
+   UInt i;
+
+   for(i = tid_hash(id); map[i] != VG_INVALID_THREADID; i = (i + 1) % TID_MAP_SIZE){
+      if(tid_map_key(by_kernel, map[i]) == id)
+         break;
+   }
+   return i;
+}
+
+static void
+tid_map_add(ThreadId* map, Bool by_kernel, ThreadId tid)
+{
+   UInt i = tid_map_slot(map, by_kernel, tid_map_key(by_kernel, tid));
+
+   vg_assert2(map[i] == VG_INVALID_THREADID, 
+              "thread id %lu is already in use\n", tid_map_key(by_kernel, tid));
+   map[i] = tid;
+}
+
+static void
+tid_map_remove(ThreadId* map, Bool by_kernel, ThreadId tid)
+{
+   UInt i, j, h;
+
+   i = tid_map_slot(map, by_kernel, tid_map_key(by_kernel, tid));
+   vg_assert(map[i] == tid);
+
+   /* move back the entries after the hole which could no longer be found */
+   for(j = (i + 1) % TID_MAP_SIZE; map[j] != VG_INVALID_THREADID; j = (j + 1) % TID_MAP_SIZE){
+      h = tid_hash(tid_map_key(by_kernel, map[j]));
+      /* map[j] stays if its home slot h is cyclically in (i, j] */
+      if(i < j ? (h > i && h <= j) : (h > i || h <= j))
+         continue;
+      map[i] = map[j];
+      i = j;
+   }
+   map[i] = VG_INVALID_THREADID;
+}
+
+unsigned long 
+VG_(recorded_id_to_kernel_id)(unsigned long recorded_id)
+{
+   ThreadId tid = tid_by_recorded[tid_map_slot(tid_by_recorded, False, recorded_id)];
+
+   return tid == VG_INVALID_THREADID ? VG_INVALID_THREADID : threads_rr[tid].tid_kernel;
+}
+
+unsigned long 
+VG_(kernel_id_to_recorded_id)(unsigned long kernel_id)
+{
+   ThreadId tid = tid_by_kernel[tid_map_slot(tid_by_kernel, True, kernel_id)];
+
+   return tid == VG_INVALID_THREADID ? VG_INVALID_THREADID : threads_rr[tid].tid_recorded;
+}
+
+static void
+flush_log_before_fork(ThreadId tid)
+{
+   ML_(drainLog)();
+}
+
+static void
+forget_log_writer_in_child(ThreadId tid)
+{
+   ML_(forgetLogWriter)();
 }
 
 #if defined(VGP_x86_linux) || defined(VGP_amd64_linux)
@@ -897,9 +1761,62 @@ setupRRArgs(Int argc, HChar** argv)
 
       if VG_INT_CLO(str, "--record-replay", VG_(clo_record_replay)) {}
       else if VG_STR_CLO(str, "--log-file-rr", VG_(clo_log_name_rr)) {}
+      else if VG_XACT_CLO(str, "--rr-sync=none",         VG_(clo_rr_sync), RR_SYNC_NONE) {}
+      else if VG_XACT_CLO(str, "--rr-sync=periodic",     VG_(clo_rr_sync), RR_SYNC_PERIODIC) {}
+      else if VG_XACT_CLO(str, "--rr-sync=every-switch", VG_(clo_rr_sync), RR_SYNC_EVERY_SWITCH) {}
+      else if VG_STREQN(10, str, "--rr-sync=") {
+         VG_(fmsg_bad_option)(str, 
+            "--rr-sync argument can only be none|periodic|every-switch.\n");
+      }
+      else if VG_BINT_CLO(str, "--rr-sync-interval", VG_(clo_rr_sync_interval), 1, 3600000) {}
+      else if VG_XACT_CLO(str, "--rr-compress=none", VG_(clo_rr_compress), RR_COMPRESS_NONE) {}
+      else if VG_XACT_CLO(str, "--rr-compress=lzo",  VG_(clo_rr_compress), RR_COMPRESS_LZO) {}
+      else if VG_STREQN(14, str, "--rr-compress=") {
+         VG_(fmsg_bad_option)(str, 
+            "--rr-compress argument can only be none|lzo.\n");
+      }
+      else if VG_XACT_CLO(str, "--rr-check-state=none",  VG_(clo_rr_check_state), RR_CHECK_STATE_NONE) {}
+      else if VG_XACT_CLO(str, "--rr-check-state=hash",  VG_(clo_rr_check_state), RR_CHECK_STATE_HASH) {}
+      else if VG_XACT_CLO(str, "--rr-check-state=delta", VG_(clo_rr_check_state), RR_CHECK_STATE_DELTA) {}
+      else if VG_XACT_CLO(str, "--rr-check-state=full",  VG_(clo_rr_check_state), RR_CHECK_STATE_FULL) {}
+      else if VG_STREQN(17, str, "--rr-check-state=") {
+         VG_(fmsg_bad_option)(str, 
+            "--rr-check-state argument can only be none|hash|delta|full.\n");
+      }
+      else if VG_BINT_CLO(str, "--rr-dedupe", VG_(clo_rr_dedupe), 0, 1 << 30) {}
+      else if VG_BOOL_CLO(str, "--rr-map-reads", VG_(clo_rr_map_reads)) {}
+      else if VG_BOOL_CLO(str, "--rr-file-refs", VG_(clo_rr_file_refs)) {}
+      else if VG_BINT_CLO(str, "--rr-flight-recorder", 
+                          VG_(clo_rr_flight_recorder), 0, 1 << 20) {}
+      else if VG_STR_CLO(str, "--rr-tree", VG_(clo_rr_tree)) {}
+      else if VG_BINT_CLO(str, "--rr-virtual-clock", 
+                          VG_(clo_rr_virtual_clock), 0, 1000) {}
+      else if VG_BOOL_CLO(str, "--rr-async-write", VG_(clo_rr_async_write)) {}
+      else if VG_BINT_CLO(str, "--rr-seek", VG_(clo_rr_seek), 1, (Long)1 << 62) {}
+      else if VG_BINT_CLO(str, "--rr-checkpoint-syscalls", 
+                          VG_(clo_rr_checkpoint_syscalls), 0, (Long)1 << 62) {}
+      else if VG_BINT_CLO(str, "--rr-checkpoint-blocks", 
+                          VG_(clo_rr_checkpoint_bbs), 0, (Long)1 << 62) {}
+      else if VG_BINT_CLO(str, "--rr-fast-forward-to", 
+                          VG_(clo_rr_fast_forward_to), 0, (Long)1 << 62) {}
       else continue;
    }
 
+   /* nothing to hash or to diff on this platform */
+   if(VG_(clo_record_replay) == RECORDONLY && num_checked_regs() == 0
+      && (VG_(clo_rr_check_state) == RR_CHECK_STATE_HASH 
+          || VG_(clo_rr_check_state) == RR_CHECK_STATE_DELTA)) {
+      VG_(fmsg_bad_option)("--rr-check-state", 
+         "--rr-check-state=hash|delta is not supported on this platform.\n");
+   }
+
+   /* the side store would grow without bound */
+   if(VG_(clo_rr_flight_recorder) > 0 
+      && (VG_(clo_rr_dedupe) > 0 || VG_(clo_rr_map_reads))) {
+      VG_(fmsg_bad_option)("--rr-flight-recorder", 
+         "--rr-flight-recorder can't be used with --rr-dedupe or --rr-map-reads.\n");
+   }
+
    if(VG_(clo_record_replay) == UNINITIALIZED){
       VG_(message)(Vg_UserMsg, "Please specify --record-replay=1|2. If you don't need record/replay, recompile Valgrind with MACRO RECORD_REPLAY undefined");
       VG_(exit)(1);
@@ -917,13 +1834,14 @@ setupRRArgs(Int argc, HChar** argv)
       Int tmp_fd;
 
       vg_assert(VG_(clo_log_name_rr) != NULL);
+      ML_(setupLogName)();
 
       if(VG_(clo_record_replay) == RECORDONLY) {
          /* overwrite the existed file without asking questions */
          sres = VG_(open)(VG_(clo_log_name_rr),
                        VKI_O_CREAT|VKI_O_WRONLY|VKI_O_TRUNC,
                        VKI_S_IRUSR|VKI_S_IWUSR);
-      } else if(VG_(clo_record_replay) == REPLAYONLY) { 
+      } else { /* REPLAYONLY, checked above */
          sres = VG_(open)(VG_(clo_log_name_rr),
                        VKI_O_RDONLY,
                        VKI_S_IRUSR|VKI_S_IWUSR);
@@ -949,6 +1867,11 @@ setupRRArgs(Int argc, HChar** argv)
          }
       }
    }
+
+   if(VG_(clo_record_replay) == RECORDONLY)
+      ML_(writeLogHeader)();
+   else
+      ML_(readLogHeader)();
 }
 
 static void 
@@ -957,8 +1880,23 @@ RR_VexGuestArchState(VexGuestArchState* arg)
    LogEntry* le;
    VexGuestArchState* recorded_vex = NULL;
    VexGuestArchState* runtime_vex = arg;
+   RRCheckState level;
 
    vg_assert(arg != NULL);
+   level = VG_(clo_record_replay) == REPLAYONLY ? ML_(logCheckState)() 
+                                                : VG_(clo_rr_check_state);
+   if(level == RR_CHECK_STATE_NONE) {
+      return;
+   }
+   else if(level == RR_CHECK_STATE_HASH) {
+      RR_VexGuestArchState_hash(VG_(running_tid), runtime_vex);
+      return;
+   }
+   else if(level == RR_CHECK_STATE_DELTA) {
+      RR_VexGuestArchState_delta(VG_(running_tid), runtime_vex);
+      return;
+   }
+
    le = alloca(sizeof(LogEntry));
    le->type = DATA1;
    le->tid = VG_(running_tid);
@@ -980,6 +1918,209 @@ RR_VexGuestArchState(VexGuestArchState* arg)
    }
 }
 
+/* 
+ * A copy of the guest state without what legitimately differs between 
+ * record and replay: the event check fields, and the host addresses of the
+ * LDT/GDT simulation. 
+ */
+static void
+canonical_VexGuestArchState(VexGuestArchState* dst, VexGuestArchState* src)
+{
+   *dst = *src;
+   dst->host_EvC_FAILADDR = 0;
+   dst->host_EvC_COUNTER = 0;
+#  if defined(VGA_x86)
+   dst->guest_LDT = 0;
+   dst->guest_GDT = 0;
+#  endif
+}
+
+ULong
+ML_(hashBytes)(const void* p, SizeT len)
+{
+   const UChar* b = p;
+   ULong h = 0xcbf29ce484222325ULL;
+   ULong w;
+
+   for(; len >= sizeof(ULong); b += sizeof(ULong), len -= sizeof(ULong)) {
+      VG_(memcpy)(&w, b, sizeof(ULong));
+      h = (h ^ w) * 0x100000001b3ULL;
+   }
+   for(; len > 0; b++, len--)
+      h = (h ^ *b) * 0x100000001b3ULL;
+   return h;
+}
+
+/* 
+ * The guest registers check_VexGuestArchState compares, in the order of
+ * RR_CHECKED_REGS. Only those are hashed: the others, the flags thunk 
+ * included, may legitimately differ between record and replay.
+ */
+#if defined(VGP_x86_linux)
+#define RR_CHECKED_REGS(X) \
+   X(EAX) X(ECX) X(EDX) X(EBX) X(ESP) X(EBP) X(ESI) X(EDI) X(EIP) \
+   X(CS) X(DS) X(ES) X(FS) X(GS) X(SS)
+#else
+#define RR_CHECKED_REGS(X)
+#endif
+#define RR_NUM_CHECKED_REGS  32
+
+static const HChar* checked_reg_names[RR_NUM_CHECKED_REGS] = {
+#define CHECKED_REG_NAME(REG) #REG,
+   RR_CHECKED_REGS(CHECKED_REG_NAME)
+#undef CHECKED_REG_NAME
+};
+
+/* fill regs with the checked registers of vex, return how many */
+static UInt
+checked_VexGuestArchState(VexGuestArchState* vex, UInt* regs)
+{
+   UInt n = 0;
+
+#define CHECKED_REG(REG) regs[n++] = (UInt)vex->guest_##REG;
+   RR_CHECKED_REGS(CHECKED_REG)
+#undef CHECKED_REG
+   vg_assert(n <= RR_NUM_CHECKED_REGS);
+   return n;
+}
+
+static UInt
+num_checked_regs(void)
+{
+   UInt n = 0;
+
+#define COUNT_CHECKED_REG(REG) n++;
+   RR_CHECKED_REGS(COUNT_CHECKED_REG)
+#undef COUNT_CHECKED_REG
+   return n;
+}
+
+static VexGuestArchState*
+prev_VexGuestArchState(ThreadId tid)
+{
+   vg_assert(tid < VG_N_THREADS);
+   if(prev_guest_state[tid] == NULL) {
+      prev_guest_state[tid] = VG_(calloc)("rr.prev_guest_state", 1, 
+                                          sizeof(VexGuestArchState));
+   }
+   return prev_guest_state[tid];
+}
+
+/* 
+ * Log the n_words of now_w that differ from prev_w as (index, XOR) pairs:
+ * the number of pairs in a DATA1 entry, then the pairs in another. prev_w
+ * is updated, from now_w in record and from the log in replay.
+ */
+static void
+log_words_delta(ThreadId tid, UInt* now_w, UInt* prev_w, UInt n_words)
+{
+   LogEntry* le;
+   UInt* pairs;
+   UInt num_pairs = 0;
+   UInt i;
+
+   pairs = alloca(n_words * 2 * sizeof(UInt));
+   if(VG_(clo_record_replay) == RECORDONLY) {
+      for(i = 0; i < n_words; i++) {
+         if(now_w[i] != prev_w[i]) {
+            pairs[2 * num_pairs] = i;
+            pairs[2 * num_pairs + 1] = now_w[i] ^ prev_w[i];
+            num_pairs++;
+         }
+      }
+      VG_(memcpy)(prev_w, now_w, n_words * sizeof(UInt));
+   }
+
+   le = alloca(sizeof(LogEntry));
+   le->type = DATA1;
+   le->tid = tid;
+   le->u.data.len = sizeof(UInt);
+   le->u.data.addr = &num_pairs;
+   PROCESS_LOGENTRY;
+   vg_assert(num_pairs <= n_words);
+   le->u.data.len = num_pairs * 2 * sizeof(UInt);
+   le->u.data.addr = pairs;
+   PROCESS_LOGENTRY;
+
+   if(VG_(clo_record_replay) != REPLAYONLY)
+      return;
+
+   for(i = 0; i < num_pairs; i++) {
+      vg_assert(pairs[2 * i] < n_words);
+      prev_w[pairs[2 * i]] ^= pairs[2 * i + 1];
+   }
+}
+
+/* 
+ * RR_CHECK_STATE_HASH: a hash of the checked registers is logged, then 
+ * their delta from the thread's previous snapshot. Replay compares the 
+ * hashes, and on a mismatch diffs the registers against the recorded ones
+ * it rebuilds from the deltas.
+ */
+static void
+RR_VexGuestArchState_hash(ThreadId tid, VexGuestArchState* runtime_vex)
+{
+   LogEntry* le;
+   ULong runtime_hash, recorded_hash = 0;
+   UInt regs[RR_NUM_CHECKED_REGS];
+   UInt* prev;
+   UInt i, n;
+
+   vg_assert(tid < VG_N_THREADS);
+   if(prev_checked_regs[tid] == NULL) {
+      prev_checked_regs[tid] = VG_(calloc)("rr.prev_checked_regs", 
+                                           RR_NUM_CHECKED_REGS, sizeof(UInt));
+   }
+   prev = prev_checked_regs[tid];
+
+   n = checked_VexGuestArchState(runtime_vex, regs);
+   runtime_hash = ML_(hashBytes)(regs, n * sizeof(UInt));
+   le = alloca(sizeof(LogEntry));
+   le->type = DATA1;
+   le->tid = tid;
+   le->u.data.len = sizeof(ULong);
+   le->u.data.addr = VG_(clo_record_replay) == RECORDONLY ? &runtime_hash 
+                                                          : &recorded_hash;
+   PROCESS_LOGENTRY;
+   log_words_delta(tid, regs, prev, n);
+
+   if(VG_(clo_record_replay) != REPLAYONLY || runtime_hash == recorded_hash)
+      return;
+
+   if(num_guest_state_mismatch < 10) {
+      VG_(printf)("Guest state hash not expected. runtime/recorded=0x%llx/0x%llx\n",
+                  runtime_hash, recorded_hash);
+      for(i = 0; i < n; i++) {
+         if(regs[i] != prev[i])
+            VG_(printf)("Guest %s not expected. runtime/recorded=0x%X/0x%X\n",
+                        checked_reg_names[i], regs[i], prev[i]);
+      }
+      VG_(show_sched_status)();
+   }
+   num_guest_state_mismatch++;
+}
+
+/* 
+ * RR_CHECK_STATE_DELTA: the words of the canonical guest state that differ
+ * from the thread's previous snapshot are logged as (index, XOR) pairs. 
+ * Replay rebuilds the recorded state from them and checks it in full.
+ */
+static void
+RR_VexGuestArchState_delta(ThreadId tid, VexGuestArchState* runtime_vex)
+{
+   VexGuestArchState* prev;
+   VexGuestArchState canon;
+
+   prev = prev_VexGuestArchState(tid);
+   if(VG_(clo_record_replay) == RECORDONLY)
+      canonical_VexGuestArchState(&canon, runtime_vex);
+   log_words_delta(tid, (UInt*)&canon, (UInt*)prev,
+                   sizeof(VexGuestArchState) / sizeof(UInt));
+
+   if(VG_(clo_record_replay) == REPLAYONLY)
+      check_VexGuestArchState(runtime_vex, prev);
+}
+
 /* replay-only code */
 static void 
 check_VexGuestArchState(VexGuestArchState* runtime_vex, VexGuestArchState* recorded_vex)
@@ -996,21 +2137,7 @@ check_VexGuestArchState(VexGuestArchState* runtime_vex, VexGuestArchState* recor
        } \
          arg_mismatch = True; \
       }
-      VEXGUESTARCHSTATE_CHECK(EAX);
-      VEXGUESTARCHSTATE_CHECK(ECX);
-      VEXGUESTARCHSTATE_CHECK(EDX);
-      VEXGUESTARCHSTATE_CHECK(EBX);
-      VEXGUESTARCHSTATE_CHECK(ESP);
-      VEXGUESTARCHSTATE_CHECK(EBP);
-      VEXGUESTARCHSTATE_CHECK(ESI);
-      VEXGUESTARCHSTATE_CHECK(EDI);
-      VEXGUESTARCHSTATE_CHECK(EIP);
-      VEXGUESTARCHSTATE_CHECK(CS);
-      VEXGUESTARCHSTATE_CHECK(DS);
-      VEXGUESTARCHSTATE_CHECK(ES);
-      VEXGUESTARCHSTATE_CHECK(FS);
-      VEXGUESTARCHSTATE_CHECK(GS);
-      VEXGUESTARCHSTATE_CHECK(SS);
+      RR_CHECKED_REGS(VEXGUESTARCHSTATE_CHECK)
       /*
        * guest_GDT and guest_LDT point to memory blocks that are used for LDT/GDT simulation.
        * The memory blocks are allocated in Valgrind core, so it is reasonable that the values 
@@ -1026,3 +2153,198 @@ check_VexGuestArchState(VexGuestArchState* runtime_vex, VexGuestArchState* recor
    }
 }
 
+
+/*********** --rr-file-refs ***********/
+
+/* record: the node of the regular file st, with one of its names, if known */
+static RRFile*
+file_node(struct vg_stat* st, const HChar* name)
+{
+   RRFile* f;
+
+   if(rr_files == NULL)
+      rr_files = VG_(HT_construct)("rr.files");
+   f = VG_(HT_lookup)(rr_files, (UWord)st->ino);
+   if(f == NULL) {
+      f = VG_(malloc)("rr.files.node", sizeof(RRFile));
+      f->key = (UWord)st->ino;
+      f->dev = st->dev;
+      f->size = st->size;
+      f->mtime = st->mtime;
+      f->mtime_nsec = st->mtime_nsec;
+      f->changed = False;
+      f->referred = False;
+      f->written = False;
+      f->copied = False;
+      f->name = name ? VG_(strdup)("rr.files.name", name) : NULL;
+      VG_(HT_add_node)(rr_files, f);
+   } else if(f->dev != st->dev) {
+      return NULL; /* another file with the same inode number, don't bother */
+   } else if(f->size != st->size || f->mtime != st->mtime 
+             || f->mtime_nsec != st->mtime_nsec) {
+      f->changed = True;
+   }
+   return f;
+}
+
+/* record: fill ref for the len bytes just read from fd into buf */
+static void 
+make_file_ref(RRFileRef* ref, Int fd, void* buf, SizeT len)
+{
+   struct vg_stat st;
+   HChar name[VKI_PATH_MAX];
+   RRFile* f;
+   Off64T pos;
+
+   VG_(memset)(ref, 0, sizeof(*ref));
+   if(VG_(fstat)(fd, &st) != 0 || !VKI_S_ISREG(st.mode))
+      return;
+   /* the read moved the file position past the bytes */
+   pos = VG_(lseek)(fd, 0, VKI_SEEK_CUR);
+   if(pos < (Off64T)len)
+      return;
+
+   f = file_node(&st, VG_(resolve_filename)(fd, name, sizeof(name)) 
+                      ? name : NULL);
+   if(f == NULL || f->changed || f->written)
+      return;
+
+   ref->dev = st.dev;
+   ref->ino = st.ino;
+   ref->size = st.size;
+   ref->mtime = st.mtime;
+   ref->mtime_nsec = st.mtime_nsec;
+   ref->off = pos - len;
+   ref->hash = ML_(hashBytes)(buf, len);
+   ref->isRef = 1;
+   f->referred = True;
+}
+
+/* RR_FILE_COPY_NAME of the log, for the file dev, ino */
+static void
+copy_name(HChar name[VKI_PATH_MAX], ULong dev, ULong ino)
+{
+   const HChar* log_name = (const HChar*)VG_(clo_log_name_rr);
+
+   vg_assert(VG_(strlen)(log_name) + 64 < VKI_PATH_MAX);
+   VG_(sprintf)(name, RR_FILE_COPY_NAME, log_name, dev, ino);
+}
+
+/* record: copy the file f, at path, to RR_FILE_COPY_NAME of the log */
+static void
+copy_file(RRFile* f, const HChar* path)
+{
+   HChar name[VKI_PATH_MAX];
+   struct vg_stat st;
+   SysRes sres;
+   Int src, dst, n;
+   UChar* buf;
+
+   sres = VG_(open)(path, VKI_O_RDONLY, 0);
+   if(sr_isError(sres))
+      return;
+   src = sr_Res(sres);
+   if(VG_(fstat)(src, &st) != 0 || st.size != f->size || st.mtime != f->mtime
+      || st.mtime_nsec != f->mtime_nsec) {
+      VG_(umsg)("RECORD warning: %s changed after it was read, the log "
+                "refers to its old contents\n", path);
+      VG_(close)(src);
+      return;
+   }
+   copy_name(name, f->dev, f->key);
+   sres = VG_(open)(name, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY, 
+                    VKI_S_IRUSR|VKI_S_IWUSR);
+   vg_assert2(!sr_isError(sres), "Can't create the copy '%s' of %s\n", 
+              name, path);
+   dst = sr_Res(sres);
+   buf = VG_(malloc)("rr.copy_file", 1 << 16);
+   while((n = VG_(read)(src, buf, 1 << 16)) > 0)
+      vg_assert2(VG_(write)(dst, buf, n) == n, "Failed to write '%s'\n", name);
+   vg_assert2(n == 0, "Failed to read %s\n", path);
+   VG_(free)(buf);
+   VG_(close)(dst);
+   VG_(close)(src);
+   f->copied = True;
+}
+
+/* record: the client is about to modify the file at path, relative to 
+   dirfd */
+static void
+modify_file(Int dirfd, const HChar* path)
+{
+   HChar buf[VKI_PATH_MAX];
+   struct vg_stat st;
+   RRFile* f;
+
+   if(path == NULL || !VG_(am_is_valid_for_client)((Addr)path, 1, VKI_PROT_READ))
+      return;
+   if(path[0] != '/' && dirfd != VKI_AT_FDCWD) {
+      if(VG_(strlen)(path) + 32 >= VKI_PATH_MAX)
+         return;
+      VG_(sprintf)(buf, "/proc/self/fd/%d/%s", dirfd, path);
+      path = buf;
+   }
+   if(sr_isError(VG_(stat)(path, &st)) || !VKI_S_ISREG(st.mode))
+      return;
+   f = file_node(&st, NULL);
+   if(f == NULL)
+      return;
+   if(f->referred && !f->copied)
+      copy_file(f, path);
+   f->written = True;
+}
+
+/* replay: read the len bytes ref refers to from fd into buf */
+static void 
+read_file_ref(RRFileRef* ref, Int fd, void* buf, SizeT len)
+{
+   HChar name[VKI_PATH_MAX];
+   struct vg_stat st;
+   SysRes sres;
+   SizeT done;
+   Int src = fd;
+
+   /* the client modified the file later on in record: it was copied */
+   copy_name(name, ref->dev, ref->ino);
+   sres = VG_(open)(name, VKI_O_RDONLY, 0);
+   if(!sr_isError(sres)) {
+      src = sr_Res(sres);
+   } else {
+      vg_assert2(VG_(fstat)(fd, &st) == 0 && st.dev == ref->dev && st.ino == ref->ino,
+                 "Replay failed. fd %d is not the file it was in record\n", fd);
+      vg_assert2(st.size == ref->size && st.mtime == ref->mtime 
+                 && st.mtime_nsec == ref->mtime_nsec,
+                 "Replay failed. The file of fd %d changed since record\n", fd);
+   }
+   for(done = 0; done < len; done += sr_Res(sres)) {
+      sres = VG_(pread)(src, (UChar*)buf + done, len - done, ref->off + done);
+      vg_assert2(!sr_isError(sres) && sr_Res(sres) > 0,
+                 "Replay failed. Can't read back %lu bytes of fd %d\n", len, fd);
+   }
+   if(src != fd)
+      VG_(close)(src);
+   vg_assert2(ML_(hashBytes)(buf, len) == ref->hash,
+              "Replay failed. The bytes read from fd %d differ from record\n", fd);
+}
+
+/* record, at exit: warn about the files referred to that changed since,
+   replaying their reads would fail */
+static void 
+check_file_refs(void)
+{
+   struct vg_stat st;
+   RRFile* f;
+
+   if(rr_files == NULL)
+      return;
+   VG_(HT_ResetIter)(rr_files);
+   while((f = VG_(HT_Next)(rr_files)) != NULL) {
+      if(!f->referred || f->copied || f->name == NULL)
+         continue;
+      if(sr_isError(VG_(stat)(f->name, &st)) || st.ino != f->key 
+         || st.size != f->size || st.mtime != f->mtime 
+         || st.mtime_nsec != f->mtime_nsec)
+         VG_(umsg)("RECORD warning: %s changed after it was read, the log "
+                   "refers to its old contents\n", f->name);
+   }
+}
@@ -38,30 +38,857 @@
 #include "pub_core_libcfile.h"
 #include "pub_core_libcassert.h"
 #include "pub_core_vki.h"
+#include "pub_core_vkiscnums.h"   /* for __NR_madvise */
+#include "pub_core_syscall.h"
+#include "pub_core_aspacemgr.h"
 #include "pub_core_threadstate.h"
 
 #include "pub_core_recordreplay.h"
 #include "priv_recordreplay.h"
 
+#include "m_debuginfo/minilzo.h"
+
+/* 
+ * The replay log file is consumed through a cursor [raw_cur, raw_end), which
+ * points either into read_buf or into a window of the log file mapped into
+ * Valgrind's address space.
+ *
+ * The log file can't be mapped until the address space manager is up, and
+ * the first entries (INITIMG_MEMLAYOUT) are read while it is starting. So 
+ * replay begins with plain VG_(read)s into read_buf, and ML_(mapLog) moves
+ * over to the mapping once the aspacemgr runs. From then on, entry headers
+ * are decoded in place and payloads are copied straight from the mapping to
+ * their destination. The window slides forward along the file, with 
+ * MADV_SEQUENTIAL read-ahead.
+ *
+ * When the log is compressed (RR_LOG_FLAG_LZO), the file holds frames, and 
+ * entries are decoded from [blk_cur, blk_end) in the current decompressed
+ * block instead.
+ */
+#define RR_READ_BUF_SIZE    (64 * 1024)
+#define RR_MAP_WINDOW_SIZE  (16 * 1024 * 1024)
+
+static UChar read_buf[RR_READ_BUF_SIZE];
+
+static UChar* raw_cur = read_buf;
+static UChar* raw_end = read_buf;
+/* raw_base is the beginning of read_buf or of the window, raw_base_off
+   is the file offset it corresponds to. */
+static UChar* raw_base = read_buf;
+static Off64T raw_base_off = 0;
+
+static Bool   log_mapped = False;
+static Off64T log_size = 0;     /* only known when log_mapped */
+
+/* version and flags of the log being replayed, from its LogFileHeader */
+static UInt  log_version = RR_LOG_VERSION_LEGACY;
+static UChar log_flags = 0;
+/* the flight recorder segment being replayed, -1 for a whole log */
+static Int   cur_segment = -1;
+
+/* for RR_LOG_FLAG_LZO: the current decompressed block, and room for a 
+   compressed one that is not contiguous in read_buf or in the window */
+static UChar  blk[RR_LOG_BLOCK_SIZE];
+static UChar* blk_cur = blk;
+static UChar* blk_end = blk;
+static UChar  zblk[RR_LZO_BOUND(RR_LOG_BLOCK_SIZE)];
+
+/* file offset of the next byte to be consumed */
+static Off64T raw_offset(void)
+{
+   return raw_base_off + (raw_cur - raw_base);
+}
+
+/* map the window of the log file that starts at (or just before) off */
+static Bool map_window(Off64T off)
+{
+   SysRes sres;
+   SizeT len;
+
+   off = VG_PGROUNDDN(off);
+   if(off >= log_size) return False;
+   len = log_size - off < RR_MAP_WINDOW_SIZE ? log_size - off : RR_MAP_WINDOW_SIZE;
+
+   sres = VG_(am_mmap_file_float_valgrind)(len, VKI_PROT_READ, ML_(log_fd_rr), off);
+   if(sr_isError(sres)) return False;
+   if(log_mapped)
+      (void)VG_(am_munmap_valgrind)((Addr)raw_base, raw_end - raw_base);
+
+   raw_base = (UChar*)sr_Res(sres);
+   raw_base_off = off;
+   raw_end = raw_base + len;
+   (void)VG_(do_syscall3)(__NR_madvise, (UWord)raw_base, len, VKI_MADV_SEQUENTIAL);
+   log_mapped = True;
+   return True;
+}
+
+/* make more bytes available after raw_cur, keeping the unconsumed ones */
+static void raw_refill(void)
+{
+   Off64T off = raw_offset();
+   Int ret;
+
+   if(log_mapped){
+      vg_assert2(map_window(off), "Error in reading replay log\n");
+      raw_cur = raw_base + (off - raw_base_off);
+      return;
+   }
+
+   if(raw_cur > read_buf){
+      VG_(memmove)(read_buf, raw_cur, raw_end - raw_cur);
+      raw_end -= raw_cur - read_buf;
+      raw_cur = read_buf;
+      raw_base_off = off;
+   }
+   ret = VG_(read)(ML_(log_fd_rr), raw_end, &read_buf[RR_READ_BUF_SIZE] - raw_end);
+   vg_assert2(ret > 0, "Error in reading replay log\n");
+   raw_end += ret;
+}
+
+static void raw_read(void* dst, SizeT len)
+{
+   UChar* p = dst;
+   SizeT n;
+   Int ret;
+
+   while(True){
+      n = raw_end - raw_cur;
+      if(n > len) n = len;
+      VG_(memcpy)(p, raw_cur, n);
+      raw_cur += n;
+      p += n;
+      len -= n;
+      if(len == 0) return;
+
+      if(!log_mapped && len >= RR_READ_BUF_SIZE){
+         /* a big payload goes straight into its destination */
+         ret = VG_(read)(ML_(log_fd_rr), p, len);
+         vg_assert2(ret == len, "Error in reading replay log\n");
+         raw_base_off += (raw_end - read_buf) + len;
+         raw_cur = raw_end = read_buf;
+         return;
+      }
+      raw_refill();
+   }
+}
+
+/* read the next frame of a compressed log into blk */
+static void next_block(void)
+{
+   LogFrameHeader fh;
+   const UChar* zsrc;
+   lzo_uint len;
+   Int rc;
+
+   raw_read(&fh, sizeof(fh));
+   vg_assert2(fh.len > 0, "Replay log ended unexpectedly\n");
+   vg_assert2(fh.len <= RR_LOG_BLOCK_SIZE && fh.zlen <= RR_LZO_BOUND(fh.len),
+              "Corrupted replay log\n");
+
+   if(fh.zlen == fh.len){ /* stored as it is */
+      raw_read(blk, fh.len);
+   } else {
+      /* decompress straight from the window when the frame is all in it */
+      if(log_mapped && raw_end - raw_cur < fh.zlen)
+         raw_refill();
+      if(raw_end - raw_cur >= fh.zlen){
+         zsrc = raw_cur;
+         raw_cur += fh.zlen;
+      } else {
+         raw_read(zblk, fh.zlen);
+         zsrc = zblk;
+      }
+      len = fh.len;
+      rc = lzo1x_decompress_safe(zsrc, fh.zlen, blk, &len, NULL);
+      vg_assert2(rc == LZO_E_OK && len == fh.len, 
+                 "Corrupted replay log: LZO error %d\n", rc);
+   }
+   blk_cur = blk;
+   blk_end = blk + fh.len;
+}
+
+static void read_log_bytes(void* dst, SizeT len)
+{
+   UChar* p = dst;
+   SizeT n;
+
+   if(!(log_flags & RR_LOG_FLAG_LZO)){
+      raw_read(dst, len);
+      return;
+   }
+
+   while(True){
+      n = blk_end - blk_cur;
+      if(n > len) n = len;
+      VG_(memcpy)(p, blk_cur, n);
+      blk_cur += n;
+      p += n;
+      len -= n;
+      if(len == 0) return;
+      next_block();
+   }
+}
+
+static UChar read_log_byte(void)
+{
+   if(log_flags & RR_LOG_FLAG_LZO){
+      if(blk_cur == blk_end)
+         next_block();
+      return *blk_cur++;
+   }
+   if(raw_cur == raw_end)
+      raw_refill();
+   return *raw_cur++;
+}
+
+void ML_(mapLog)(void)
+{
+   Off64T off;
+   Long size;
+
+   if(VG_(clo_record_replay) != REPLAYONLY || log_mapped) return;
+
+   size = VG_(fsize)(ML_(log_fd_rr));
+   if(size <= 0) return; /* not a regular file, keep on reading it */
+
+   off = raw_offset();
+   log_size = size;
+   if(!map_window(off)) return;
+   raw_cur = raw_base + (off - raw_base_off);
+}
+
+Bool ML_(logIsMapped)(void)
+{
+   return log_mapped;
+}
+
+/*************** event index of the log ***************/
+
+/* copied out of the end of the log by ML_(readLogIndex) */
+static Bool  have_index = False;
+static EventIndexEntry*  ev_index = NULL;
+static UInt              ev_index_n = 0;
+static EventIndexThread* ev_threads = NULL;
+static UInt              ev_threads_n = 0;
+static ULong ev_total = 0;
+
+/* number of entries, and of SYSCALL_ARGS entries, read so far */
+static ULong cur_event = 0;
+static ULong cur_syscalls = 0;
+
+/* copy len bytes at off in the log file to dst */
+static Bool pread_log(void* dst, SizeT len, Off64T off)
+{
+   Off64T start = VG_PGROUNDDN(off);
+   SysRes sres;
+
+   if(len == 0) return True;
+   sres = VG_(am_mmap_file_float_valgrind)(len + (off - start), VKI_PROT_READ, 
+                                           ML_(log_fd_rr), start);
+   if(sr_isError(sres)) return False;
+   VG_(memcpy)(dst, (UChar*)sr_Res(sres) + (off - start), len);
+   (void)VG_(am_munmap_valgrind)(sr_Res(sres), len + (off - start));
+   return True;
+}
+
+void ML_(readLogIndex)(void)
+{
+   LogIndexTrailer tr;
+   Long size;
+   Off64T end;
+
+   if(VG_(clo_record_replay) != REPLAYONLY || log_version == RR_LOG_VERSION_LEGACY) 
+      return;
+
+   size = VG_(fsize)(ML_(log_fd_rr));
+   if(size < (Long)(sizeof(LogFileHeader) + sizeof(tr))) return;
+   end = size - sizeof(tr);
+   if(!pread_log(&tr, sizeof(tr), end) 
+      || VG_(memcmp)(tr.magic, RR_LOG_INDEX_MAGIC, 4) != 0)
+      return; /* the recording didn't finish */
+
+   if(tr.events_off > tr.threads_off || tr.threads_off > end
+      || tr.threads_off - tr.events_off != (ULong)tr.n_event_index * sizeof(EventIndexEntry)
+      || end - tr.threads_off != (ULong)tr.n_threads * sizeof(EventIndexThread)) {
+      VG_(message)(Vg_UserMsg, "Warning: the event index of the replay log "
+                   "is corrupted, ignoring it\n");
+      return;
+   }
+
+   ev_index_n = tr.n_event_index;
+   ev_threads_n = tr.n_threads;
+   ev_index = VG_(malloc)("rr.readLogIndex.1", 
+                          (ev_index_n + 1) * sizeof(EventIndexEntry));
+   ev_threads = VG_(malloc)("rr.readLogIndex.2", 
+                            (ev_threads_n + 1) * sizeof(EventIndexThread));
+   if(!pread_log(ev_index, ev_index_n * sizeof(EventIndexEntry), tr.events_off)
+      || !pread_log(ev_threads, ev_threads_n * sizeof(EventIndexThread), tr.threads_off)) {
+      VG_(free)(ev_index);
+      VG_(free)(ev_threads);
+      ev_index = NULL;
+      ev_threads = NULL;
+      return;
+   }
+   ev_total = tr.n_events;
+   have_index = True;
+}
+
+ULong ML_(currentEvent)(void)
+{
+   return cur_event;
+}
+
+ULong ML_(currentSyscall)(void)
+{
+   return cur_syscalls;
+}
+
+ULong ML_(numEvents)(void)
+{
+   return ev_total;
+}
+
+/* syscalls of tid before ev_index[i], or of all threads if tid is 0 */
+static ULong syscalls_before(Int i, ThreadId tid)
+{
+   const EventIndexEntry* ie = &ev_index[i];
+   UInt j;
+
+   if(tid == VG_INVALID_THREADID)
+      return ie->n_syscalls;
+   for(j = 0; j < ie->n_threads; j++)
+      if(ev_threads[ie->threads_off + j].tid == tid)
+         return ev_threads[ie->threads_off + j].n_syscalls;
+   return 0;
+}
+
+static void fill_pos(RRLogPos* pos, Int i, ThreadId tid)
+{
+   if(i < 0){
+      VG_(memset)(pos, 0, sizeof(*pos)); /* the beginning of the log */
+      return;
+   }
+   pos->event_no = ev_index[i].event_no;
+   pos->stream_off = ev_index[i].stream_off;
+   pos->n_syscalls = syscalls_before(i, tid);
+   pos->dispatch_ctr = ev_index[i].dispatch_ctr;
+}
+
+Bool ML_(findEvent)(ULong event_no, RRLogPos* pos)
+{
+   Int lo = 0, hi = ev_index_n - 1, mid;
+
+   if(!have_index || event_no >= ev_total) return False;
+
+   /* the last index entry at or before event_no */
+   while(lo <= hi){
+      mid = lo + (hi - lo) / 2;
+      if(ev_index[mid].event_no <= event_no)
+         lo = mid + 1;
+      else
+         hi = mid - 1;
+   }
+   fill_pos(pos, hi, VG_INVALID_THREADID);
+   return True;
+}
+
+Bool ML_(findSyscall)(ThreadId tid, ULong nth, RRLogPos* pos)
+{
+   Int lo = 0, hi = ev_index_n - 1, mid;
+
+   /* the last index entry tells how many syscalls there are in total */
+   if(!have_index || ev_index_n == 0 || nth >= syscalls_before(ev_index_n - 1, tid)) 
+      return False;
+
+   /* the last index entry before the (nth+1)th syscall of tid */
+   while(lo <= hi){
+      mid = lo + (hi - lo) / 2;
+      if(syscalls_before(mid, tid) <= nth)
+         lo = mid + 1;
+      else
+         hi = mid - 1;
+   }
+   fill_pos(pos, hi, tid);
+   return True;
+}
+
+/*************** side store of payloads ***************/
+
+/* 
+ * With RR_LOG_FLAG_STORE, the payloads of some DATA2 entries are in the 
+ * side store. It is complete when replay starts, so it is mapped whole the
+ * first time it is needed, and a payload referred to many times is copied
+ * out of the same pages each time. Until the aspacemgr runs, it is read 
+ * with VG_(pread) instead.
+ *
+ * A large payload at the page offset of its buffer (--rr-map-reads) is not
+ * copied at all, but for its first and last partial pages: the store pages
+ * are mapped privately over the whole pages of the buffer, so replaying a 
+ * large read costs page faults on the pages the client touches. Only a 
+ * buffer in private anonymous memory is mapped over: a shared one would 
+ * stop being shared with the processes forked before.
+ */
+static Int    store_fd = -1;
+static Long   store_size = 0;
+static UChar* store_map = NULL;
+
+/* where the payload of the DATA2 entry decoded last is, when it is in the
+   store: the entry decoded last is always the next one consumed */
+static Bool  in_store = False;
+static ULong in_store_off = 0;
+
+static void open_store(void)
+{
+   const HChar* log_name = (const HChar*)VG_(clo_log_name_rr);
+   HChar name[VKI_PATH_MAX];
+   SysRes sres;
+
+   vg_assert(VG_(strlen)(log_name) + sizeof(RR_STORE_SUFFIX) <= VKI_PATH_MAX);
+   VG_(sprintf)(name, "%s%s", log_name, RR_STORE_SUFFIX);
+   sres = VG_(open)(name, VKI_O_RDONLY, 0);
+   vg_assert2(!sr_isError(sres), "Can't open the record store '%s' (%s)\n",
+              name, VG_(strerror)(sr_Err(sres)));
+   store_fd = VG_(safe_fd)(sr_Res(sres));
+   VG_(fcntl)(store_fd, VKI_F_SETFD, VKI_FD_CLOEXEC);
+   store_size = VG_(fsize)(store_fd);
+   vg_assert2(store_size >= 0, "Can't read the record store '%s'\n", name);
+}
+
+/* True when [a, a+len) is in a single private mapping, as the kernel 
+   tells in /proc/self/maps: aspacem records MAP_SHARED anonymous memory 
+   as SkAnonC too */
+static Bool kernel_maps_private(Addr a, SizeT len)
+{
+   HChar buf[VKI_PATH_MAX + 256];
+   HChar *line, *nl, *p;
+   Addr start, end;
+   SysRes sres;
+   Int fd, n, used = 0;
+   Bool found = False, priv = False;
+
+   sres = VG_(open)("/proc/self/maps", VKI_O_RDONLY, 0);
+   if(sr_isError(sres))
+      return False;
+   fd = sr_Res(sres);
+   while(!found){
+      n = VG_(read)(fd, buf + used, sizeof(buf) - 1 - used);
+      if(n <= 0)
+         break;
+      used += n;
+      buf[used] = 0;
+      line = buf;
+      while(!found && (nl = VG_(strchr)(line, '\n')) != NULL){
+         *nl = 0;
+         /* start-end perms ... */
+         start = (Addr)VG_(strtoull16)(line, &p);
+         if(*p == '-'){
+            end = (Addr)VG_(strtoull16)(p + 1, &p);
+            if(start <= a && a < end){
+               found = True;
+               priv = a + len <= end && VG_(strlen)(p) >= 5 && p[4] == 'p';
+            }
+         }
+         line = nl + 1;
+      }
+      used -= line - buf;
+      VG_(memmove)(buf, line, used);
+      /* no line of a mapping we look for is that long */
+      if(used == sizeof(buf) - 1)
+         used = 0;
+   }
+   VG_(close)(fd);
+   return priv;
+}
+
+/* map the store pages at off over [a, a+len), both page aligned; False 
+   unless that is plain private client data: not the heap, nor a stack
+   growing down into the reservation below it, nor memory shared with 
+   another process */
+static Bool map_store_pages(Addr a, SizeT len, ULong off)
+{
+   NSegment const* seg = VG_(am_find_nsegment)(a);
+   NSegment const* below;
+   SysRes sres;
+
+   if(seg == NULL || seg->kind != SkAnonC || seg->isCH || a + len - 1 > seg->end
+      || !seg->hasR || !seg->hasW || seg->hasX)
+      return False;
+   below = seg->start > 0 ? VG_(am_find_nsegment)(seg->start - 1) : NULL;
+   if(below != NULL && below->kind == SkResvn) 
+      return False;
+   if(!kernel_maps_private(a, len))
+      return False;
+
+   sres = VG_(am_mmap_file_fixed_client)(a, len, VKI_PROT_READ|VKI_PROT_WRITE,
+                                         store_fd, off);
+   return !sr_isError(sres);
+}
+
+/* copy the len bytes at off in the store to dst */
+static void read_store(void* dst, SizeT len, ULong off)
+{
+   Addr a0 = VG_PGROUNDUP((Addr)dst);
+   Addr a1 = VG_PGROUNDDN((Addr)dst + len);
+
+   SysRes sres;
+   Int n;
+
+   if(store_fd == -1)
+      open_store();
+   vg_assert2(off + len <= store_size, "Record store is truncated\n");
+
+   if(store_map == NULL && store_size > 0){
+      sres = VG_(am_mmap_file_float_valgrind)(store_size, VKI_PROT_READ, 
+                                              store_fd, 0);
+      if(!sr_isError(sres))
+         store_map = (UChar*)sr_Res(sres);
+   }
+   if(store_map != NULL){
+      if(len >= RR_MAP_MIN_LEN && a1 > a0 
+         && (off & (VKI_PAGE_SIZE-1)) == ((Addr)dst & (VKI_PAGE_SIZE-1))
+         && map_store_pages(a0, a1 - a0, off + (a0 - (Addr)dst))){
+         VG_(memcpy)(dst, store_map + off, a0 - (Addr)dst);
+         VG_(memcpy)((void*)a1, store_map + off + (a1 - (Addr)dst), 
+                     (Addr)dst + len - a1);
+         return;
+      }
+      VG_(memcpy)(dst, store_map + off, len);
+      return;
+   }
+
+   for(; len > 0; dst = (UChar*)dst + n, off += n, len -= n){
+      sres = VG_(pread)(store_fd, dst, len, off);
+      vg_assert2(!sr_isError(sres) && sr_Res(sres) > 0, 
+                 "Error in reading the record store\n");
+      n = sr_Res(sres);
+   }
+}
+
+/*************** decoding of log entries ***************/
+
+static LogCodecState dec;
+
+static ULong get_uleb(void)
+{
+   ULong v = 0;
+   UInt shift = 0;
+   UChar b;
+
+   do {
+      b = read_log_byte();
+      vg_assert2(shift < 64, "Corrupted replay log\n");
+      v |= ((ULong)(b & 0x7f)) << shift;
+      shift += 7;
+   } while(b & 0x80);
+   return v;
+}
+
+static Long get_sleb(void)
+{
+   ULong v = get_uleb();
+   return RR_UNZIGZAG(v);
+}
+
+/* inverse of record.c/encode_entry */
+static void decode_entry(LogEntry* recorded)
+{
+   UChar tag = read_log_byte();
+
+   recorded->type = tag & RR_TAG_TYPE_MASK;
+   if(!(tag & RR_TAG_SAME_TID))
+      dec.prev_tid = (UInt)((Long)dec.prev_tid + get_sleb());
+   recorded->tid = dec.prev_tid;
+
+   switch(recorded->type){
+      case CLIENT_CMDLINE:
+         recorded->u.client_cmdline.len = get_uleb();
+         recorded->u.client_cmdline.addr = NULL;
+         break;
+
+      case SYSCALL_ARGS:
+         recorded->u.syscall_args.sysno = get_uleb();
+         recorded->u.syscall_args.tid = (tag & RR_TAG_AUX) ? get_uleb() : recorded->tid;
+         break;
+
+      case SYSCALL_RET:
+         recorded->u.syscall_ret = (ULong)get_sleb();
+         break;
+
+      case SYSCALL_DISPATCH_CTR:
+         recorded->u.syscall_dispatch_ctr.isBefore = (tag & RR_TAG_AUX) ? 1 : 0;
+         dec.prev_ctr = (UWord)((Long)dec.prev_ctr + get_sleb());
+         recorded->u.syscall_dispatch_ctr.counter = dec.prev_ctr;
+         break;
+
+      case THREAD_CREATE:
+         recorded->u.thread_create.vg_tid = get_uleb();
+         recorded->u.thread_create.lwpid = get_uleb();
+         break;
+
+      case THREAD_EXIT:
+         break;
+
+      case ACQUIRE_BIGLOCK:
+         recorded->u.acquire_biglock.tid = get_uleb();
+         if(log_flags & RR_LOG_FLAG_SWITCHES)
+            dec.prev_release += get_uleb();
+         recorded->u.acquire_biglock.release_no = dec.prev_release;
+         recorded->u.acquire_biglock.type = (tag & RR_TAG_AUX) ? get_uleb() : CALLER_NORMAL;
+         break;
+
+      case RELEASE_BIGLOCK:
+         if(tag & RR_TAG_AUX){
+            ULong i = get_uleb();
+            vg_assert2(i < dec.n_who, "Corrupted replay log\n");
+            VG_(memcpy)(recorded->u.release_biglock.who, dec.who[i], 16);
+         } else {
+            ULong len = get_uleb();
+            vg_assert2(len <= 16, "Corrupted replay log\n");
+            VG_(memset)(recorded->u.release_biglock.who, 0, 16);
+            read_log_bytes(recorded->u.release_biglock.who, len);
+            if(dec.n_who < RR_WHO_DICT_SIZE){
+               VG_(memcpy)(dec.who[dec.n_who], recorded->u.release_biglock.who, 16);
+               dec.n_who++;
+            }
+         }
+         break;
+
+#if defined(VGA_x86) || defined(VGA_amd64)
+      case RDTSC:
+         dec.prev_tsc += (ULong)get_sleb();
+         recorded->u.rdtsc.eax = (UInt)dec.prev_tsc;
+         recorded->u.rdtsc.edx = (UInt)(dec.prev_tsc >> 32);
+         break;
+
+      case CLOCK:
+         dec.prev_tsc += (ULong)get_sleb();
+         recorded->u.clock.tsc = dec.prev_tsc;
+         recorded->u.clock.sync = (tag & RR_TAG_AUX) ? 1 : 0;
+         break;
+#endif
+
+      case INITIMG_CLSTK:
+         recorded->u.initimg_clstk.stksz = get_uleb();
+         recorded->u.initimg_clstk.auxv_addr = get_uleb();
+         break;
+
+      case INITIMG_MEMLAYOUT:
+         recorded->u.initimg_memlayout.vstart = get_uleb();
+         recorded->u.initimg_memlayout.clstk_top = get_uleb();
+         break;
+
+      case DATA1:
+      case DATA2:
+         recorded->u.data.len = get_uleb();
+         recorded->u.data.addr = NULL;
+         in_store = (tag & RR_TAG_AUX) != 0;
+         if(in_store){
+            vg_assert2(recorded->type == DATA2 && (log_flags & RR_LOG_FLAG_STORE),
+                       "bad log entry\n");
+            in_store_off = get_uleb();
+         }
+         break;
+
+      default:
+         vg_assert2(0, "bad log entry\n");
+   }
+}
+
+void ML_(readLogHeader)(void)
+{
+   LogFileHeader hdr;
+
+   if(VG_(clo_record_replay) != REPLAYONLY) return;
+   VG_(memset)(&dec, 0, sizeof(dec));
+
+   raw_refill();
+   if(raw_end - raw_cur < sizeof(hdr) || VG_(memcmp)(raw_cur, RR_LOG_MAGIC, 4) != 0){
+      /* no header: a log from before the compact format, leave it unread */
+      log_version = RR_LOG_VERSION_LEGACY;
+      return;
+   }
+
+   raw_read(&hdr, sizeof(hdr));
+   vg_assert2(hdr.version == RR_LOG_VERSION_COMPACT, 
+              "Replay log version %d is not supported\n", hdr.version);
+   vg_assert2(hdr.segment == 0 || cur_segment >= 0,
+              "Replay log is a flight recorder segment, it can only be replayed "
+              "from its snapshot\n");
+   vg_assert2((hdr.flags & ~(RR_LOG_FLAG_LZO | RR_LOG_FLAG_SWITCHES 
+                             | RR_LOG_FLAG_THREAD_EXITS 
+                             | RR_LOG_FLAG_AUTO_SYSCALLS
+                             | RR_LOG_FLAG_STATE_MASK
+                             | RR_LOG_FLAG_STORE
+                             | RR_LOG_FLAG_FILE_REFS)) == 0, 
+              "Replay log flags 0x%x are not supported\n", hdr.flags);
+   vg_assert2(hdr.reserved == 0, 
+              "Replay log flags 0x%x in the reserved byte are not supported\n",
+              hdr.reserved);
+   log_version = hdr.version;
+   log_flags = hdr.flags;
+}
+
+Bool ML_(logHasSwitchesOnly)(void)
+{
+   return (log_flags & RR_LOG_FLAG_SWITCHES) != 0;
+}
+
+Bool ML_(logHasThreadExits)(void)
+{
+   return (log_flags & RR_LOG_FLAG_THREAD_EXITS) != 0;
+}
+
+Bool ML_(logHasAutoSyscalls)(void)
+{
+   return (log_flags & RR_LOG_FLAG_AUTO_SYSCALLS) != 0;
+}
+
+RRCheckState ML_(logCheckState)(void)
+{
+   return (log_flags & RR_LOG_FLAG_STATE_MASK) >> RR_LOG_FLAG_STATE_SHIFT;
+}
+
+Bool ML_(logHasFileRefs)(void)
+{
+   return (log_flags & RR_LOG_FLAG_FILE_REFS) != 0;
+}
+
+/* An entry (but not its payload) read ahead by ML_(peekLogType) */
+static LogEntry ahead;
+static Bool have_ahead = False;
+
+/*************** flight recorder segments, forked children ***************/
+
+/* go on with the log file fd, from its beginning, as with the log file at
+   the beginning of the replay */
+static void restart_log(Int fd)
+{
+   if(log_mapped)
+      (void)VG_(am_munmap_valgrind)((Addr)raw_base, raw_end - raw_base);
+   raw_base = raw_cur = raw_end = read_buf;
+   raw_base_off = 0;
+   log_mapped = False;
+   log_size = 0;
+   blk_cur = blk_end = blk;
+   if(have_index){
+      VG_(free)(ev_index);
+      VG_(free)(ev_threads);
+      ev_index = NULL;
+      ev_threads = NULL;
+      have_index = False;
+   }
+   ev_index_n = ev_threads_n = 0;
+   ev_total = 0;
+   cur_event = cur_syscalls = 0;
+   vg_assert(!have_ahead);
+   if(store_fd != -1){
+      if(store_map != NULL)
+         (void)VG_(am_munmap_valgrind)((Addr)store_map, store_size);
+      VG_(close)(store_fd);
+      store_fd = -1;
+      store_map = NULL;
+      store_size = 0;
+   }
+
+   VG_(close)(ML_(log_fd_rr));
+   ML_(log_fd_rr) = VG_(safe_fd)(fd);
+   VG_(fcntl)(ML_(log_fd_rr), VKI_F_SETFD, VKI_FD_CLOEXEC);
+   ML_(readLogHeader)();
+   ML_(mapLog)();
+   ML_(readLogIndex)();
+}
+
+/* go on with the segment-th segment of the flight recorder; False if 
+   there is no such file */
+static Bool open_segment(UInt segment)
+{
+   const HChar* log_name = (const HChar*)VG_(clo_log_name_rr);
+   HChar name[VKI_PATH_MAX];
+   SysRes sres;
+
+   vg_assert(VG_(strlen)(log_name) + 12 <= VKI_PATH_MAX);
+   VG_(sprintf)(name, RR_SEGMENT_NAME, log_name, segment);
+   sres = VG_(open)(name, VKI_O_RDONLY, 0);
+   if(sr_isError(sres))
+      return False;
+
+   cur_segment = segment;
+   restart_log(sr_Res(sres));
+   return True;
+}
+
+void ML_(replayLog)(const HChar* name)
+{
+   SysRes sres;
+
+   vg_assert(VG_(clo_record_replay) == REPLAYONLY);
+   sres = VG_(open)(name, VKI_O_RDONLY, 0);
+   vg_assert2(!sr_isError(sres), "Can't open the replay log '%s' (%s)\n",
+              name, VG_(strerror)(sr_Err(sres)));
+   cur_segment = -1;
+   restart_log(sr_Res(sres));
+}
+
+void ML_(replaySegments)(UInt segment)
+{
+   vg_assert(VG_(clo_record_replay) == REPLAYONLY);
+   vg_assert2(open_segment(segment), 
+              "Can't open the flight recorder segment %u\n", segment);
+}
+
+/* at the end of a segment, the next one takes over */
+static void maybe_next_segment(void)
+{
+   if(cur_segment >= 0 && !have_ahead && have_index && cur_event >= ev_total)
+      (void)open_segment(cur_segment + 1);
+}
+
+static void read_entry(LogEntry* recorded)
+{
+   maybe_next_segment();
+   if(have_ahead){
+      *recorded = ahead;
+      have_ahead = False;
+   } else if(log_version == RR_LOG_VERSION_LEGACY)
+      read_log_bytes(recorded, sizeof(LogEntry));
+   else
+      decode_entry(recorded);
+}
+
+Bool ML_(peekLog)(LogEntry* next)
+{
+   maybe_next_segment();
+   if(!have_ahead){
+      if(have_index && cur_event >= ev_total)
+         return False;
+      read_entry(&ahead);
+      have_ahead = True;
+   }
+   *next = ahead;
+   return True;
+}
+
 void ML_(readFromLog)(LogEntry* rt_ent)
 {
    /* The following fields of rt_ent should already be filled:
         rt_ent->tid, rt_ent->type, rt_ent->aux_len, and rt_ent->aux_addr(if aux_len > 0)
     */   
    LogEntry* recorded;
-   UInt ret;
    
    if(VG_(clo_record_replay) != REPLAYONLY) return;
    recorded = alloca(sizeof(LogEntry));
-   ret = VG_(read)(ML_(log_fd_rr), recorded, sizeof(LogEntry)); 
-   vg_assert2(ret == sizeof(LogEntry), "Error in reading replay log\n"); 
+   read_entry(recorded);
+   cur_event++;
+   if(recorded->type == SYSCALL_ARGS)
+      cur_syscalls++;
    
    /*************** sanity check *******************/ 
    vg_assert2(rt_ent->type == recorded->type, "Log entry not expected. "
                 "Log type:runtime/recorded=%d/%d\n", rt_ent->type, recorded->type);
    vg_assert2(rt_ent->tid == recorded->tid, "Log entry not expected. "
                 "Thread id:runtime/recorded=%d/%d\n", rt_ent->tid, recorded->tid);
-   vg_assert2(rt_ent->tid < 1024, "thread id %d is bigger than 1024, not supported for now\n", rt_ent->tid);
+   vg_assert2(rt_ent->tid < VG_N_THREADS, "thread id %d is not below VG_N_THREADS (%d)\n", 
+              rt_ent->tid, VG_N_THREADS);
 
    switch(rt_ent->type){
       case CLIENT_CMDLINE:
@@ -103,15 +930,13 @@ void ML_(readFromLog)(LogEntry* rt_ent)
 
       case THREAD_CREATE: 
          rt_ent->u.thread_create.vg_tid = recorded->u.thread_create.vg_tid;
-         vg_assert2(recorded->u.thread_create.vg_tid < 1024, "thread id number too big: %d\n", 
+         vg_assert2(recorded->u.thread_create.vg_tid < VG_N_THREADS, "thread id number too big: %d\n", 
                        recorded->u.thread_create.vg_tid);
          rt_ent->u.thread_create.lwpid = recorded->u.thread_create.lwpid;
          break;
 
-/*
-      case THREAD_EXIT:
+      case THREAD_EXIT: /* the tids were checked above */
          break;
-*/
 
       case ACQUIRE_BIGLOCK:
          vg_assert(recorded->u.acquire_biglock.tid < VG_N_THREADS);
@@ -128,6 +953,10 @@ void ML_(readFromLog)(LogEntry* rt_ent)
       case RDTSC:
          rt_ent->u.rdtsc = recorded->u.rdtsc;
          break;
+
+      case CLOCK:
+         rt_ent->u.clock = recorded->u.clock;
+         break;
 #endif
       
       case INITIMG_MEMLAYOUT:
@@ -155,15 +984,17 @@ void ML_(readFromLog)(LogEntry* rt_ent)
    }
    /*********** end of sanity check ****************/
 
-   if((rt_ent->type == DATA1 || rt_ent->type == DATA2) && rt_ent->u.data.len > 0){
-      ret = VG_(read)(ML_(log_fd_rr), rt_ent->u.data.addr, rt_ent->u.data.len);
-      vg_assert2(ret == rt_ent->u.data.len, "Error in reading replay log\n"); 
+   if(rt_ent->type == DATA2 && in_store){
+      in_store = False;
+      read_store(rt_ent->u.data.addr, rt_ent->u.data.len, in_store_off);
+   }
+   else if((rt_ent->type == DATA1 || rt_ent->type == DATA2) && rt_ent->u.data.len > 0){
+      read_log_bytes(rt_ent->u.data.addr, rt_ent->u.data.len);
    }
    else if(rt_ent->type == CLIENT_CMDLINE){
       UInt len = rt_ent->u.client_cmdline.len;
       rt_ent->u.client_cmdline.addr = (Char*)VG_(malloc)("rr.load_record_data", len+1);
-      ret = VG_(read)(ML_(log_fd_rr), rt_ent->u.client_cmdline.addr, len);
-      vg_assert2(ret == len, "Error in reading replay log\n"); 
+      read_log_bytes(rt_ent->u.client_cmdline.addr, len);
       rt_ent->u.client_cmdline.addr[len] = '\0';
    }
 }
@@ -0,0 +1,331 @@
+/*******************************************************************
+   This file is part of Valgrind, a dynamic binary instrumentation
+   framework.
+
+   Copyright (C) 2008
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+********************************************************************/
+
+/*
+ * tree.c --
+ *
+ *      Recording and replaying a process tree: a log for every process,
+ *      and the joint schedule of the forks and execs of all of them.
+ */
+
+#include "pub_core_basics.h"
+#include "pub_core_vki.h"
+#include "pub_core_vkiscnums.h"
+#include "pub_core_libcbase.h"
+#include "pub_core_libcassert.h"
+#include "pub_core_libcprint.h"
+#include "pub_core_libcfile.h"
+#include "pub_core_libcproc.h"
+#include "pub_core_syscall.h"
+#include "pub_core_aspacemgr.h"
+#include "pub_core_threadstate.h"
+#include "pub_core_recordreplay.h"
+#include "priv_recordreplay.h"
+
+/*
+ * The process Valgrind is started on is the root of the tree. It records
+ * to the log --log-file-rr names, with %p expanded to its pid. Every other
+ * process of the tree, a forked child or the image an exec starts, has a
+ * log of its own: RR_TREE_LOG_NAME of the root's log, of its pid and of
+ * the number of its fork or exec in the joint schedule. So the processes
+ * of a pre-fork server record in parallel, each one with its log writer.
+ * The log names are made absolute, for a chdir of the client not to move
+ * the logs that come later.
+ *
+ * The joint schedule numbers the forks and execs of the whole tree in the
+ * order they happen. Every fork or exec takes the next number from a
+ * counter shared by the tree, in the file named like the root's log plus
+ * RR_TREE_SUFFIX, and logs it in an RRProcessEvent. A forked child
+ * inherits the mapping of the counter; an exec passes the root's log on to
+ * the new Valgrind with --rr-tree, along with the log of the new image.
+ *
+ * Replay is started on the root's log, and goes through the same forks and
+ * execs: a forked child goes on with the log of the child of the same
+ * fork, and an exec'd image with that of the image, named from the
+ * recorded pid. A fork or exec waits until all the ones numbered before it
+ * are replayed, counted by a second counter in the same file, so that the
+ * tree is replayed in the order it was recorded. Two replays of the same
+ * recording can't run at the same time.
+ */
+typedef struct RRTreeCounters{
+   UInt next;       /* record: number of the next fork or exec */
+   UInt replayed;   /* replay: forks and execs replayed so far */
+}RRTreeCounters;
+
+static volatile RRTreeCounters* tree = NULL;
+/* no joint schedule to wait for: its file can't be mapped, or this is a
+   flight recorder replay */
+static Bool tree_off = False;
+
+/* the log of this process, and the root's */
+static HChar log_name[VKI_PATH_MAX];
+static HChar root_name[VKI_PATH_MAX];
+
+/* the fork going on, between ML_(preFork) and ML_(postFork) */
+static RRProcessEvent fork_ev;
+
+/* out is name, absolute; with expand, %p is this process' pid */
+static void absolute_name(HChar* out, const HChar* name, Bool expand)
+{
+   SysRes sres;
+   Int j = 0;
+
+   if(name[0] != '/'){
+      sres = VG_(do_syscall2)(__NR_getcwd, (UWord)out, VKI_PATH_MAX - 1);
+      vg_assert2(!sr_isError(sres), "Can't get the working directory\n");
+      j = VG_(strlen)(out);
+      out[j++] = '/';
+   }
+   for(; *name != '\0'; name++){
+      vg_assert2(j + 12 < VKI_PATH_MAX, "Replay log name too long\n");
+      if(expand && name[0] == '%' && name[1] == 'p'){
+         j += VG_(sprintf)(&out[j], "%d", VG_(getpid)());
+         name++;
+      } else if(expand && name[0] == '%' && name[1] == '%'){
+         out[j++] = '%';
+         name++;
+      } else
+         out[j++] = *name;
+   }
+   out[j] = '\0';
+}
+
+void ML_(setupLogName)(void)
+{
+   Bool root = VG_(clo_rr_tree) == NULL;
+
+   /* the log of any other process is already named for it */
+   absolute_name(log_name, (HChar*)VG_(clo_log_name_rr),
+                 root && VG_(clo_record_replay) == RECORDONLY);
+   if(root)
+      VG_(strcpy)(root_name, log_name);
+   else
+      absolute_name(root_name, VG_(clo_rr_tree), False);
+   VG_(clo_log_name_rr) = (Char*)log_name;
+}
+
+/* map the counters of the tree, the first time they are needed */
+static Bool map_tree(void)
+{
+   static const UChar zeros[VKI_PAGE_SIZE];
+   HChar name[VKI_PATH_MAX];
+   Bool create = VG_(clo_record_replay) == RECORDONLY
+                 && VG_(clo_rr_tree) == NULL;
+   SysRes sres;
+   Int fd;
+
+   if(tree != NULL) return True;
+   if(tree_off) return False;
+
+   vg_assert(VG_(strlen)(root_name) + sizeof(RR_TREE_SUFFIX) <= VKI_PATH_MAX);
+   VG_(sprintf)(name, "%s%s", root_name, RR_TREE_SUFFIX);
+   sres = VG_(open)(name, create ? VKI_O_CREAT|VKI_O_RDWR|VKI_O_TRUNC
+                                 : VKI_O_RDWR,
+                    VKI_S_IRUSR|VKI_S_IWUSR);
+   if(!sr_isError(sres)){
+      fd = sr_Res(sres);
+      if(!create || VG_(write)(fd, zeros, sizeof(zeros)) == sizeof(zeros))
+         sres = VG_(am_shared_mmap_file_float_valgrind)(VKI_PAGE_SIZE,
+                   VKI_PROT_READ|VKI_PROT_WRITE, fd, 0);
+      else
+         sres = VG_(mk_SysRes_Error)(VKI_EIO);
+      VG_(close)(fd);
+   }
+   if(sr_isError(sres)){
+      vg_assert2(VG_(clo_record_replay) == REPLAYONLY,
+                 "Can't set up the process tree file '%s' (%s)\n",
+                 name, VG_(strerror)(sr_Err(sres)));
+      VG_(message)(Vg_UserMsg, "Warning: can't map the process tree file "
+                   "'%s', processes are replayed in any order\n", name);
+      tree_off = True;
+      return False;
+   }
+   tree = (RRTreeCounters*)sr_Res(sres);
+   /* the replay starts over where the root does */
+   if(VG_(clo_record_replay) == REPLAYONLY && VG_(clo_rr_tree) == NULL)
+      tree->replayed = 0;
+   return True;
+}
+
+/* the number of the next fork or exec of the tree */
+static UInt next_seq(void)
+{
+   map_tree();
+   return __sync_fetch_and_add(&tree->next, 1);
+}
+
+/* replay: wait until the forks and execs before seq are replayed */
+static void wait_turn(UInt seq)
+{
+   UInt done;
+
+   if(!map_tree()) return;
+   /* a restarted checkpoint replays them again: no wait then */
+   while((done = tree->replayed) < seq)
+      (void)VG_(do_syscall4)(__NR_futex, (UWord)&tree->replayed,
+                             VKI_FUTEX_WAIT, done, 0);
+}
+
+static void turn_done(UInt seq)
+{
+   if(tree == NULL) return;
+   if(__sync_bool_compare_and_swap(&tree->replayed, seq, seq + 1))
+      (void)VG_(do_syscall3)(__NR_futex, (UWord)&tree->replayed,
+                             VKI_FUTEX_WAKE, 0x7fffffff);
+}
+
+/* log or read the RRProcessEvent of this fork or exec */
+static void process_event(ThreadId tid, RRProcessEvent* ev)
+{
+   LogEntry le;
+
+   le.type = DATA1;
+   le.tid = tid;
+   le.u.data.len = sizeof(RRProcessEvent);
+   le.u.data.addr = ev;
+   if(VG_(clo_record_replay) == RECORDONLY)
+      ML_(writeToLog)(&le);
+   else
+      ML_(readFromLog)(&le);
+}
+
+static void tree_log_name(HChar* name, Int pid, UInt seq)
+{
+   vg_assert(VG_(strlen)(root_name) + 24 <= VKI_PATH_MAX);
+   VG_(sprintf)(name, RR_TREE_LOG_NAME, root_name, pid, seq);
+}
+
+void ML_(preFork)(ThreadId tid)
+{
+   if(VG_(clo_record_replay) == RECORDONLY){
+      /* nothing the parent has logged may end up in the child's log */
+      ML_(drainLog)();
+      fork_ev.seq = next_seq();
+   } else if(VG_(clo_record_replay) == REPLAYONLY){
+      /* the parent logs it after the fork, but nothing comes between */
+      process_event(tid, &fork_ev);
+      vg_assert2(fork_ev.kind == RR_PROC_FORK, "Log entry not expected. "
+                 "Process event: runtime/recorded=%u/%u\n", 
+                 RR_PROC_FORK, fork_ev.kind);
+      wait_turn(fork_ev.seq);
+   }
+}
+
+/* the child of the fork goes on with a log of its own */
+static void child_log(void)
+{
+   HChar name[VKI_PATH_MAX];
+   SysRes sres;
+   Int fd;
+
+   tree_log_name(name, VG_(clo_record_replay) == RECORDONLY ? VG_(getpid)()
+                                                          : fork_ev.pid,
+                 fork_ev.seq);
+   VG_(strcpy)(log_name, name);
+   ML_(checkpointsAtFork)();
+
+   if(VG_(clo_record_replay) == REPLAYONLY){
+      ML_(replayLog)(log_name);
+      return;
+   }
+   sres = VG_(open)(log_name, VKI_O_CREAT|VKI_O_WRONLY|VKI_O_TRUNC,
+                    VKI_S_IRUSR|VKI_S_IWUSR);
+   vg_assert2(!sr_isError(sres), "Can't create the record log '%s' (%s)\n",
+              log_name, VG_(strerror)(sr_Err(sres)));
+   fd = VG_(safe_fd)(sr_Res(sres));
+   VG_(fcntl)(fd, VKI_F_SETFD, VKI_FD_CLOEXEC);
+   VG_(close)(ML_(log_fd_rr));
+   ML_(startLogSegment)(fd, 0);
+}
+
+void ML_(postFork)(ThreadId tid, SysRes* res)
+{
+   Bool child = !sr_isError(*res) && sr_Res(*res) == 0;
+
+   if(VG_(clo_record_replay) == RECORDONLY){
+      if(child){
+         child_log();
+         return;
+      }
+      fork_ev.kind = RR_PROC_FORK;
+      fork_ev.pid = sr_isError(*res) ? -(Int)sr_Err(*res) : (Int)sr_Res(*res);
+      fork_ev.pad = 0;
+      process_event(tid, &fork_ev);
+   } else if(VG_(clo_record_replay) == REPLAYONLY){
+      if(child){
+         /* the recorded fork failed: this child never was */
+         if(fork_ev.pid < 0)
+            VG_(exit)(0);
+         child_log();
+         return;
+      }
+      vg_assert2(!sr_isError(*res) || fork_ev.pid < 0,
+                 "The replay can't fork (%s)\n", VG_(strerror)(sr_Err(*res)));
+      turn_done(fork_ev.seq);
+      *res = fork_ev.pid < 0 ? VG_(mk_SysRes_Error)(-fork_ev.pid)
+                             : VG_(mk_SysRes_Success)(fork_ev.pid);
+   }
+}
+
+HChar** ML_(exec)(ThreadId tid, Bool traced)
+{
+   static HChar log_arg[VKI_PATH_MAX + 16];
+   static HChar tree_arg[VKI_PATH_MAX + 16];
+   static HChar* args[3];
+   RRProcessEvent ev;
+   UInt kind = traced ? RR_PROC_EXEC : RR_PROC_EXEC_OUT;
+   HChar name[VKI_PATH_MAX];
+
+   if(VG_(clo_record_replay) == RECORDONLY){
+      ev.seq = next_seq();
+      ev.kind = kind;
+      ev.pid = VG_(getpid)();
+      ev.pad = 0;
+      process_event(tid, &ev);
+   } else {
+      process_event(tid, &ev);
+      if(ev.kind != kind && (ev.kind == RR_PROC_EXEC 
+                             || ev.kind == RR_PROC_EXEC_OUT))
+         vg_assert2(0, "The recording %s the exec'd program: replay with "
+                    "the same --trace-children\n", 
+                    ev.kind == RR_PROC_EXEC ? "traced" : "did not trace");
+      vg_assert2(ev.kind == kind, "Log entry not expected. Process event: "
+                 "runtime/recorded=%u/%u\n", kind, ev.kind);
+      wait_turn(ev.seq);
+      turn_done(ev.seq);
+   }
+
+   tree_log_name(name, ev.pid, ev.seq);
+   VG_(sprintf)(log_arg, "--log-file-rr=%s", name);
+   VG_(sprintf)(tree_arg, "--rr-tree=%s", root_name);
+   args[0] = log_arg;
+   args[1] = tree_arg;
+   args[2] = NULL;
+   return args;
+}
+
+void ML_(leaveProcessTree)(void)
+{
+   tree_off = True;
+}
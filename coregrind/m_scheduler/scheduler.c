@@ -61,7 +61,7 @@
 #include "pub_core_basics.h"
 #include "pub_core_debuglog.h"
 #include "pub_core_vki.h"
-#include "pub_core_vkiscnums.h"    // __NR_sched_yield
+#include "pub_core_vkiscnums.h"    // __NR_sched_yield, __NR_futex
 #include "pub_core_libcsetjmp.h"   // to keep _threadstate.h happy
 #include "pub_core_threadstate.h"
 #include "pub_core_aspacemgr.h"
@@ -121,6 +121,12 @@ UInt VG_(dispatch_ctr);
 /* 64-bit counter for the number of basic blocks done. */
 static ULong bbs_done = 0;
 
+/* Exact number of basic blocks entered so far, which bbs_done is not:
+   it misses the last block of a run left early. evc_run_start is the
+   event counter a run of generated code starts with. */
+static ULong bbs_entered = 0;
+static Int   evc_run_start = 0;
+
 /* Counter to see if vgdb activity is to be verified.
    When nr of bbs done reaches vgdb_next_poll, scheduler will
    poll for gdbserver activity. VG_(force_vgdb_poll) and 
@@ -402,11 +408,12 @@ void VG_(exit_thread)(ThreadId tid)
    if (VG_(clo_trace_sched))
       print_sched_event(tid, "release lock in VG_(exit_thread)");
 
-   VG_(release_BigLock_LL)(NULL);
-
 #ifdef RECORD_REPLAY
+   /* while we still own the BigLock, as it touches the log */
    VG_(RR_Thread_Exit)(tid);
 #endif
+
+   VG_(release_BigLock_LL)(NULL);
 }
 
 /* If 'tid' is blocked in a syscall, send it SIGVGKILL so as to get it
@@ -476,31 +483,50 @@ void VG_(vg_yield)(void)
 
 #ifdef RECORD_REPLAY
 /*
- * Only used by RR_acquire_BigLock. If a wrong thread gets chance to run,
- * it yields by calling this function 
+ * Directed handoff of the BigLock in replay. A thread that gets the
+ * BigLock while the log says another one runs next sleeps on its own
+ * futex, so only the thread named by VG_(replay_handoff) wakes up,
+ * instead of every waiting thread spinning on sched_yield.
+ * Both are only used by RR_acquire_BigLock / RR_release_BigLock, with
+ * the BigLock held.
  */
+static volatile UInt replay_futex[VG_N_THREADS];
+static Bool replay_sleeping[VG_N_THREADS];
+
 void VG_(replay_yield)(ThreadId tid)
 {
+   UInt futex_value;
+   SysRes sres;
 
-/*
-   if (VG_(clo_trace_sched)) {
-      print_sched_event(tid, "not expected to run now, yielding...");
-   }
-*/
+   vg_assert(tid < VG_N_THREADS);
+   replay_sleeping[tid] = True;
+   futex_value = replay_futex[tid];
+   __sync_synchronize();
 
-   ML_(sema_up)(&the_BigLock);
-   /* 
-      Tell the kernel we're yielding.
-    */
-   VG_(do_syscall0)(__NR_sched_yield);
+   VG_(release_BigLock_LL)(NULL);
+   /* returns at once if we were handed the lock in between */
+   sres = VG_(do_syscall3)(__NR_futex, (UWord)&replay_futex[tid],
+                           VKI_FUTEX_WAIT | VKI_FUTEX_PRIVATE_FLAG,
+                           futex_value);
+   vg_assert(!sr_isError(sres) || sr_Err(sres) == VKI_EAGAIN
+             || sr_Err(sres) == VKI_EINTR);
+   VG_(acquire_BigLock_LL)(NULL);
 
-   ML_(sema_down)(&the_BigLock);
+   replay_sleeping[tid] = False;
+}
 
-/*
-   if (VG_(clo_trace_sched)) {
-      print_sched_event(tid, "acquired the BigLock again...");
-   }
-*/
+void VG_(replay_handoff)(ThreadId tid)
+{
+   SysRes sres;
+
+   vg_assert(tid < VG_N_THREADS);
+   if (!replay_sleeping[tid])
+      return; /* it will see it's its turn when it gets the BigLock */
+
+   __sync_fetch_and_add(&replay_futex[tid], 1);
+   sres = VG_(do_syscall3)(__NR_futex, (UWord)&replay_futex[tid],
+                           VKI_FUTEX_WAKE | VKI_FUTEX_PRIVATE_FLAG, 1);
+   vg_assert(!sr_isError(sres));
 }
 #endif
 
@@ -863,6 +889,18 @@ void VG_(force_vgdb_poll) ( void )
    vgdb_next_poll = VGDB_POLL_ASAP;
 }
 
+ULong VG_(get_bbs_entered) ( void )
+{
+   ThreadState* tst;
+
+   if (!VG_(in_generated_code))
+      return bbs_entered;
+   /* count the blocks of the run in progress, the current one included */
+   tst = VG_(get_ThreadState)(VG_(running_tid));
+   return bbs_entered
+          + (ULong)(evc_run_start - (Int)tst->arch.vex.host_EvC_COUNTER);
+}
+
 /* Run the thread tid for a while, and return a VG_TRC_* value
    indicating why VG_(disp_run_translations) stopped, and possibly an
    auxiliary word.  Also, only allow the thread to run for at most
@@ -944,6 +982,7 @@ void run_thread_for_a_while ( /*OUT*/HWord* two_words,
 
    /* Set up event counter stuff for the run. */
    tst->arch.vex.host_EvC_COUNTER = *dispatchCtrP;
+   evc_run_start = *dispatchCtrP;
    tst->arch.vex.host_EvC_FAILADDR
       = (HWord)VG_(fnptr_to_fnentry)( &VG_(disp_cp_evcheck_fail) );
 
@@ -1005,6 +1044,10 @@ void run_thread_for_a_while ( /*OUT*/HWord* two_words,
 
    vg_assert(done_this_time >= 0);
    bbs_done += (ULong)done_this_time;
+   if ((Int)tst->arch.vex.host_EvC_COUNTER >= 0)
+      bbs_entered += (ULong)(evc_run_start - (Int)tst->arch.vex.host_EvC_COUNTER);
+   else
+      bbs_entered += (ULong)evc_run_start;
 
    *dispatchCtrP -= done_this_time;
    vg_assert(*dispatchCtrP >= 0);
@@ -1316,6 +1359,17 @@ VgSchedReturnCode VG_(scheduler) ( ThreadId tid )
 	 vg_assert(tst->os_state.lwpid == VG_(gettid)());
       }
 
+#ifdef RECORD_REPLAY
+      /* a quiescent point: maybe take a replay checkpoint or start a
+         flight recorder segment, switch the tool on at the end of a 
+         fast-forward, then hand over to the debugger if this is where 
+         --rr-seek stops */
+      VG_(RR_Checkpoint) (tid, bbs_done);
+      VG_(RR_MaybeEndFastForward) ();
+      if (VG_(RR_SeekReached)())
+         VG_(gdbserver) (tid);
+#endif
+
       /* For stats purposes only. */
       n_scheduling_events_MINOR++;
 
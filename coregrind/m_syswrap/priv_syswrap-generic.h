@@ -81,6 +81,15 @@ ML_(buf_and_len_pre_check) ( ThreadId tid, Addr buf_p, Addr buflen_p,
 extern void
 ML_(buf_and_len_post_check) ( ThreadId tid, SysRes res,
                               Addr buf_p, Addr buflen_p, const HChar* s );
+#ifdef RECORD_REPLAY
+/* The buffer lengths the client passed in to the current syscall, saved
+   by ML_(buf_and_len_pre_check) and ML_(generic_PRE_sys_recvmsg). */
+extern UInt
+ML_(rr_buflen_in) ( ThreadId tid );
+extern void
+ML_(rr_msg_lens_in) ( ThreadId tid, struct vki_msghdr *msg,
+                      UInt *namelen, UInt *controllen );
+#endif
 
 /* PRE and POST for unknown ioctls based on ioctl request encoding */
 extern 
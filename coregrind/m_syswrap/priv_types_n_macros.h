@@ -745,8 +745,16 @@ static inline UWord getERR ( SyscallStatus* st ) {
 #define PRE_MEM_WRITE(zzname, zzaddr, zzlen) \
    VG_TRACK( pre_mem_write, Vg_CoreSysCall, tid, zzname, zzaddr, zzlen)
 
+#ifdef RECORD_REPLAY
+/* requires #include "pub_core_recordreplay.h" */
+#define POST_MEM_WRITE(zzaddr, zzlen) \
+   do { VG_(RR_Syscall_PostMemWrite)(tid, zzaddr, zzlen); \
+        VG_TRACK( post_mem_write, Vg_CoreSysCall, tid, zzaddr, zzlen); \
+   } while (0)
+#else
 #define POST_MEM_WRITE(zzaddr, zzlen) \
    VG_TRACK( post_mem_write, Vg_CoreSysCall, tid, zzaddr, zzlen)
+#endif
 
 
 #define PRE_FIELD_READ(zzname, zzfield) \
@@ -57,6 +57,10 @@
 #include "priv_syswrap-linux-variants.h" /* decls of linux variant wrappers */
 #include "priv_syswrap-main.h"
 
+#ifdef RECORD_REPLAY
+#include "pub_core_recordreplay.h"   // POST_MEM_WRITE
+#endif
+
 
 /* ---------------------------------------------------------------------
    clone() handling
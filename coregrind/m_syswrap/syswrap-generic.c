@@ -853,6 +853,8 @@ void msghdr_foreachfield (
         const HChar *name,
         struct vki_msghdr *msg,
         UInt length,
+        UInt name_max,
+        UInt control_max,
         void (*foreach_func)( ThreadId, Bool, const HChar *, Addr, SizeT ),
         Bool recv
      )
@@ -880,8 +882,8 @@ void msghdr_foreachfield (
 
    if ( msg->msg_name ) {
       VG_(sprintf) ( fieldName, "(%s.msg_name)", name );
-      foreach_func ( tid, False, fieldName, 
-                     (Addr)msg->msg_name, msg->msg_namelen );
+      foreach_func ( tid, False, fieldName, (Addr)msg->msg_name,
+                     msg->msg_namelen <= name_max ? msg->msg_namelen : name_max );
    }
 
    if ( msg->msg_iov ) {
@@ -905,8 +907,9 @@ void msghdr_foreachfield (
    if ( msg->msg_control ) 
    {
       VG_(sprintf) ( fieldName, "(%s.msg_control)", name );
-      foreach_func ( tid, False, fieldName, 
-                     (Addr)msg->msg_control, msg->msg_controllen );
+      foreach_func ( tid, False, fieldName, (Addr)msg->msg_control,
+                     msg->msg_controllen <= control_max ? msg->msg_controllen
+                                                        : control_max );
    }
 
    VG_(arena_free) ( VG_AR_CORE, fieldName );
@@ -1017,9 +1020,26 @@ static UInt deref_UInt ( ThreadId tid, Addr a, const HChar* s )
       return *a_p;
 }
 
+#ifdef RECORD_REPLAY
+/* The buffer length the client passed in, for each thread's current
+   syscall. The kernel returns the full length of what it has, but writes
+   no more than that of it. */
+static UInt rr_buflen_in[VG_N_THREADS];
+
+UInt ML_(rr_buflen_in) ( ThreadId tid )
+{
+   return rr_buflen_in[tid];
+}
+#endif
+
 void ML_(buf_and_len_pre_check) ( ThreadId tid, Addr buf_p, Addr buflen_p,
                                   const HChar* buf_s, const HChar* buflen_s )
 {
+#ifdef RECORD_REPLAY
+   rr_buflen_in[tid] = 0;
+   if (buflen_p != (Addr)NULL && ML_(safe_to_deref)((void*)buflen_p, sizeof(UInt)))
+      rr_buflen_in[tid] = *(UInt*)buflen_p;
+#endif
    if (VG_(tdict).track_pre_mem_write) {
       UInt buflen_in = deref_UInt( tid, buflen_p, buflen_s);
       if (buflen_in > 0) {
@@ -1032,6 +1052,19 @@ void ML_(buf_and_len_pre_check) ( ThreadId tid, Addr buf_p, Addr buflen_p,
 void ML_(buf_and_len_post_check) ( ThreadId tid, SysRes res,
                                    Addr buf_p, Addr buflen_p, const HChar* s )
 {
+#ifdef RECORD_REPLAY
+   /* the length first: in replay, it is the recorded one from then on */
+   if (!sr_isError(res) && buflen_p != (Addr)NULL
+       && ML_(safe_to_deref)((void*)buflen_p, sizeof(UInt))) {
+      UInt buflen_out;
+      VG_(RR_Syscall_PostMemWrite)(tid, buflen_p, sizeof(UInt));
+      buflen_out = *(UInt*)buflen_p;
+      if (buflen_out > rr_buflen_in[tid])
+         buflen_out = rr_buflen_in[tid];
+      if (buflen_out > 0 && buf_p != (Addr)NULL)
+         VG_(RR_Syscall_PostMemWrite)(tid, buf_p, buflen_out);
+   }
+#endif
    if (!sr_isError(res) && VG_(tdict).track_post_mem_write) {
       UInt buflen_out = deref_UInt( tid, buflen_p, s);
       if (buflen_out > 0 && buf_p != (Addr)NULL) {
@@ -1533,23 +1566,114 @@ void
 ML_(generic_PRE_sys_sendmsg) ( ThreadId tid, const HChar *name,
                                struct vki_msghdr *msg )
 {
-   msghdr_foreachfield ( tid, name, msg, ~0, pre_mem_read_sendmsg, False );
+   msghdr_foreachfield ( tid, name, msg, ~0, ~0, ~0, pre_mem_read_sendmsg, False );
 }
 
 /* ------ */
 
+#ifdef RECORD_REPLAY
+/* The msg_namelen and msg_controllen the client passed in, for each
+   msghdr of each thread's current recvmsg or recvmmsg. The kernel
+   returns the full length of the address, but writes no more of it than
+   the buffer takes. */
+typedef
+   struct {
+      struct vki_msghdr *msg;
+      UInt namelen;
+      UInt controllen;
+   }
+   RRMsgLens;
+
+static XArray* rr_msg_lens[VG_N_THREADS];
+
+static Word rr_find_msg_lens ( ThreadId tid, struct vki_msghdr *msg )
+{
+   Word i;
+
+   if ( !msg || rr_msg_lens[tid] == NULL )
+      return -1;
+   for ( i = 0; i < VG_(sizeXA)( rr_msg_lens[tid] ); i++ ) {
+      RRMsgLens* ml = VG_(indexXA)( rr_msg_lens[tid], i );
+      if ( ml->msg == msg )
+         return i;
+   }
+   return -1;
+}
+
+static void rr_save_msg_lens ( ThreadId tid, struct vki_msghdr *msg )
+{
+   RRMsgLens ml;
+   Word i;
+
+   if ( !msg || !ML_(safe_to_deref)(msg, sizeof(*msg)) )
+      return;
+   if ( rr_msg_lens[tid] == NULL )
+      rr_msg_lens[tid] = VG_(newXA)( VG_(malloc), "syswrap.rr_save_msg_lens.1",
+                                     VG_(free), sizeof(RRMsgLens) );
+   ml.msg = msg;
+   ml.namelen = msg->msg_namelen;
+   ml.controllen = msg->msg_controllen;
+   i = rr_find_msg_lens( tid, msg );
+   if ( i >= 0 )
+      *(RRMsgLens*)VG_(indexXA)( rr_msg_lens[tid], i ) = ml;
+   else
+      VG_(addToXA)( rr_msg_lens[tid], &ml );
+}
+
+void ML_(rr_msg_lens_in) ( ThreadId tid, struct vki_msghdr *msg,
+                           UInt *namelen, UInt *controllen )
+{
+   Word i = rr_find_msg_lens( tid, msg );
+   RRMsgLens* ml;
+
+   *namelen = 0;
+   *controllen = 0;
+   if ( i < 0 )
+      return;
+   ml = VG_(indexXA)( rr_msg_lens[tid], i );
+   *namelen = ml->namelen;
+   *controllen = ml->controllen;
+}
+
+/* Replay the header fields the kernel wrote, and return the lengths the
+   post handler may use: what it computes from them must be the same in
+   record and replay. */
+static void rr_replay_msg_lens ( ThreadId tid, struct vki_msghdr *msg,
+                                 UInt *name_max, UInt *control_max )
+{
+   Word i = rr_find_msg_lens( tid, msg );
+
+   ML_(rr_msg_lens_in)( tid, msg, name_max, control_max );
+   if ( i < 0 )
+      return;
+   VG_(removeIndexXA)( rr_msg_lens[tid], i );
+   VG_(RR_Syscall_PostMemWrite)( tid, (Addr)&msg->msg_namelen,
+                                 sizeof(msg->msg_namelen) );
+   VG_(RR_Syscall_PostMemWrite)( tid, (Addr)&msg->msg_controllen,
+                                 sizeof(msg->msg_controllen) );
+}
+#endif
+
 void
 ML_(generic_PRE_sys_recvmsg) ( ThreadId tid, const HChar *name,
                                struct vki_msghdr *msg )
 {
-   msghdr_foreachfield ( tid, name, msg, ~0, pre_mem_write_recvmsg, True );
+#ifdef RECORD_REPLAY
+   rr_save_msg_lens( tid, msg );
+#endif
+   msghdr_foreachfield ( tid, name, msg, ~0, ~0, ~0, pre_mem_write_recvmsg, True );
 }
 
 void 
 ML_(generic_POST_sys_recvmsg) ( ThreadId tid, const HChar *name,
                                 struct vki_msghdr *msg, UInt length )
 {
-   msghdr_foreachfield( tid, name, msg, length, post_mem_write_recvmsg, True );
+   UInt name_max = ~0, control_max = ~0;
+#ifdef RECORD_REPLAY
+   rr_replay_msg_lens( tid, msg, &name_max, &control_max );
+#endif
+   msghdr_foreachfield( tid, name, msg, length, name_max, control_max,
+                        post_mem_write_recvmsg, True );
    check_cmsg_for_fds( tid, msg );
 }
 
@@ -2561,6 +2685,9 @@ PRE(sys_execve)
    Int          i, j, tot_args;
    SysRes       res;
    Bool         setuid_allowed, trace_this_child;
+#ifdef RECORD_REPLAY
+   HChar**      rr_args;
+#endif
 
    PRINT("sys_execve ( %#lx(%s), %#lx, %#lx )", ARG1, (char*)ARG1, ARG2, ARG3);
    PRE_REG_READ3(vki_off_t, "execve",
@@ -2651,6 +2778,11 @@ PRE(sys_execve)
    VG_(nuke_all_threads_except)( tid, VgSrc_ExitThread );
    VG_(reap_threads)(tid);
 
+#ifdef RECORD_REPLAY
+   // Finish the log; a traced child gets the one it goes on with.
+   rr_args = VG_(RR_Exec)(tid, trace_this_child);
+#endif
+
    // Set up the child's exe path.
    //
    if (trace_this_child) {
@@ -2717,6 +2849,11 @@ PRE(sys_execve)
       // V's args
       tot_args += VG_(sizeXA)( VG_(args_for_valgrind) );
       tot_args -= VG_(args_for_valgrind_noexecpass);
+#ifdef RECORD_REPLAY
+      // record/replay args, after V's so that they take precedence
+      for (i = 0; rr_args[i]; i++)
+         tot_args++;
+#endif
       // name of client exe
       tot_args++;
       // args for client exe, skipping [0]
@@ -2737,6 +2874,10 @@ PRE(sys_execve)
             continue;
          argv[j++] = * (HChar**) VG_(indexXA)( VG_(args_for_valgrind), i );
       }
+#ifdef RECORD_REPLAY
+      for (i = 0; rr_args[i]; i++)
+         argv[j++] = rr_args[i];
+#endif
       argv[j++] = (HChar*)ARG1;
       if (arg2copy && arg2copy[0])
          for (i = 1; arg2copy[i]; i++)
@@ -3017,8 +3158,21 @@ PRE(sys_fork)
    VG_(sigfillset)(&mask);
    VG_(sigprocmask)(VKI_SIG_SETMASK, &mask, &fork_saved_mask);
 
+#ifdef RECORD_REPLAY
+   VG_(RR_PreFork)(tid);
+#endif
+
    SET_STATUS_from_SysRes( VG_(do_syscall0)(__NR_fork) );
 
+#ifdef RECORD_REPLAY
+   /* the parent gets the recorded result in replay */
+   if (!SUCCESS || RES != 0) {
+      SysRes res = status->sres;
+      VG_(RR_PostFork)(tid, &res);
+      SET_STATUS_from_SysRes( res );
+   }
+#endif
+
    if (!SUCCESS) return;
 
 #if defined(VGO_linux)
@@ -3052,6 +3206,14 @@ PRE(sys_fork)
             VG_(xml_output_sink).fd = -1;
       }
 
+#ifdef RECORD_REPLAY
+      /* the child goes on with a log of its own */
+      {
+         SysRes res = status->sres;
+         VG_(RR_PostFork)(tid, &res);
+      }
+#endif
+
    } else {
       VG_(do_atfork_parent)(tid);
 
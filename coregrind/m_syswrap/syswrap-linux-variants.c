@@ -69,6 +69,10 @@
 #include "priv_types_n_macros.h"
 #include "priv_syswrap-linux-variants.h"
 
+#ifdef RECORD_REPLAY
+#include "pub_core_recordreplay.h"   // POST_MEM_WRITE
+#endif
+
 
 /* ---------------------------------------------------------------
    BProc wrappers
@@ -441,6 +441,10 @@ SysRes ML_(do_fork_clone) ( ThreadId tid, UInt flags,
 
    VG_(do_atfork_pre)(tid);
 
+#ifdef RECORD_REPLAY
+   VG_(RR_PreFork)(tid);
+#endif
+
    /* Since this is the fork() form of clone, we don't need all that
       VG_(clone) stuff */
 #if defined(VGP_x86_linux) \
@@ -495,6 +499,11 @@ SysRes ML_(do_fork_clone) ( ThreadId tid, UInt flags,
       VG_(sigprocmask)(VKI_SIG_SETMASK, &fork_saved_mask, NULL);
    }
 
+#ifdef RECORD_REPLAY
+   /* the child goes on with a log of its own */
+   VG_(RR_PostFork)(tid, &res);
+#endif
+
    return res;
 }
 
@@ -40,6 +40,7 @@
 #include "pub_core_libcassert.h"
 #include "pub_core_libcprint.h"
 #include "pub_core_libcproc.h"      // For VG_(getpid)()
+#include "pub_core_libcfile.h"      // For VG_(open), VG_(dup2)
 #include "pub_core_libcsignal.h"
 #include "pub_core_scheduler.h"     // For VG_({acquire,release}_BigLock),
                                     //   and VG_(vg_yield)
@@ -1329,8 +1330,266 @@ static void ensure_initialised ( void )
 
 #ifdef RECORD_REPLAY
 /*
-   For the syscalls that we have not wrapped, or that should not be wrapped,
-   return a value indicating it should be processed by record/replay.
+   Syscalls that change state Valgrind or the kernel keeps for the process
+   must really run in replay as well: the address space, the processes,
+   threads and signals, the file descriptor table, the file system the
+   natively run opens look up (names, owners, modes and sizes), the
+   credentials they are checked against, and the working directory. All
+   the others go through record/replay. The children fork makes are real,
+   so are the waits that reap them.
+
+   The descriptors accept returns, or recvmsg passes in its control data,
+   cannot be made in replay, there is no peer: the call is replayed, and
+   reserve_replayed_fd keeps their numbers taken.
+ */
+static Bool must_run_in_replay(UWord sysno, SyscallArgs *arrghs)
+{
+   switch(sysno) {
+#if defined(__NR_socketcall)
+   case __NR_socketcall:
+      return ARG1 == VKI_SYS_SOCKET || ARG1 == VKI_SYS_SOCKETPAIR;
+#endif
+   case __NR_mmap:
+#if defined(__NR_mmap2)
+   case __NR_mmap2:
+#endif
+   case __NR_munmap:
+   case __NR_mremap:
+   case __NR_mprotect:
+   case __NR_brk:
+   case __NR_madvise:
+#if defined(__NR_ipc)
+   case __NR_ipc:
+#endif
+#if defined(__NR_shmat)
+   case __NR_shmget:
+   case __NR_shmat:
+   case __NR_shmdt:
+   case __NR_shmctl:
+#endif
+   case __NR_clone:
+   case __NR_fork:
+   case __NR_vfork:
+   case __NR_execve:
+   case __NR_wait4:
+#if defined(__NR_waitpid)
+   case __NR_waitpid:
+#endif
+   case __NR_waitid:
+   case __NR_setsid:
+   case __NR_setpgid:
+   case __NR_exit:
+   case __NR_exit_group:
+   case __NR_getpid:
+   case __NR_kill:
+   case __NR_tkill:
+   case __NR_tgkill:
+   case __NR_rt_sigaction:
+   case __NR_rt_sigprocmask:
+   case __NR_rt_sigreturn:
+   case __NR_sigaltstack:
+#if defined(__NR_set_thread_area)
+   case __NR_set_thread_area:
+#endif
+#if defined(__NR_arch_prctl)
+   case __NR_arch_prctl:
+#endif
+   case __NR_prctl:
+   case __NR_setrlimit:
+   case __NR_open:
+   case __NR_openat:
+   case __NR_creat:
+   case __NR_close:
+   case __NR_dup:
+   case __NR_dup2:
+#if defined(__NR_dup3)
+   case __NR_dup3:
+#endif
+   case __NR_pipe:
+#if defined(__NR_pipe2)
+   case __NR_pipe2:
+#endif
+   case __NR_fcntl:
+#if defined(__NR_fcntl64)
+   case __NR_fcntl64:
+#endif
+#if defined(__NR_socket)
+   case __NR_socket:
+   case __NR_socketpair:
+#endif
+   case __NR_epoll_create:
+   case __NR_epoll_create1:
+   case __NR_eventfd:
+   case __NR_eventfd2:
+   case __NR_timerfd_create:
+   case __NR_signalfd:
+   case __NR_signalfd4:
+   case __NR_inotify_init:
+   case __NR_inotify_init1:
+#if defined(__NR_memfd_create)
+   case __NR_memfd_create:
+#endif
+   case __NR_mkdir:
+   case __NR_mkdirat:
+   case __NR_rmdir:
+   case __NR_unlink:
+   case __NR_unlinkat:
+   case __NR_rename:
+   case __NR_renameat:
+   case __NR_link:
+   case __NR_linkat:
+   case __NR_symlink:
+   case __NR_symlinkat:
+   case __NR_mknod:
+   case __NR_mknodat:
+   case __NR_chmod:
+   case __NR_fchmod:
+   case __NR_fchmodat:
+   case __NR_chown:
+   case __NR_fchown:
+   case __NR_lchown:
+   case __NR_fchownat:
+#if defined(__NR_chown32)
+   case __NR_chown32:
+   case __NR_fchown32:
+   case __NR_lchown32:
+#endif
+   case __NR_truncate:
+   case __NR_ftruncate:
+#if defined(__NR_truncate64)
+   case __NR_truncate64:
+   case __NR_ftruncate64:
+#endif
+   case __NR_chroot:
+   case __NR_setuid:
+   case __NR_setgid:
+   case __NR_setreuid:
+   case __NR_setregid:
+   case __NR_setresuid:
+   case __NR_setresgid:
+   case __NR_setfsuid:
+   case __NR_setfsgid:
+   case __NR_setgroups:
+#if defined(__NR_setuid32)
+   case __NR_setuid32:
+   case __NR_setgid32:
+   case __NR_setreuid32:
+   case __NR_setregid32:
+   case __NR_setresuid32:
+   case __NR_setresgid32:
+   case __NR_setfsuid32:
+   case __NR_setfsgid32:
+   case __NR_setgroups32:
+#endif
+   case __NR_chdir:
+   case __NR_fchdir:
+   case __NR_umask:
+      return True;
+   default:
+      return False;
+   }
+}
+
+/* True when the replayed syscall returns a new file descriptor */
+static Bool returns_replayed_fd(UWord sysno, SyscallArgs *arrghs)
+{
+   switch(sysno) {
+#if defined(__NR_socketcall)
+   case __NR_socketcall:
+      return ARG1 == VKI_SYS_ACCEPT || ARG1 == VKI_SYS_ACCEPT4;
+#endif
+#if defined(__NR_accept)
+   case __NR_accept:
+#endif
+#if defined(__NR_accept4)
+   case __NR_accept4:
+#endif
+      return True;
+   default:
+      return False;
+   }
+}
+
+/*
+   Take the number of a descriptor the replay returned but did not make,
+   with /dev/null, for the descriptors later made natively to get the
+   numbers they got in record, and a native close of it to succeed.
+ */
+static void reserve_replayed_fd(Int fd)
+{
+   SysRes sres;
+   Int tmp;
+
+   sres = VG_(open)("/dev/null", VKI_O_RDWR, 0);
+   vg_assert2(!sr_isError(sres), "Cannot open /dev/null to reserve fd %d\n", fd);
+   tmp = (Int)sr_Res(sres);
+   if(tmp == fd)
+      return;
+   sres = VG_(dup2)(tmp, fd);
+   vg_assert2(!sr_isError(sres), "Cannot reserve fd %d\n", fd);
+   VG_(close)(tmp);
+}
+
+/* Reserve the descriptors the replayed control data of msg passes */
+static void reserve_received_fds(struct vki_msghdr *msg)
+{
+   struct vki_cmsghdr *cm = VKI_CMSG_FIRSTHDR(msg);
+
+   while(cm) {
+      if(cm->cmsg_level == VKI_SOL_SOCKET &&
+         cm->cmsg_type == VKI_SCM_RIGHTS) {
+         Int *fds = (Int *) VKI_CMSG_DATA(cm);
+         Int fdc = (cm->cmsg_len - VKI_CMSG_ALIGN(sizeof(struct vki_cmsghdr)))
+                         / sizeof(int);
+         Int i;
+
+         for(i = 0; i < fdc; i++)
+            reserve_replayed_fd(fds[i]);
+      }
+      cm = VKI_CMSG_NXTHDR(msg, cm);
+   }
+}
+
+/* The same for every message a replayed recvmsg or recvmmsg got */
+static void reserve_replayed_msg_fds(UWord sysno, SyscallArgs *arrghs,
+                                     UWord res)
+{
+   struct vki_msghdr *msg = NULL;
+   struct vki_mmsghdr *mmsg = NULL;
+   UWord i;
+
+   switch(sysno) {
+#if defined(__NR_socketcall)
+   case __NR_socketcall:
+      if(ARG1 == VKI_SYS_RECVMSG)
+         msg = (struct vki_msghdr *)((UWord*)ARG2)[1];
+      break;
+#endif
+#if defined(__NR_recvmsg)
+   case __NR_recvmsg:
+      msg = (struct vki_msghdr *)ARG2;
+      break;
+#endif
+#if defined(__NR_recvmmsg)
+   case __NR_recvmmsg:
+      mmsg = (struct vki_mmsghdr *)ARG2;
+      break;
+#endif
+   default:
+      break;
+   }
+   if(msg)
+      reserve_received_fds(msg);
+   if(mmsg)
+      for(i = 0; i < res; i++)
+         reserve_received_fds(&mmsg[i].msg_hdr);
+}
+
+/*
+   For the syscalls that should not be wrapped, return a value indicating
+   they are left to the OS in replay. A syscall without a hand-written 
+   record_replay wrapper is still recorded/replayed when the log captures
+   kernel memory writes through POST_MEM_WRITE (VG_(RR_Syscall_Auto)).
    Some specific system calls may be better serviced by OS though it 
    could also be replayed. For example, a stdout or stderr write can go to
    OS, then the replay seems better. 
@@ -1343,7 +1602,8 @@ static Bool should_not_record_replay(UWord sysno, SyscallArgs *arrghs)
    if(VG_(clo_record_replay) != RECORDONLY && VG_(clo_record_replay) != REPLAYONLY) {
       return 1;
    }
-   if(ent->record_replay == NULL) {
+   if(ent->record_replay == NULL && 
+      (!VG_(RR_Syscall_Auto)() || must_run_in_replay(sysno, arrghs))) {
       return 1;
    }
    if( sysno == __NR_write && (ARG1 == 1 || ARG1 == 2) ) {
@@ -1353,6 +1613,16 @@ static Bool should_not_record_replay(UWord sysno, SyscallArgs *arrghs)
       return 0;
    }
 }
+
+/*
+   Record/replay a syscall without a hand-written wrapper: only the return
+   value is logged here, the memory it wrote is logged by the post handler.
+ */
+static void auto_record_replay(ThreadId tid, ULong* sys_ret, SyscallArgs* args)
+{
+   VG_(RR_Syscall_Ret)(sys_ret);
+   VG_(RR_Syscall_CaptureMemWrites)(tid, True);
+}
 #endif
 
 /* --- This is the main function of this file. --- */
@@ -1364,6 +1634,10 @@ void VG_(client_syscall) ( ThreadId tid, UInt trc )
    const SyscallTableEntry* ent;
    SyscallArgLayout         layout;
    SyscallInfo*             sci;
+#ifdef RECORD_REPLAY
+   Bool                     rr_clock;
+   SysRes                   rr_clock_res;
+#endif
 
    ensure_initialised();
 
@@ -1549,11 +1823,20 @@ void VG_(client_syscall) ( ThreadId tid, UInt trc )
    }
 
 #ifdef RECORD_REPLAY
+   /* A clock read served by the virtual clock is neither logged nor 
+      handed to the kernel; the pre and post handlers still run for the
+      tool. */
+   rr_clock = VG_(RR_Syscall_Clock)(tid, sysno, sci->args.arg1, 
+                                    sci->args.arg2, &rr_clock_res);
    /* 
     * Log the guest cpu state in record; check whether the state is the same as the logged one in replay. 
     * The syscall arguments could be derived from the arch registers.
     */
-   VG_(RR_Syscall_VexGuestArchState)(tid, sysno, &tst->arch.vex);
+   if(!rr_clock)
+      VG_(RR_Syscall_VexGuestArchState)(tid, sysno, &tst->arch.vex);
+   /* a file the log refers to is copied before the client changes it */
+   VG_(RR_Syscall_FileModify)(sysno, sci->args.arg1, sci->args.arg2,
+                              sci->args.arg3, sci->args.arg4);
 #endif
 
    vg_assert(ent);
@@ -1561,6 +1844,14 @@ void VG_(client_syscall) ( ThreadId tid, UInt trc )
    (ent->before)( tid,
                   &layout, 
                   &sci->args, &sci->status, &sci->flags );
+
+#ifdef RECORD_REPLAY
+   if(rr_clock){
+      vg_assert(sci->status.what == SsHandToKernel && sci->flags == 0);
+      sci->status.what = SsComplete;
+      sci->status.sres = rr_clock_res;
+   }
+#endif
    
    /* The pre-handler may have modified:
          sci->args
@@ -1695,7 +1986,10 @@ void VG_(client_syscall) ( ThreadId tid, UInt trc )
                                            	   : (ULong)sr_Res(temp_status.sres);
             }
             /* record/replay syscall return value and  memory side effects */
-            ent->record_replay(tid, &sys_ret, &sci->args);
+            if(ent->record_replay)
+               ent->record_replay(tid, &sys_ret, &sci->args);
+            else
+               auto_record_replay(tid, &sys_ret, &sci->args);
             if(VG_(clo_record_replay) == REPLAYONLY){
                temp_status.what = SsComplete;
 #if defined(VGP_x86_linux)
@@ -1755,7 +2049,10 @@ void VG_(client_syscall) ( ThreadId tid, UInt trc )
                                        	   : (ULong)sr_Res(sres);
             }
             /* record/replay syscall return value and memory side effects */
-            ent->record_replay(tid, &sys_ret, &sci->args);
+            if(ent->record_replay)
+               ent->record_replay(tid, &sys_ret, &sci->args);
+            else
+               auto_record_replay(tid, &sys_ret, &sci->args);
             if(VG_(clo_record_replay) == REPLAYONLY)
                /* ret value is written into args.sysno in record_replay wrapper */
                sres = VG_(mk_SysRes_x86_linux)(sys_ret); 
@@ -1880,6 +2177,13 @@ void VG_(post_syscall) (ThreadId tid)
       - it exists, and
       - Success or (Failure and PostOnFail is set)
    */
+#ifdef RECORD_REPLAY
+   if (VG_(clo_record_replay) == REPLAYONLY
+       && !sr_isError(sci->status.sres)
+       && returns_replayed_fd(sysno, &sci->args)
+       && !should_not_record_replay(sysno, &sci->args))
+      reserve_replayed_fd((Int)sr_Res(sci->status.sres));
+#endif
    if (ent->after
        && ((!sr_isError(sci->status.sres))
            || (sr_isError(sci->status.sres)
@@ -1887,6 +2191,15 @@ void VG_(post_syscall) (ThreadId tid)
 
       (ent->after)( tid, &sci->args, &sci->status );
    }
+#ifdef RECORD_REPLAY
+   VG_(RR_Syscall_CaptureMemWrites)(tid, False);
+   /* the control data is only replayed by the post handler of an
+      automatically replayed recvmsg */
+   if (VG_(clo_record_replay) == REPLAYONLY
+       && !sr_isError(sci->status.sres)
+       && !should_not_record_replay(sysno, &sci->args))
+      reserve_replayed_msg_fds(sysno, &sci->args, sr_Res(sci->status.sres));
+#endif
 
    /* Because the post handler might have changed the status (eg, the
       post-handler for sys_open can change the result from success to
@@ -61,6 +61,10 @@
 #include "priv_syswrap-generic.h"
 #include "priv_syswrap-xen.h"
 
+#ifdef RECORD_REPLAY
+#include "pub_core_recordreplay.h"   // POST_MEM_WRITE
+#endif
+
 #include <inttypes.h>
 
 #define PRE(name) static DEFN_PRE_TEMPLATE(xen, name)
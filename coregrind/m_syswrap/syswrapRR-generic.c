@@ -64,7 +64,7 @@ RECORDREPLAY(sys_read)
    SHARED_RECORDREPLAY_HEADER;
 
    if(ARG2 != 0) {
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2, *sys_ret);
+      VG_(RR_Syscall_FileRead)(ARG1, (void*)ARG2, *sys_ret);
    }
 }
 
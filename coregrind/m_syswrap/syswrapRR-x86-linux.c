@@ -65,6 +65,63 @@ RECORDREPLAY(sys_fstat64)
    }
 }
 
+/* 
+ * Record/replay a socket address the kernel returned in addr, with its
+ * length in *lenp. The length is logged first, so that in replay the 
+ * recorded one tells how much of the address to fill in. The kernel
+ * returns the full length of the address even when it truncated it to
+ * the caller's buffer: no more than the len_in the caller passed in is
+ * written.
+ */
+static void rr_sockaddr(Addr addr, Addr lenp, UInt len_in)
+{
+   UInt len;
+
+   if(addr == 0 || lenp == 0)
+      return;
+   VG_(RR_Syscall_Mem)(1, (void*)lenp, sizeof(UInt));
+   len = *(UInt*)lenp < len_in ? *(UInt*)lenp : len_in;
+   if(len > 0) {
+      VG_(RR_Syscall_Mem)(1, (void*)addr, len);
+   }
+}
+
+/* 
+ * Record/replay what recvmsg wrote: the msghdr fields the kernel updates,
+ * the name and control data, and the received bytes scattered over the 
+ * iovecs, which only cover the first nbytes of them. The name and control
+ * data are cut to the lengths the caller passed in, like in rr_sockaddr.
+ */
+static void rr_recvmsg(ThreadId tid, struct vki_msghdr* msg, ULong nbytes)
+{
+   struct vki_iovec* iov;
+   SizeT i, len;
+   UInt namelen_in, controllen_in;
+
+   ML_(rr_msg_lens_in)(tid, msg, &namelen_in, &controllen_in);
+   VG_(RR_Syscall_Mem)(3, &msg->msg_namelen, sizeof(msg->msg_namelen),
+                          &msg->msg_controllen, sizeof(msg->msg_controllen),
+                          &msg->msg_flags, sizeof(msg->msg_flags));
+   len = msg->msg_namelen < namelen_in ? msg->msg_namelen : namelen_in;
+   if(msg->msg_name != NULL && len > 0) {
+      VG_(RR_Syscall_Mem)(1, msg->msg_name, len);
+   }
+   len = msg->msg_controllen < controllen_in ? msg->msg_controllen
+                                             : controllen_in;
+   if(msg->msg_control != NULL && len > 0) {
+      VG_(RR_Syscall_Mem)(1, msg->msg_control, len);
+   }
+
+   iov = msg->msg_iov;
+   for(i = 0; i < msg->msg_iovlen && nbytes > 0; i++) {
+      len = iov[i].iov_len < nbytes ? iov[i].iov_len : nbytes;
+      if(len > 0) {
+         VG_(RR_Syscall_Mem)(1, iov[i].iov_base, len);
+      }
+      nbytes -= len;
+   }
+}
+
 RECORDREPLAY(sys_socketcall)
 {
 #  define ARG2_0  (((UWord*)ARG2)[0])
@@ -93,7 +150,7 @@ RECORDREPLAY(sys_socketcall)
 
    case VKI_SYS_ACCEPT:
    {
-      VG_(RR_Syscall_Mem)(2, (void*)ARG2_1, sizeof(struct vki_sockaddr), (void*)ARG2_2, sizeof(UInt));
+      rr_sockaddr(ARG2_1, ARG2_2, ML_(rr_buflen_in)(tid));
       break;
    }
 
@@ -106,19 +163,20 @@ RECORDREPLAY(sys_socketcall)
 
    case VKI_SYS_RECVFROM:
    {
-      /* len = ARG2_2;
-         Although actual received bytes may be less than len, we record
-         len bytes here for simplicity */
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2_1, (ULong)ARG2_2);
+      /* only the received bytes are written, *sys_ret <= len (ARG2_2) */
+      if(*sys_ret > 0) {
+         VG_(RR_Syscall_Mem)(1, (void*)ARG2_1, *sys_ret);
+      }
+      rr_sockaddr(ARG2_4, ARG2_5, ML_(rr_buflen_in)(tid));
       break;
    }
 
    case VKI_SYS_RECV:
    {
-      /* len = ARG2_2;
-         Although actual received bytes may be less than len, we record
-         len bytes here for simplicity */
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2_1, (ULong)ARG2_2);
+      /* only the received bytes are written, *sys_ret <= len (ARG2_2) */
+      if(*sys_ret > 0) {
+         VG_(RR_Syscall_Mem)(1, (void*)ARG2_1, *sys_ret);
+      }
       break;
    }
 
@@ -131,33 +189,15 @@ RECORDREPLAY(sys_socketcall)
 
    case VKI_SYS_GETSOCKOPT:
    {
-      ULong len;
-      /* I am not sure this is true. some test needed */
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2_4, sizeof(ULong));
-      len = *((ULong*)ARG2_4);
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2_3, len);
+      /* the kernel sets *optlen (ARG2_4) to the bytes it wrote to optval */
+      rr_sockaddr(ARG2_3, ARG2_4, ML_(rr_buflen_in)(tid));
       break;
    }
 
    case VKI_SYS_GETSOCKNAME:
-   {
-      ULong len;
-      /* I am not sure this is true. some test needed */
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2_2, sizeof(ULong));
-      len = *((ULong*)ARG2_2);
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2_1, len);
-      break;
-   }
-
    case VKI_SYS_GETPEERNAME:
    {
-      ULong len;
-      /* I am not sure this is true. some test needed */
-      VG_(RR_Syscall_Mem)(1, (void*)ARG2_2, sizeof(ULong));
-      len = *((ULong*)ARG2_2);
-      if(len != 0) {
-         VG_(RR_Syscall_Mem)(1, (void*)ARG2_1, len);
-      }
+      rr_sockaddr(ARG2_1, ARG2_2, ML_(rr_buflen_in)(tid));
       break;
    }
 
@@ -170,12 +210,9 @@ RECORDREPLAY(sys_socketcall)
 
    case VKI_SYS_RECVMSG:
    {
-      /* memory layout difference of record execution and replay execution should be known.
-       * because the members of msghdr may point to other places that we cannot know from
-       * the syscall arguments 
-       */
-      VG_(core_panic)("recvmsg not supported yet... bye!\n");
-     /* ML_(generic_POST_sys_recvmsg)( tid, ARG2_0, ARG2_1 ); */
+      /* the msghdr (ARG2_1) and what it points to are client memory, laid
+         out the same in record and replay */
+      rr_recvmsg(tid, (struct vki_msghdr*)ARG2_1, *sys_ret);
       break;
    }
    default:
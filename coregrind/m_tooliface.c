@@ -411,6 +411,7 @@ DEF0(track_post_reg_write_clientcall_return, ThreadId, PtrdiffT, SizeT, Addr)
 
 DEF0(track_start_client_code,     ThreadId, ULong)
 DEF0(track_stop_client_code,      ThreadId, ULong)
+DEF0(track_end_fast_forward,      void)
 
 DEF0(track_pre_thread_ll_create,  ThreadId, ThreadId)
 DEF0(track_pre_thread_first_insn, ThreadId)
@@ -217,6 +217,27 @@ static IRExpr* mk_ecu_Expr ( Addr64 guest_IP )
    return mkIRExpr_HWord( (HWord)ecu );
 }
 
+#ifdef RECORD_REPLAY
+/* While replay fast-forwards (--rr-fast-forward-to), the tool's
+   instrumentation is left out.  gdbserver's is still needed for
+   breakpoints and single stepping.
+*/
+static
+IRSB* fast_forward_instrument ( VgCallbackClosure* closureV,
+                                IRSB*              sb_in, 
+                                VexGuestLayout*    layout, 
+                                VexGuestExtents*   vge,
+                                VexArchInfo*       vai,
+                                IRType             gWordTy, 
+                                IRType             hWordTy )
+{
+   if (VG_(clo_vgdb) == Vg_VgdbNo)
+      return sb_in;
+   return VG_(instrument_for_gdbserver_if_needed)
+      (sb_in, layout, vge, gWordTy, hWordTy);
+}
+#endif
+
 /* When gdbserver is activated, the translation of a block must
    first be done by the tool function, then followed by a pass
    which (if needed) instruments the code for gdbserver.
@@ -1563,6 +1584,10 @@ Bool VG_(translate) ( ThreadId tid,
         = VG_(clo_vgdb) != Vg_VgdbNo
              ? tool_instrument_then_gdbserver_if_needed
              : VG_(tdict).tool_instrument;
+#ifdef RECORD_REPLAY
+     if (VG_(RR_FastForwarding)())
+        f = fast_forward_instrument;
+#endif
      IRSB*(*g)(void*,
                IRSB*,VexGuestLayout*,VexGuestExtents*,VexArchInfo*,
                IRType,IRType)
@@ -86,6 +86,38 @@ Bool VG_(gdbserver_point) (PointKind kind, Bool insert,
 /* True if there is a breakpoint at addr. */
 Bool VG_(has_gdbserver_breakpoint) (Addr addr);
 
+/* A replay can go on in another process than the one gdb is connected
+   to, e.g. when gdb asks to execute backwards. GdbSession is what such
+   a process needs to take over the gdb connection: the FIFOs, the
+   protocol state and the break and watch points inserted by gdb. */
+#define GDBSERVER_SESSION_POINTS 64
+typedef
+   struct {
+      Int   fifo_pid;        // the FIFOs are named after this pid
+      Bool  noack_mode;
+      Bool  stepping;        // single step from the start
+      Bool  history_begin;   // next stop is at the start of the history
+      Int   n_points;
+      struct {
+         PointKind kind;
+         Addr      addr;
+         SizeT     len;
+      } points[GDBSERVER_SESSION_POINTS];
+   }
+   GdbSession;
+
+/* Fills up s from the current gdb connection. Returns False if gdb has
+   inserted more points than s can hold. */
+extern Bool VG_(gdbserver_save_session) (GdbSession* s);
+
+/* Sets up the gdbserver of this process from s, saved by another process
+   of the same replay. With connect, the gdb connection is taken over, and
+   the next stop is reported to gdb as the end of the resume request it is
+   waiting for. Without, the points are inserted but gdb is never talked
+   to: stops are expected to be hidden by VG_(RR_HideGdbStop). */
+extern void VG_(gdbserver_adopt_session) (ThreadId tid, const GdbSession* s,
+                                          Bool connect);
+
 /* Entry point invoked by vgdb when it uses ptrace to cause a gdbserver
    invocation. A magic value is passed by vgdb in check as a verification
    that the call has been properly pushed by vgdb. */
@@ -39,9 +39,73 @@ typedef enum RRState{
    REPLAYONLY
 }RRState;
    
+/* When the buffered record log is pushed to the disk */
+typedef enum RRSyncPolicy{
+   RR_SYNC_NONE,         /* only when Valgrind exits */
+   RR_SYNC_PERIODIC,     /* at a BigLock release, every --rr-sync-interval ms */
+   RR_SYNC_EVERY_SWITCH  /* at every BigLock release */
+}RRSyncPolicy;
+
+/* How the record log is compressed */
+typedef enum RRCompress{
+   RR_COMPRESS_NONE,
+   RR_COMPRESS_LZO
+}RRCompress;
+
+/* How the guest state logged before every syscall is checked in replay */
+typedef enum RRCheckState{
+   RR_CHECK_STATE_FULL,  /* the whole VexGuestArchState */
+   RR_CHECK_STATE_NONE,  /* not logged at all */
+   RR_CHECK_STATE_HASH,  /* a 64-bit hash of it */
+   RR_CHECK_STATE_DELTA  /* the words changed since the thread's previous one */
+}RRCheckState;
+
+/* Why the gdbserver stops, see VG_(RR_HideGdbStop) */
+typedef enum RRStopKind{
+   RRStop_Other,        /* not a break or watch point */
+   RRStop_Breakpoint,   /* a breakpoint only */
+   RRStop_Step,         /* single stepping, or after a write watchpoint */
+   RRStop_Watch         /* a read or access watchpoint */
+}RRStopKind;
+
+/* A position in the replay log, as found in its event index */
+typedef struct RRLogPos{
+   ULong event_no;
+   ULong stream_off;    /* where the entry of event_no starts */
+   ULong n_syscalls;    /* syscalls before event_no */
+   ULong dispatch_ctr;  /* last dispatch counter logged before event_no */
+}RRLogPos;
+
 /* Command line options. */
 extern RRState VG_(clo_record_replay);
 extern Char* VG_(clo_log_name_rr);
+extern RRSyncPolicy VG_(clo_rr_sync);
+extern UInt VG_(clo_rr_sync_interval);
+extern RRCompress VG_(clo_rr_compress);
+/* record: store a DATA2 payload of at least so many bytes once, 0 for never */
+extern UInt VG_(clo_rr_dedupe);
+/* record: put large syscall payloads where replay can map them */
+extern Bool VG_(clo_rr_map_reads);
+/* record: log large reads of regular files as references to the file */
+extern Bool VG_(clo_rr_file_refs);
+/* record: keep only the last so many MB of log, 0 for all of it */
+extern UInt VG_(clo_rr_flight_recorder);
+/* the log of the root of the process tree, when this process is not it */
+extern const HChar* VG_(clo_rr_tree);
+/* record: serve clock reads from the TSC, syncing with the kernel every so
+   many ms, 0 for never */
+extern UInt VG_(clo_rr_virtual_clock);
+/* record: how the guest state is logged, replay takes it from the log */
+extern RRCheckState VG_(clo_rr_check_state);
+/* write the record log from a helper thread */
+extern Bool VG_(clo_rr_async_write);
+/* replay: stop in the gdbserver once this event is replayed, 0 for never */
+extern ULong VG_(clo_rr_seek);
+/* replay: take a checkpoint every so many syscalls / basic blocks, 0 for never */
+extern ULong VG_(clo_rr_checkpoint_syscalls);
+extern ULong VG_(clo_rr_checkpoint_bbs);
+/* replay: run without the tool's instrumentation until this event, 0 for never */
+extern ULong VG_(clo_rr_fast_forward_to);
 
 /*
  * Global functions
@@ -52,7 +116,9 @@ extern Char* VG_(clo_log_name_rr);
 
 /* Initialization and exit of m_recordreplay */
 extern void VG_(RR_Init)(Int argc, HChar** argv, HChar** p_toolname);
-extern void VG_(RR_Exit)(void);
+/* the part of initialization that needs the address space manager running */
+extern void VG_(RR_PostAspacemInit)(void);
+extern void VG_(RR_Exit)(Bool crashed);
 
 /* Client command line */
 extern void VG_(RR_ClientCmdLine) (void);
@@ -65,12 +131,30 @@ extern void VG_(RR_Thread_Acquire)(ThreadId tid, Char* who);
 /* release the BigLock and yield */
 extern void VG_(RR_Thread_Release)(ThreadId tid, Char* who);
 
+/* Process trees: around a fork of the client, and at an exec */
+extern void VG_(RR_PreFork)(ThreadId tid);
+extern void VG_(RR_PostFork)(ThreadId tid, SysRes* res);
+extern HChar** VG_(RR_Exec)(ThreadId tid, Bool traced);
+
 /* Syscall related */
 // extern void VG_(RR_syscall_args) (ThreadId tid, UInt sysno, VexGuestArchState* cpuState); 
 extern void VG_(RR_Syscall_VexGuestArchState) (ThreadId tid, UInt sysno, void* vex);
 extern void VG_(RR_Syscall_Ret)(ULong* ret);
 // VG_(RR_syscall_mem)(Int numAddrs, void* addr1, Int len1, void* addr2, Int len2, ...)
 extern void VG_(RR_Syscall_Mem)(Int numAddrs, ...);
+/* True when syscalls without a record_replay wrapper are recorded/replayed,
+   their memory side effects captured from the post handler's POST_MEM_WRITEs */
+extern Bool VG_(RR_Syscall_Auto)(void);
+extern void VG_(RR_Syscall_CaptureMemWrites)(ThreadId tid, Bool capture);
+extern void VG_(RR_Syscall_PostMemWrite)(ThreadId tid, Addr a, SizeT len);
+/* the len bytes read from fd into buf, see --rr-file-refs */
+extern void VG_(RR_Syscall_FileRead)(Int fd, void* buf, SizeT len);
+/* before syscall sysno, that may modify a file read before */
+extern void VG_(RR_Syscall_FileModify)(UInt sysno, UWord arg1, UWord arg2,
+                                       UWord arg3, UWord arg4);
+/* A clock read served by the virtual clock, without a syscall */
+extern Bool VG_(RR_Syscall_Clock)(ThreadId tid, UInt sysno, UWord arg1, 
+                                  UWord arg2, SysRes* res);
 /* Remember dispatch counter around every syscall in record, and check it in replay */
 extern void VG_(RR_Syscall_DispatchCtr)(UInt ctr, Bool isBefore);
 
@@ -87,6 +171,26 @@ extern IRSB* VG_(instrumentRecordReplay)( void* closureV,
                                           VexGuestExtents* vge,
                                           IRType gWordTy, IRType hWordTy );
 
+/* Event index of the replay log */
+extern ULong VG_(RR_CurrentEvent)(void);
+extern Bool VG_(RR_FindEvent)(ULong event_no, RRLogPos* pos);
+extern Bool VG_(RR_FindSyscall)(ThreadId tid, ULong nth, RRLogPos* pos);
+/* True once, when the event --rr-seek asks for has been replayed */
+extern Bool VG_(RR_SeekReached)(void);
+
+/* Replay without the tool until --rr-fast-forward-to */
+extern Bool VG_(RR_FastForwarding)(void);
+extern void VG_(RR_MaybeEndFastForward)(void);
+
+/* Replay checkpoints */
+extern void VG_(RR_Checkpoint)(ThreadId tid, ULong bbs_done);
+extern Bool VG_(RR_RestartFromCheckpoint)(ULong event_no);
+
+/* Reverse execution in the gdbserver, on top of the checkpoints */
+extern Bool VG_(RR_CanReverse)(void);
+extern void VG_(RR_ReverseResume)(ThreadId tid, Bool step);
+extern Bool VG_(RR_HideGdbStop)(ThreadId tid, RRStopKind kind, Bool* resume_step);
+
 /* Thread id conversion between the tid from kernel's view and from client's view. Replay-only */
 extern unsigned long VG_(kernel_id_to_recorded_id)(unsigned long kernel_id);
 extern unsigned long VG_(recorded_id_to_kernel_id)(unsigned long recorded_id);
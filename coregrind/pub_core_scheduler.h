@@ -88,6 +88,14 @@ extern Bool VG_(owns_BigLock_LL) ( ThreadId tid );
    normal (non _LL) functions. */
 extern void VG_(vg_yield)(void);
 
+#ifdef RECORD_REPLAY
+/* Replay: VG_(replay_yield) puts tid to sleep, without the lock, until
+   VG_(replay_handoff)(tid) hands the lock over to it.  Both are called
+   with the lock held. */
+extern void VG_(replay_yield)   ( ThreadId tid );
+extern void VG_(replay_handoff) ( ThreadId tid );
+#endif
+
 // The scheduler.
 extern VgSchedReturnCode VG_(scheduler) ( ThreadId tid );
 
@@ -106,6 +114,11 @@ extern void VG_(scheduler_init_phase2) ( ThreadId main_tid,
 extern void VG_(disable_vgdb_poll) (void );
 extern void VG_(force_vgdb_poll) ( void );
 
+// Number of basic blocks entered so far, counting the one running
+// when called from generated code. Each block entry counts exactly
+// once, so that a replay can tell positions in it apart.
+extern ULong VG_(get_bbs_entered) ( void );
+
 /* Stats ... */
 extern void VG_(print_scheduler_stats) ( void );
 
@@ -227,6 +227,7 @@ typedef struct {
 
    void (*track_start_client_code)(ThreadId, ULong);
    void (*track_stop_client_code) (ThreadId, ULong);
+   void (*track_end_fast_forward)(void);
 
    void (*track_pre_thread_ll_create)(ThreadId, ThreadId);
    void (*track_pre_thread_first_insn)(ThreadId);
@@ -37,8 +37,12 @@
    deliberately not very high since our implementation of some of the
    scheduler algorithms is surely O(N) in the number of threads, since
    that's simple, at least.  And (in practice) we hope that most
-   programs do not need many threads. */
+   programs do not need many threads.  It can be raised when building
+   Valgrind, e.g. with CPPFLAGS=-DVG_N_THREADS=4096, for programs
+   running a thread per connection. */
+#ifndef VG_N_THREADS
 #define VG_N_THREADS 500
+#endif
 
 /* Special magic value for an invalid ThreadId.  It corresponds to
    LinuxThreads using zero as the initial value for
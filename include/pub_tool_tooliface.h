@@ -639,6 +639,16 @@ void VG_(track_stop_client_code)(
         void(*f)(ThreadId tid, ULong blocks_dispatched)
      );
 
+/* Called once when the core switches the tool's instrumentation on
+   after running the client without it (replay with
+   --rr-fast-forward-to).  The core events (mmap, brk, stack, syscall
+   memory writes, ...) were still reported in the meantime, but loads
+   and stores were not: a tool with shadow memory should bring it to a
+   state that can't produce false errors, e.g. all defined.  The
+   registers of all threads are reported just before with
+   post_reg_write. */
+void VG_(track_end_fast_forward)( void(*f)(void) );
+
 
 /* Thread events (not exhaustive)
 
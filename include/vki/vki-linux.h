@@ -1254,6 +1254,16 @@ struct  vki_seminfo {
 #define VKI_MREMAP_MAYMOVE	1
 #define VKI_MREMAP_FIXED	2
 
+//----------------------------------------------------------------------
+// From linux-2.6.8.1/include/asm-generic/mman.h
+//----------------------------------------------------------------------
+
+#define VKI_MADV_NORMAL		0	/* no further special treatment */
+#define VKI_MADV_RANDOM		1	/* expect random page references */
+#define VKI_MADV_SEQUENTIAL	2	/* expect sequential page references */
+#define VKI_MADV_WILLNEED	3	/* will need these pages */
+#define VKI_MADV_DONTNEED	4	/* don't need these pages */
+
 //----------------------------------------------------------------------
 // From linux-2.6.31-rc4/include/linux/futex.h
 //----------------------------------------------------------------------
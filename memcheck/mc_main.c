@@ -32,6 +32,7 @@
 
 #include "pub_tool_basics.h"
 #include "pub_tool_aspacemgr.h"
+#include "pub_tool_aspacehl.h"      // VG_(get_segment_starts)
 #include "pub_tool_gdbserver.h"
 #include "pub_tool_poolalloc.h"
 #include "pub_tool_hashtable.h"     // For mc_include.h
@@ -1793,6 +1794,38 @@ static void make_mem_defined_if_addressable ( Addr a, SizeT len )
    }
 }
 
+/* Replay with --rr-fast-forward-to ran the client without our
+   instrumentation up to now.  The core events kept addressability
+   right, but not definedness: take every addressable byte of the
+   client's memory as defined.  Secondaries that are no-access or
+   defined as a whole are skipped. */
+static void mc_end_fast_forward ( void )
+{
+   Int     i, n_seg_starts;
+   Addr    a, next;
+   SizeT   len;
+   SecMap* sm;
+   Addr*   seg_starts = VG_(get_segment_starts)( &n_seg_starts );
+
+   for (i = 0; i < n_seg_starts; i++) {
+      NSegment const* seg = VG_(am_find_nsegment)( seg_starts[i] );
+      tl_assert(seg);
+      if (seg->kind != SkFileC && seg->kind != SkAnonC 
+          && seg->kind != SkShmC) continue;
+
+      for (a = seg->start; a >= seg->start && a <= seg->end; a = next) {
+         next = (a & ~(Addr)SM_MASK) + SM_SIZE;
+         len  = (next - 1 <= seg->end ? next : seg->end + 1) - a;
+         sm   = get_secmap_for_reading(a);
+         if (sm == &sm_distinguished[SM_DIST_UNDEFINED])
+            MC_(make_mem_defined)( a, len );
+         else if (!is_distinguished_sm(sm))
+            make_mem_defined_if_addressable( a, len );
+      }
+   }
+   VG_(free)(seg_starts);
+}
+
 /* Similarly (needed for mprotect handling ..) */
 static void make_mem_defined_if_noaccess ( Addr a, SizeT len )
 {
@@ -6782,6 +6815,8 @@ static void mc_pre_clo_init(void)
    VG_(track_post_reg_write)                  ( mc_post_reg_write );
    VG_(track_post_reg_write_clientcall_return)( mc_post_reg_write_clientcall );
 
+   VG_(track_end_fast_forward)    ( mc_end_fast_forward );
+
    VG_(needs_watchpoint)          ( mc_mark_unaddressable_for_watchpoint );
 
    init_shadow_memory();
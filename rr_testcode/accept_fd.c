@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* accept is replayed: the descriptor it returned in record must stay
+   taken in replay for the open after it to get the same number. */
+int main(){
+    struct sockaddr_un addr;
+    int s, c, a;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, "rr_accept.tmp");
+    unlink(addr.sun_path);
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    bind(s, (struct sockaddr*)&addr, sizeof(addr));
+    listen(s, 1);
+    if(fork() == 0){
+        c = socket(AF_UNIX, SOCK_STREAM, 0);
+        connect(c, (struct sockaddr*)&addr, sizeof(addr));
+        write(c, "hello", 5);
+        close(c);
+        return 0;
+    }
+    a = accept(s, NULL, NULL);
+    printf("accepted: %d\n", a);
+    printf("open: %d\n", open("/dev/null", O_RDONLY));
+    printf("close: %d\n", close(a));
+    close(s);
+    unlink(addr.sun_path);
+    return 0;
+}
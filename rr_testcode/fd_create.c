@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+
+/* The descriptors made in record must be made in replay too: the numbers
+   the later opens get, and the results of close, must be the same. */
+int main(){
+    int fds[8], sv[2], n = 0, i;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    fds[n++] = socket(AF_INET, SOCK_STREAM, 0);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fds[n++] = sv[0];
+    fds[n++] = sv[1];
+    fds[n++] = epoll_create(1);
+    fds[n++] = eventfd(0, 0);
+    fds[n++] = timerfd_create(CLOCK_MONOTONIC, 0);
+    fds[n++] = signalfd(-1, &mask, 0);
+    fds[n++] = inotify_init();
+    for(i = 0; i < n; i++)
+        printf("fd %d\n", fds[i]);
+    printf("open: %d\n", open("/dev/null", O_RDONLY));
+    for(i = 0; i < n; i++)
+        printf("close %d: %d\n", fds[i], close(fds[i]));
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The file system changes made in record must be made in replay too: the
+   natively run opens look the names up. */
+int main(){
+    int fd;
+    char *p;
+
+    mkdir("rr_fs.tmp", 0755);
+    fd = open("rr_fs.tmp/a", O_CREAT | O_EXCL | O_WRONLY, 0644);
+    printf("create a: %d\n", fd >= 0);
+    close(fd);
+    printf("rename: %d\n", rename("rr_fs.tmp/a", "rr_fs.tmp/b"));
+    printf("symlink: %d\n", symlink("b", "rr_fs.tmp/c"));
+    printf("open c: %d\n", (fd = open("rr_fs.tmp/c", O_RDONLY)) >= 0);
+    close(fd);
+    printf("unlink c: %d\n", unlink("rr_fs.tmp/c"));
+    printf("unlink b: %d\n", unlink("rr_fs.tmp/b"));
+    /* fails unless the unlink really ran */
+    fd = open("rr_fs.tmp/b", O_CREAT | O_EXCL | O_WRONLY, 0644);
+    printf("create b again: %d\n", fd >= 0);
+    close(fd);
+    unlink("rr_fs.tmp/b");
+    printf("rmdir: %d\n", rmdir("rr_fs.tmp"));
+    printf("mkdir again: %d\n", mkdir("rr_fs.tmp", 0755));
+
+    /* owners and sizes too: the natively run mmap faults past the end of
+       the file unless the ftruncate really ran */
+    fd = open("rr_fs.tmp/d", O_CREAT | O_RDWR, 0644);
+    printf("chown: %d\n", chown("rr_fs.tmp/d", getuid(), getgid()));
+    printf("fchown: %d\n", fchown(fd, -1, getgid()));
+    printf("lchown: %d\n", lchown("rr_fs.tmp/d", getuid(), -1));
+    printf("ftruncate: %d\n", ftruncate(fd, 4096));
+    p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+    printf("mapped end: %d\n", p != MAP_FAILED && p[4095] == 0);
+    munmap(p, 4096);
+    printf("truncate: %d\n", truncate("rr_fs.tmp/d", 8192));
+    p = mmap(NULL, 8192, PROT_READ, MAP_SHARED, fd, 0);
+    printf("mapped new end: %d\n", p != MAP_FAILED && p[8191] == 0);
+    munmap(p, 8192);
+    close(fd);
+    unlink("rr_fs.tmp/d");
+    rmdir("rr_fs.tmp");
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* The children fork makes are real in replay: the waits must really reap
+   them, and setsid/setpgid really move them. */
+int main(){
+    pid_t pid;
+    int st;
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+    pid = fork();
+    if(pid == 0){
+        printf("child setsid: %d\n", setsid() == getpid());
+        _exit(3);
+    }
+    printf("waitpid: %d", waitpid(pid, &st, 0) == pid);
+    printf(" status: %d\n", WEXITSTATUS(st));
+    /* a zombie a replayed wait left behind would still take signals */
+    printf("reaped: %d\n", kill(pid, 0) < 0 && errno == ESRCH);
+
+    pid = fork();
+    if(pid == 0){
+        printf("child setpgid: %d\n", setpgid(0, 0));
+        _exit(4);
+    }
+    printf("wait4: %d", wait4(pid, &st, 0, NULL) == pid);
+    printf(" status: %d\n", WEXITSTATUS(st));
+    printf("no more children: %d\n", wait(&st) < 0 && errno == ECHILD);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* The kernel rewrites msg_namelen, msg_controllen and msg_flags: the
+   replay must see the recorded ones before it sizes the name and the
+   control data. The name buffer here is smaller than the address.
+   The descriptor passed in the control data must keep its number taken
+   in replay, for the open after it to get the recorded one. */
+int main(){
+    struct sockaddr_un a, b;
+    char name[8], data[16], control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { data, sizeof(data) };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int s, c, n, fd;
+
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, "rr_recvmsg_a.tmp");
+    b = a;
+    strcpy(b.sun_path, "rr_recvmsg_b.tmp");
+    unlink(a.sun_path);
+    unlink(b.sun_path);
+    s = socket(AF_UNIX, SOCK_DGRAM, 0);
+    c = socket(AF_UNIX, SOCK_DGRAM, 0);
+    bind(s, (struct sockaddr*)&a, sizeof(a));
+    bind(c, (struct sockaddr*)&b, sizeof(b));
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &c, sizeof(int));
+    strcpy(data, "hello");
+    msg.msg_name = &a;
+    msg.msg_namelen = sizeof(a);
+    sendmsg(c, &msg, 0);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(data, 0, sizeof(data));
+    msg.msg_name = name;
+    msg.msg_namelen = sizeof(name);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = recvmsg(s, &msg, 0);
+    printf("recvmsg: %d %s\n", n, data);
+    printf("namelen: %d controllen: %d flags: %d\n",
+           (int)msg.msg_namelen, (int)msg.msg_controllen, msg.msg_flags);
+    printf("name: %.*s\n", (int)(sizeof(name) - 2), name + 2);
+    fd = open("/dev/null", O_RDONLY);
+    printf("open after recvmsg: %d\n", fd);
+    unlink(a.sun_path);
+    unlink(b.sun_path);
+    return 0;
+}
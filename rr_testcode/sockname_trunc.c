@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* getsockname into a buffer smaller than the address: the kernel returns
+   the full length, but only fills the buffer. The bytes past it must be
+   left alone in replay too. */
+int main(){
+    struct sockaddr_un addr;
+    char buf[16];
+    socklen_t len = 8;
+    int s;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, "rr_sockname.tmp");
+    unlink(addr.sun_path);
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    bind(s, (struct sockaddr*)&addr, sizeof(addr));
+    memset(buf, 'x', sizeof(buf));
+    printf("getsockname: %d\n", getsockname(s, (struct sockaddr*)buf, &len));
+    printf("len: %d\n", (int)len);
+    printf("buf: %.*s\n", (int)(sizeof(buf) - 2), buf + 2);
+    close(s);
+    unlink(addr.sun_path);
+    return 0;
+}
@@ -0,0 +1,136 @@
+
+/*--------------------------------------------------------------------*/
+/*--- A program that prints an rrcheck execution trace as text.     ---*/
+/*---                                               rrcheck_dump.c ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of rrcheck, a Valgrind tool that detects replay
+   divergence
+
+   Copyright (C) 2008
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+/*
+ * Usage: rrcheck_dump [trace file]
+ *
+ * Prints one line per record, in the text format rrcheck used to write,
+ * so two traces can be compared with diff. The trace must come from a
+ * host of the same byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rrcheck_trace.h"
+
+static unsigned long long get_word(const unsigned char* p, int wordsz)
+{
+   unsigned int w4;
+   unsigned long long w8;
+
+   if (wordsz == 4) {
+      memcpy(&w4, p, 4);
+      return w4;
+   }
+   memcpy(&w8, p, 8);
+   return w8;
+}
+
+static unsigned int get_u16(const unsigned char* p)
+{
+   unsigned short v;
+   memcpy(&v, p, 2);
+   return v;
+}
+
+int main(int argc, char** argv)
+{
+   const char* name = argc > 1 ? argv[1] : "execution_trace.log";
+   unsigned char hdr[RRCT_HEADER_SIZE];
+   unsigned char rec[RRCT_MAX_RECORD_SIZE];
+   unsigned long long n_recs = 0;
+   int wordsz, len;
+   FILE* f;
+
+   if (argc > 2) {
+      fprintf(stderr, "usage: rrcheck_dump [trace file]\n");
+      return 1;
+   }
+   f = fopen(name, "rb");
+   if (f == NULL) {
+      fprintf(stderr, "rrcheck_dump: can't open %s\n", name);
+      return 1;
+   }
+   if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)
+       || memcmp(hdr, RRCT_MAGIC, 4) != 0 || hdr[4] != RRCT_VERSION
+       || (hdr[5] != 4 && hdr[5] != 8)) {
+      fprintf(stderr, "rrcheck_dump: %s is not an rrcheck execution trace\n",
+              name);
+      return 1;
+   }
+   wordsz = hdr[5];
+
+   while (fread(rec, 1, 1, f) == 1) {
+      len = RRCT_RECORD_SIZE(rec[0], wordsz);
+      if (len == 0) {
+         fprintf(stderr, "rrcheck_dump: bad record kind 0x%x after %llu "
+                 "records\n", rec[0], n_recs);
+         return 1;
+      }
+      if (fread(rec + 1, 1, len - 1, f) != (size_t)(len - 1)) {
+         fprintf(stderr, "rrcheck_dump: trace truncated after %llu records\n",
+                 n_recs);
+         return 1;
+      }
+      switch (rec[0]) {
+      case RRCT_SB:
+         printf("SB  %08llX\n", get_word(rec + 1, wordsz));
+         break;
+      case RRCT_INSTR:
+         printf("I  %08llX,%u\n", get_word(rec + 1, wordsz),
+                rec[1 + wordsz]);
+         break;
+      case RRCT_LOAD:
+      case RRCT_STORE:
+         printf("%c  %08llX,%08llX,%u\n", rec[0], get_word(rec + 1, wordsz),
+                get_word(rec + 1 + wordsz, wordsz),
+                get_u16(rec + 1 + 2 * wordsz));
+         break;
+      case RRCT_PUT:
+      case RRCT_GET:
+         printf("%c  %08X,%08llX\n", rec[0], get_u16(rec + 1),
+                get_word(rec + 3, wordsz));
+         break;
+      case RRCT_HASH:
+         printf("H  %016llX,%llu,%llu\n", get_word(rec + 1, 8),
+                get_word(rec + 9, 8), get_word(rec + 17, 8));
+         break;
+      }
+      n_recs++;
+   }
+   fclose(f);
+   return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*--- end                                          rrcheck_dump.c ---*/
+/*--------------------------------------------------------------------*/
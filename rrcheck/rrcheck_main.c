@@ -46,6 +46,8 @@
 #include "pub_tool_machine.h"      // VG_(fnptr_to_fnentry)
 #include "libvex_guest_offsets.h"
 
+#include "rrcheck_trace.h"
+
 /* 
  * TODO: Record/replay memory side-effects of load, and register GET. Then we
  *       can detect divergence a little earlier.
@@ -60,10 +62,13 @@ typedef enum RRState{
 }RRState;
 
 /* ------------- command line options --------------- */
-static Char* rrcheck_out_file = "execution_trace.log";
+static HChar* rrcheck_out_file = "execution_trace.log";
 static Bool clo_trace_mem       = False;
 static Bool clo_trace_reg       = False;
 static Bool clo_trace_sbs       = True;
+static ULong clo_hash_interval  = 0;
+static ULong clo_check_from_sb  = 0;
+static ULong clo_check_to_sb    = 0;
 
 extern RRState VG_(clo_record_replay);  /* 1, record; 2, replay */
 
@@ -73,6 +78,9 @@ static Bool rrcheck_process_cmd_line_option(Char* arg)
    else if VG_BOOL_CLO(arg, "--trace-mem",         clo_trace_mem) {}
    else if VG_BOOL_CLO(arg, "--trace-reg",         clo_trace_reg) {}
    else if VG_BOOL_CLO(arg, "--trace-superblocks", clo_trace_sbs) {}
+   else if VG_BINT_CLO(arg, "--hash-interval", clo_hash_interval, 0, (Long)1 << 62) {}
+   else if VG_BINT_CLO(arg, "--check-from-sb", clo_check_from_sb, 1, (Long)1 << 62) {}
+   else if VG_BINT_CLO(arg, "--check-to-sb",   clo_check_to_sb,   1, (Long)1 << 62) {}
    else
       return False;
 
@@ -87,7 +95,13 @@ static void rrcheck_print_usage(void)
 "    --trace-mem=no|yes        trace all loads and stores [no]\n"
 "    --trace-reg=no|yes        trace all register puts/gets [no]\n"
 "    --trace-superblocks=yes|no  trace all superblock entries [yes]\n"
-"    --log-name=<log file name>  the name of execution trace log [execution-trace.log]\n"
+"    --log-name=<log file name>  the name of execution trace log, print it\n"
+"                                with rrcheck_dump [execution_trace.log]\n"
+"    --hash-interval=<number>  record: log only a hash of the records of every\n"
+"                              <number> superblocks, the records themselves\n"
+"                              go to <log file name>.detail [0]\n"
+"    --check-from-sb=<number>  replay of a hashed log: check the records in\n"
+"    --check-to-sb=<number>    full from/to these superblock entries [none]\n"
    );
 }
 
@@ -100,31 +114,221 @@ static void rrcheck_print_debug_usage(void)
 /* ---------- end of command line options ----------- */
 
 
-SysRes  sres;
-Int fd = -1;
-
-static void rrcheck_post_clo_init(void)
+/* 
+ * The execution trace goes through the buffer of its TraceFile: in record
+ * it is written out when full, in replay it is refilled when used up. 
+ * Threads run one at a time under the BigLock, so a single buffer keeps 
+ * their records in execution order.
+ *
+ * With --hash-interval, the records go to the detail file instead, and the
+ * trace only holds one RRCT_HASH record for every hash window of that many
+ * superblocks. Replay then only compares the hashes, and the detail file 
+ * is read only for the superblocks given by --check-from-sb/--check-to-sb.
+ */
+#define TRACE_BUF_SIZE  (256 * 1024)
+typedef struct {
+   HChar* name;
+   Int    fd;
+   UChar* buf;
+   Int    used;    /* bytes in buf */
+   Int    pos;     /* replay: the next record in buf */
+   ULong  base;    /* offset in the file of buf[0] */
+} TraceFile;
+
+static TraceFile trace  = { NULL, -1 };
+static TraceFile detail = { NULL, -1 };
+
+/* superblocks per hash window, 0 for a trace of all the records */
+static ULong hash_interval = 0;
+
+static void open_trace(TraceFile* tf, HChar* name)
 {
-   tl_assert2(VG_(clo_record_replay) == RECORDONLY || VG_(clo_record_replay) == REPLAYONLY,
-               "rrcheck can only be enabled for Valgrind during record-only mode or during replay-only mode\n"); 
-   tl_assert2(clo_trace_sbs == True || clo_trace_mem == True || clo_trace_reg == True,
-         "Either --trace-superblocks=yes or --trace-mem=yes or --trace-reg=yes should be set.");
+   SysRes sres;
 
    if(VG_(clo_record_replay) == RECORDONLY)
-      sres = VG_(open)(rrcheck_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+      sres = VG_(open)(name, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
                                             VKI_S_IRUSR|VKI_S_IWUSR);
    else /* replay */
-      sres = VG_(open)(rrcheck_out_file, VKI_O_RDONLY, VKI_S_IRUSR|VKI_S_IWUSR);
+      sres = VG_(open)(name, VKI_O_RDONLY, VKI_S_IRUSR|VKI_S_IWUSR);
 
    if (sr_isError(sres)) {
       // If the file can't be opened for whatever reason, give up now.
       VG_(message)(Vg_UserMsg,
          "error: can't open output file '%s'",
-         rrcheck_out_file );
+         name );
       VG_(exit)(1);
-   } else {
-      fd = sr_Res(sres);
-   }   
+   }
+   tf->name = name;
+   tf->fd = sr_Res(sres);
+   tf->buf = VG_(malloc)("rrcheck.trace", TRACE_BUF_SIZE);
+   tf->used = tf->pos = 0;
+   tf->base = 0;
+}
+
+static void flush_trace(TraceFile* tf)
+{
+   Int off = 0, n;
+
+   while(off < tf->used) {
+      n = VG_(write)(tf->fd, tf->buf + off, tf->used - off);
+      tl_assert2(n > 0, "rrcheck: can't write %s\n", tf->name);
+      off += n;
+   }
+   tf->base += tf->used;
+   tf->used = 0;
+}
+
+static void close_trace(TraceFile* tf)
+{
+   if(tf->fd == -1)
+      return;
+   if(VG_(clo_record_replay) == RECORDONLY)
+      flush_trace(tf);
+   VG_(close)(tf->fd);
+   tf->fd = -1;
+}
+
+/* record: the file offset the next record is written at */
+static ULong trace_offset(TraceFile* tf)
+{
+   return tf->base + tf->used;
+}
+
+static void append_trace(TraceFile* tf, UChar* rec, Int len)
+{
+   if(tf->used + len > TRACE_BUF_SIZE)
+      flush_trace(tf);
+   VG_(memcpy)(tf->buf + tf->used, rec, len);
+   tf->used += len;
+}
+
+/* replay: have at least n unread bytes in the buffer; False at the end of the trace */
+static Bool fill_trace(TraceFile* tf, Int n)
+{
+   Int got;
+
+   if(tf->used - tf->pos >= n)
+      return True;
+   VG_(memmove)(tf->buf, tf->buf + tf->pos, tf->used - tf->pos);
+   tf->base += tf->pos;
+   tf->used -= tf->pos;
+   tf->pos = 0;
+   while(tf->used < n) {
+      got = VG_(read)(tf->fd, tf->buf + tf->used, TRACE_BUF_SIZE - tf->used);
+      if(got <= 0)
+         return False;
+      tf->used += got;
+   }
+   return True;
+}
+
+/* replay: read on from file offset off */
+static void seek_trace(TraceFile* tf, ULong off)
+{
+   tl_assert2(VG_(lseek)(tf->fd, off, VKI_SEEK_SET) == off, 
+              "rrcheck: can't seek in %s\n", tf->name);
+   tf->base = off;
+   tf->used = tf->pos = 0;
+}
+
+static void write_trace_header(TraceFile* tf)
+{
+   VG_(memcpy)(tf->buf, RRCT_MAGIC, 4);
+   tf->buf[4] = RRCT_VERSION;
+   tf->buf[5] = sizeof(HWord);
+   tf->buf[6] = tf->buf[7] = 0;
+   VG_(memcpy)(tf->buf + 8, &hash_interval, sizeof(ULong));
+   tf->used = RRCT_HEADER_SIZE;
+}
+
+static void read_trace_header(TraceFile* tf)
+{
+   tl_assert2(fill_trace(tf, RRCT_HEADER_SIZE) 
+              && VG_(memcmp)(tf->buf, RRCT_MAGIC, 4) == 0
+              && tf->buf[4] == RRCT_VERSION,
+              "rrcheck: %s is not an execution trace of this rrcheck\n", 
+              tf->name);
+   tl_assert2(tf->buf[5] == sizeof(HWord),
+              "rrcheck: %s was recorded with %d-byte words\n", 
+              tf->name, tf->buf[5]);
+   VG_(memcpy)(&hash_interval, tf->buf + 8, sizeof(ULong));
+   tf->pos = RRCT_HEADER_SIZE;
+}
+
+static void put_word(UChar** p, HWord w)
+{
+   VG_(memcpy)(*p, &w, sizeof(HWord));
+   *p += sizeof(HWord);
+}
+
+static void put_u16(UChar** p, UShort v)
+{
+   VG_(memcpy)(*p, &v, sizeof(UShort));
+   *p += sizeof(UShort);
+}
+
+static void put_u64(UChar** p, ULong v)
+{
+   VG_(memcpy)(*p, &v, sizeof(ULong));
+   *p += sizeof(ULong);
+}
+
+static HWord get_word(UChar* p)
+{
+   HWord w;
+   VG_(memcpy)(&w, p, sizeof(HWord));
+   return w;
+}
+
+static UShort get_u16(UChar* p)
+{
+   UShort v;
+   VG_(memcpy)(&v, p, sizeof(UShort));
+   return v;
+}
+
+static ULong get_u64(UChar* p)
+{
+   ULong v;
+   VG_(memcpy)(&v, p, sizeof(ULong));
+   return v;
+}
+
+static void rrcheck_post_clo_init(void)
+{
+   static HChar detail_name[VKI_PATH_MAX];
+
+   tl_assert2(VG_(clo_record_replay) == RECORDONLY || VG_(clo_record_replay) == REPLAYONLY,
+               "rrcheck can only be enabled for Valgrind during record-only mode or during replay-only mode\n"); 
+   tl_assert2(clo_trace_sbs == True || clo_trace_mem == True || clo_trace_reg == True,
+         "Either --trace-superblocks=yes or --trace-mem=yes or --trace-reg=yes should be set.");
+
+   open_trace(&trace, rrcheck_out_file);
+   if(VG_(clo_record_replay) == RECORDONLY) {
+      hash_interval = clo_hash_interval;
+      write_trace_header(&trace);
+   }
+   else
+      read_trace_header(&trace);
+
+   if(hash_interval == 0) {
+      tl_assert2(clo_check_from_sb == 0,
+            "--check-from-sb needs a trace recorded with --hash-interval.");
+      return;
+   }
+   tl_assert2(clo_trace_sbs == True, "--hash-interval needs --trace-superblocks=yes.");
+   tl_assert2(clo_check_from_sb == 0 || (clo_check_from_sb - 1) % hash_interval == 0,
+         "--check-from-sb should be the first superblock of a hash window.");
+   tl_assert(VG_(strlen)(rrcheck_out_file) + 8 < VKI_PATH_MAX);
+   VG_(sprintf)(detail_name, "%s.detail", rrcheck_out_file);
+   if(VG_(clo_record_replay) == RECORDONLY) {
+      open_trace(&detail, detail_name);
+      write_trace_header(&detail);
+   }
+   else if(clo_check_from_sb > 0) {
+      open_trace(&detail, detail_name);
+      read_trace_header(&detail);
+   }
 }
 
 #define FILE_LEN     VKI_PATH_MAX
@@ -180,40 +384,84 @@ static ULong n_get_mismatch = 0;;
 static Addr last_instr;
 static SizeT last_sz;
 
-/* check rt_line with next line in the execution trace log. If equal return True, else return False */
-/* TODO: refine me */
-static Bool checkWithNextLogLine(Char* rt_line, Bool print)
+/* print a record the way rrcheck_dump does */
+static void format_record(Char* buf, UChar* rec)
+{
+   switch(rec[0]) {
+   case RRCT_SB:
+      VG_(sprintf)(buf, "SB  %08lX", get_word(rec + 1));
+      break;
+   case RRCT_INSTR:
+      VG_(sprintf)(buf, "I  %08lX,%u", get_word(rec + 1), 
+                   (UInt)rec[1 + sizeof(HWord)]);
+      break;
+   case RRCT_LOAD:
+   case RRCT_STORE:
+      VG_(sprintf)(buf, "%c  %08lX,%08lX,%u", rec[0], get_word(rec + 1), 
+                   get_word(rec + 1 + sizeof(HWord)), 
+                   (UInt)get_u16(rec + 1 + 2 * sizeof(HWord)));
+      break;
+   case RRCT_PUT:
+   case RRCT_GET:
+      VG_(sprintf)(buf, "%c  %08X,%08lX", rec[0], (UInt)get_u16(rec + 1), 
+                   get_word(rec + 1 + sizeof(UShort)));
+      break;
+   default:
+      VG_(sprintf)(buf, "bad record kind 0x%x", (UInt)rec[0]);
+      break;
+   }
+}
+
+/* the rolling hash of the current hash window */
+#define HASH_INIT    0xcbf29ce484222325ULL
+static ULong window_hash = HASH_INIT;
+/* replay: checking the records of the detail file */
+static Bool in_check_window = False;
+
+/* FNV-1a, over the records of the window in order */
+static void hash_record(UChar* rec, Int len)
+{
+   Int i;
+
+   for(i = 0; i < len; i++) {
+      window_hash ^= rec[i];
+      window_hash *= 0x100000001b3ULL;
+   }
+}
+
+/* Replay: check the record rec of len bytes against the next one in tf */
+static Bool check_record(TraceFile* tf, UChar* rec, Int len, Bool print)
 {
-   Char buf[512]; // a line in log
-   UInt len;
-   UInt rt_len;
+   Int logged_len = 0;
+   UChar* logged = NULL;
    Bool ret;
-   
-   rt_len = VG_(strlen)(rt_line);
-   tl_assert(rt_len < 511 ); 
-   len = VG_(read)(fd, buf, rt_len);
-   buf[len] = '\0';
-   if(len != VG_(strlen)(rt_line))
-      ret = False;
-   else if(VG_(strcmp)(buf, rt_line) != 0)
-      ret = False;
-   else ret = True;
+
+   if(fill_trace(tf, 1)) {
+      logged_len = RRCT_RECORD_SIZE(tf->buf[tf->pos], sizeof(HWord));
+      tl_assert2(logged_len > 0, "rrcheck: bad execution trace record kind 0x%x\n",
+                 (UInt)tf->buf[tf->pos]);
+      if(fill_trace(tf, logged_len))
+         logged = tf->buf + tf->pos;
+   }
+   ret = logged != NULL && logged_len == len && VG_(memcmp)(logged, rec, len) == 0;
 
    if(ret == False && print == True){
       Int line;
       Char    file[FILE_LEN], fn[FN_LEN];
-      VG_(printf)("\n******** Log entry mismatch ********\nRuntime:%s    Log:%s\n", rt_line, buf);
+      Char    rt_line[64], log_line[64];
+      format_record(rt_line, rec);
+      if(logged != NULL)
+         format_record(log_line, logged);
+      else
+         VG_(strcpy)(log_line, "end of trace");
+      VG_(printf)("\n******** Log entry mismatch ********\nRuntime:%s\n    Log:%s\n", rt_line, log_line);
       VG_(printf)("Instruction address: 0x%08lX size=%lu\n", last_instr, last_sz);
       //get debug info for runtime instruction address
       get_debug_info(last_instr, file, fn, &line);
       VG_(printf)("file=%s\tfn=%s\tline=%d\n", file, fn, line);
       //get debug info for logged instruction address
-      {
-         Addr tmp_addr = 0;
-         if(buf[0] == 'I')
-            tmp_addr = VG_(strtoll16)(&buf[3], NULL);
-         else if(buf[0] == 'S' && buf[1] == 'B')
-            tmp_addr = VG_(strtoll16)(&buf[4], NULL);
+      if(logged != NULL && (logged[0] == RRCT_INSTR || logged[0] == RRCT_SB)) {
+         Addr tmp_addr = get_word(logged + 1);
          if(tmp_addr > 0){
             VG_(printf)("Logged instruction address: 0x%08lX\n", tmp_addr);
             get_debug_info(tmp_addr, file, fn, &line);
@@ -222,12 +470,39 @@ static Bool checkWithNextLogLine(Char* rt_line, Bool print)
       }
       VG_(printf)("\n");
    }
+   /* skip the logged record as a whole, so the next one is checked in step */
+   if(logged != NULL)
+      tf->pos += logged_len;
    return ret;
 }
 
-static VG_REGPARM(2) void trace_instr(Addr addr, SizeT size)
+/* 
+ * Record: append the record rec of len bytes to the trace. Replay: check it
+ * against the next record in the trace. If equal return True, else return
+ * False.
+ */
+static Bool trace_record(UChar* rec, Int len, Bool print)
 {
-   Char    buf[512];
+   if(hash_interval > 0) {
+      hash_record(rec, len);
+      if(VG_(clo_record_replay) == RECORDONLY)
+         append_trace(&detail, rec, len);
+      else if(in_check_window)
+         return check_record(&detail, rec, len, print);
+      return True;
+   }
+
+   if(VG_(clo_record_replay) == RECORDONLY) {
+      append_trace(&trace, rec, len);
+      return True;
+   }
+   return check_record(&trace, rec, len, print);
+}
+
+static void trace_instr(Addr addr, SizeT size)
+{
+   UChar   rec[RRCT_MAX_RECORD_SIZE];
+   UChar*  p = rec;
 
    tl_assert( (VG_MIN_INSTR_SZB <= size && size <= VG_MAX_INSTR_SZB)
             || VG_CLREQ_SZB == size );
@@ -236,81 +511,148 @@ static VG_REGPARM(2) void trace_instr(Addr addr, SizeT size)
    last_instr = addr;
    last_sz = size;
    count_ir++;
-   VG_(sprintf)(buf, "I  %08lX,%lu\n", addr, size);
+   *p++ = RRCT_INSTR;
+   put_word(&p, addr);
+   *p++ = size;
 
-   if(VG_(clo_record_replay) == RECORDONLY)
-      VG_(write)(fd, (void*)buf, VG_(strlen)(buf));
-   else /* replay */
-      if(!checkWithNextLogLine(buf, n_instr_mismatch==0))
-         n_instr_mismatch++;
+   if(!trace_record(rec, p - rec, n_instr_mismatch==0))
+      n_instr_mismatch++;
 }
 
-static VG_REGPARM(3) void trace_mem_load(Addr addr, HWord val, SizeT size)
+static void trace_mem_load(Addr addr, HWord val, SizeT size)
 {
-   Char    buf[512];
+   UChar   rec[RRCT_MAX_RECORD_SIZE];
+   UChar*  p = rec;
 
    tl_assert(size >= 1 && size <= MAX_DSIZE);
 
    count_dr++;
-   VG_(sprintf)(buf, "L  %08lX,%08lX,%lu\n", addr, val, size);
+   *p++ = RRCT_LOAD;
+   put_word(&p, addr);
+   put_word(&p, val);
+   put_u16(&p, size);
 
-   if(VG_(clo_record_replay) == RECORDONLY) /* record*/
-      VG_(write)(fd, (void*)buf, VG_(strlen)(buf));
-   else /* replay */
-      if(!checkWithNextLogLine(buf, n_load_mismatch==0))
-         n_load_mismatch++;
+   if(!trace_record(rec, p - rec, n_load_mismatch==0))
+      n_load_mismatch++;
 }
 
-static VG_REGPARM(3) void trace_mem_store(Addr addr, HWord val, SizeT size)
+static void trace_mem_store(Addr addr, HWord val, SizeT size)
 {
-   Char    buf[512];
+   UChar   rec[RRCT_MAX_RECORD_SIZE];
+   UChar*  p = rec;
 
    tl_assert(size >= 1 && size <= MAX_DSIZE);
 
    count_dw++;
-   VG_(sprintf)(buf, "S  %08lX,%08lX,%lu\n", addr, val, size);
+   *p++ = RRCT_STORE;
+   put_word(&p, addr);
+   put_word(&p, val);
+   put_u16(&p, size);
 
-   if(VG_(clo_record_replay) == RECORDONLY) /* record*/
-      VG_(write)(fd, (void*)buf, VG_(strlen)(buf));
-   else /* replay */
-      if(!checkWithNextLogLine(buf, n_store_mismatch==0))
-         n_store_mismatch++;
+   if(!trace_record(rec, p - rec, n_store_mismatch==0))
+      n_store_mismatch++;
 }
 
-static VG_REGPARM(2) void trace_reg_put(Addr addr, HWord val)
+static void trace_reg_put(Addr addr, HWord val)
 {
-   Char    buf[512];
+   UChar   rec[RRCT_MAX_RECORD_SIZE];
+   UChar*  p = rec;
 
    count_rp++;
-   VG_(sprintf)(buf, "P  %08lX,%08lX\n", addr, val);
+   *p++ = RRCT_PUT;
+   put_u16(&p, addr);
+   put_word(&p, val);
 
-   if(VG_(clo_record_replay) == RECORDONLY) /* record*/
-      VG_(write)(fd, (void*)buf, VG_(strlen)(buf));
-   else /* replay */
-      if(!checkWithNextLogLine(buf, n_put_mismatch==0))
-         n_put_mismatch++;
+   if(!trace_record(rec, p - rec, n_put_mismatch==0))
+      n_put_mismatch++;
 }
 
-static VG_REGPARM(2) void trace_reg_get(Addr addr, HWord val)
+static void trace_reg_get(Addr addr, HWord val)
 {
-   Char    buf[512];
+   UChar   rec[RRCT_MAX_RECORD_SIZE];
+   UChar*  p = rec;
 
    count_rg++;
-   VG_(sprintf)(buf, "G  %08lX,%08lX\n", addr, val);
+   *p++ = RRCT_GET;
+   put_u16(&p, addr);
+   put_word(&p, val);
 
-   if(VG_(clo_record_replay) == RECORDONLY) /* record*/
-      VG_(write)(fd, (void*)buf, VG_(strlen)(buf));
-   else /* replay */
-      if(!checkWithNextLogLine(buf, n_get_mismatch==0))
-         n_get_mismatch++;
+   if(!trace_record(rec, p - rec, n_get_mismatch==0))
+      n_get_mismatch++;
 }
 
-/* for tracing superblock entries */
 /* for tracing superblock entries */
 static ULong n_sb = 0;
+
+/* the current hash window */
+static ULong window_first_sb = 0;
+static ULong window_detail_off = 0;
+/* replay: the RRCT_HASH record of the current hash window */
+static UChar window_rec[RRCT_MAX_RECORD_SIZE];
+static Bool have_window_rec = False;
+static ULong n_hash_mismatch = 0;
+
+/* log or check the hash of the window ending with superblock last_sb */
+static void end_hash_window(ULong last_sb)
+{
+   UChar   rec[RRCT_MAX_RECORD_SIZE];
+   UChar*  p = rec;
+
+   if(VG_(clo_record_replay) == RECORDONLY) {
+      *p++ = RRCT_HASH;
+      put_u64(&p, window_hash);
+      put_u64(&p, last_sb);
+      put_u64(&p, window_detail_off);
+      append_trace(&trace, rec, p - rec);
+      return;
+   }
+
+   /* replay; the records themselves are checked inside the check window */
+   if(clo_check_from_sb > 0)
+      return;
+   if(have_window_rec && get_u64(window_rec + 1) == window_hash 
+      && get_u64(window_rec + 9) == last_sb)
+      return;
+   if(n_hash_mismatch == 0) {
+      VG_(printf)("\n******** Trace hash mismatch in superblocks %llu-%llu ********\n",
+                  window_first_sb, last_sb);
+      VG_(printf)("Replay again with --check-from-sb=%llu --check-to-sb=%llu "
+                  "to see where it diverges.\n\n", window_first_sb, last_sb);
+   }
+   n_hash_mismatch++;
+}
+
+/* superblock entry n_sb starts a new hash window */
+static void start_hash_window(void)
+{
+   if(n_sb > 1)
+      end_hash_window(n_sb - 1);
+   window_hash = HASH_INIT;
+   window_first_sb = n_sb;
+   if(VG_(clo_record_replay) == RECORDONLY) {
+      window_detail_off = trace_offset(&detail);
+      return;
+   }
+
+   /* replay: the hash of this window is the next record of the trace */
+   have_window_rec = fill_trace(&trace, RRCT_RECORD_SIZE(RRCT_HASH, sizeof(HWord)))
+                     && trace.buf[trace.pos] == RRCT_HASH;
+   if(have_window_rec) {
+      VG_(memcpy)(window_rec, trace.buf + trace.pos, 
+                  RRCT_RECORD_SIZE(RRCT_HASH, sizeof(HWord)));
+      trace.pos += RRCT_RECORD_SIZE(RRCT_HASH, sizeof(HWord));
+   }
+   if(n_sb == clo_check_from_sb) {
+      tl_assert2(have_window_rec, "rrcheck: the trace ends before superblock %llu\n", n_sb);
+      seek_trace(&detail, get_u64(window_rec + 17));
+      in_check_window = True;
+   }
+}
+
 static void trace_superblock(Addr addr)
 {
-   Char buf[512];
+   UChar   rec[RRCT_MAX_RECORD_SIZE];
+   UChar*  p = rec;
    static ULong n_sb_mismatch = 0;;
 
    /* Superblock entry is the first instruction of this block */
@@ -318,13 +660,145 @@ static void trace_superblock(Addr addr)
    last_sz = 0; /* have no idea what the size is at this time */
 
    n_sb++;
-   VG_(sprintf)(buf, "SB  %08lX\n", addr);
+   if(in_check_window && clo_check_to_sb > 0 && n_sb > clo_check_to_sb)
+      in_check_window = False;
+   if(hash_interval > 0 && (n_sb - 1) % hash_interval == 0)
+      start_hash_window();
+   *p++ = RRCT_SB;
+   put_word(&p, addr);
+
+   if(!trace_record(rec, p - rec, n_sb_mismatch==0))
+      n_sb_mismatch++;
+}
 
-   if(VG_(clo_record_replay) == RECORDONLY) /* record*/
-      VG_(write)(fd, (void*)buf, VG_(strlen)(buf));
-   else /* replay */
-      if(!checkWithNextLogLine(buf, n_sb_mismatch==0))
-         n_sb_mismatch++;
+/* 
+ * Events are batched per superblock, the way cachegrind does: while a 
+ * superblock is instrumented, its events are collected in events[], and
+ * what is only known at run time (an address, a stored value) is written 
+ * by inline IR stores into ev_dyn[]. At every exit of the superblock, a 
+ * single call of flush_events() goes over the group of events collected
+ * since the previous exit and traces them in order.
+ *
+ * Threads run one at a time under the BigLock, and a thread only gives it
+ * up between superblocks, after a flush; so one ev_dyn[] serves them all.
+ */
+#define N_EVENTS     64
+
+typedef struct {
+   UChar  tag;        /* RRCT_SB, RRCT_INSTR, ... ; 0 ends a group */
+   Bool   dyn_addr;   /* addr is the next word of ev_dyn[] */
+   Bool   dyn_val;    /* val is the next word of ev_dyn[] */
+   UShort size;       /* access or instruction size, or register offset */
+   HWord  addr;
+   HWord  val;
+} Event;
+
+/* at run time: the words of the current group only known then */
+static HWord ev_dyn[2 * N_EVENTS];
+
+/* at instrumentation time: the group being collected */
+static Event events[N_EVENTS];
+static Int events_used = 0;
+static Int dyn_used = 0;
+
+/* 
+ * The groups of a translation, keyed by its guest address like cachegrind's
+ * instrInfoTable, for them to be freed when the translation is discarded.
+ * A translation without events has none.
+ */
+typedef struct {
+   Addr    sb_addr;   /* key */
+   XArray* groups;    /* of Event*, one per call of flush_events() */
+} SBEvents;
+
+static OSet* sb_events_table;
+/* at instrumentation time: the translation being made, and its groups */
+static Addr cur_sb_addr;
+static SBEvents* cur_sb_events;
+
+static void flush_events(Event* ev)
+{
+   HWord* dyn = ev_dyn;
+   HWord addr, val;
+
+   for(; ev->tag != 0; ev++) {
+      addr = ev->dyn_addr ? *dyn++ : ev->addr;
+      val  = ev->dyn_val  ? *dyn++ : ev->val;
+      switch(ev->tag) {
+      case RRCT_SB:    trace_superblock(addr); break;
+      case RRCT_INSTR: trace_instr(addr, ev->size); break;
+      case RRCT_LOAD:  trace_mem_load(addr, val, ev->size); break;
+      case RRCT_STORE: trace_mem_store(addr, val, ev->size); break;
+      case RRCT_PUT:   trace_reg_put(ev->size, val); break;
+      case RRCT_GET:   trace_reg_get(ev->size, val); break;
+      default:         tl_assert(0);
+      }
+   }
+}
+
+/* Emit the call of flush_events() for the group collected so far */
+static void flushEvents(IRSB* sbOut)
+{
+   Event*   group;
+   IRDirty* di;
+
+   if(events_used == 0)
+      return;
+   /* lives as long as the translation */
+   group = VG_(malloc)("rrcheck.events", (events_used + 1) * sizeof(Event));
+   if(cur_sb_events == NULL) {
+      cur_sb_events = VG_(OSetGen_AllocNode)(sb_events_table, sizeof(SBEvents));
+      cur_sb_events->sb_addr = cur_sb_addr;
+      cur_sb_events->groups = VG_(newXA)(VG_(malloc), "rrcheck.groups", 
+                                         VG_(free), sizeof(Event*));
+      VG_(OSetGen_Insert)(sb_events_table, cur_sb_events);
+   }
+   VG_(addToXA)(cur_sb_events->groups, &group);
+   VG_(memcpy)(group, events, events_used * sizeof(Event));
+   group[events_used].tag = 0;
+   di = unsafeIRDirty_0_N( 
+           1, "flush_events", 
+           VG_(fnptr_to_fnentry)( &flush_events ),
+           mkIRExprVec_1( mkIRExpr_HWord( (HWord)group ) )
+        );
+   addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
+   events_used = 0;
+   dyn_used = 0;
+}
+
+/* 
+ * Add an event to the group. A non-NULL dyn_addr / dyn_val is an atom 
+ * of the host word type whose value is staged in ev_dyn[] at run time, 
+ * in place of the static addr / val.
+ */
+static void addEvent(IRSB* sbOut, UChar tag, UShort size, 
+                     HWord addr, IRExpr* dyn_addr, HWord val, IRExpr* dyn_val)
+{
+#if defined(VG_BIGENDIAN)
+#  define END Iend_BE
+#else
+#  define END Iend_LE
+#endif
+   Event* ev;
+
+   if(events_used == N_EVENTS)
+      flushEvents(sbOut);
+   ev = &events[events_used++];
+   ev->tag = tag;
+   ev->size = size;
+   ev->addr = addr;
+   ev->val = val;
+   ev->dyn_addr = dyn_addr != NULL;
+   ev->dyn_val = dyn_val != NULL;
+   if(dyn_addr) {
+      addStmtToIRSB( sbOut, IRStmt_Store(END, 
+                        mkIRExpr_HWord( (HWord)&ev_dyn[dyn_used++] ), dyn_addr) );
+   }
+   if(dyn_val) {
+      addStmtToIRSB( sbOut, IRStmt_Store(END, 
+                        mkIRExpr_HWord( (HWord)&ev_dyn[dyn_used++] ), dyn_val) );
+   }
+#  undef END
 }
 
 static
@@ -335,19 +809,15 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
                       VexArchInfo* archinfo_host,
                       IRType gWordTy, IRType hWordTy )
 {
-   IRDirty*   di;
    Int        i;
    IRSB*      sbOut;
    IRTypeEnv* tyenv = sbIn->tyenv;
    IRType     type;
-   Addr       mask;
 
 #if (VG_WORDSIZE == 4)
    type = Ity_I32;
-   mask = ~0x03;
 #elif  (VG_WORDSIZE == 8)
    type = Ity_I64;
-   mask = ~0x07;
 #endif
 
    if (gWordTy != hWordTy) {
@@ -357,6 +827,12 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
 
    /* Set up the result SB */
    sbOut = deepCopyIRSBExceptStmts(sbIn);
+   events_used = 0;
+   dyn_used = 0;
+   cur_sb_addr = (Addr)closure->readdr;
+   cur_sb_events = NULL;
+   /* a translation at this address was discarded before being made again */
+   tl_assert(NULL == VG_(OSetGen_Lookup)(sb_events_table, &cur_sb_addr));
 
    // Copy verbatim any IR preamble preceding the first IMark 
    i = 0;
@@ -367,13 +843,7 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
 
    /* count this superblock */
    if (clo_trace_sbs) {
-      /* Print this superblock's address. */
-      di = unsafeIRDirty_0_N( 
-              0, "trace_superblock", 
-              VG_(fnptr_to_fnentry)( &trace_superblock ),
-              mkIRExprVec_1( mkIRExpr_HWord( vge->base[0] ) ) 
-           );
-      addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
+      addEvent( sbOut, RRCT_SB, 0, vge->base[0], NULL, 0, NULL );
    }   
    
    for (/*use current i*/; i < sbIn->stmts_used; i++) {
@@ -391,13 +861,8 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
          case Ist_IMark:
 
             if(clo_trace_mem){
-               di = unsafeIRDirty_0_N( 
-                       2, "trace_instr", 
-                       VG_(fnptr_to_fnentry)( &trace_instr ),
-                       mkIRExprVec_2( mkIRExpr_HWord( (HWord)st->Ist.IMark.addr ),
-                                      mkIRExpr_HWord( st->Ist.IMark.len) ) 
-                    );
-               addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
+               addEvent( sbOut, RRCT_INSTR, st->Ist.IMark.len, 
+                         (HWord)st->Ist.IMark.addr, NULL, 0, NULL );
             }
  
             addStmtToIRSB( sbOut, st );
@@ -407,33 +872,13 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
          {
             IRExpr* data = st->Ist.WrTmp.data;
             if(data->tag == Iex_Load && clo_trace_mem){
-               // Add a call to trace_load()
-                //  IRTemp t = newIRTemp(tyenv, data->Iex.Load.ty);
-                //  addStmtToIRSB(sbOut, IRStmt_WrTmp(t, IRExpr_RdTmp(st->Ist.WrTmp.tmp)));
-               di = unsafeIRDirty_0_N( 
-                       3, "trace_mem_load", 
-                       VG_(fnptr_to_fnentry)( &trace_mem_load ),
-                       mkIRExprVec_3( mkIRExpr_HWord( (HWord)data->Iex.Load.addr ),
-                                      mkIRExpr_HWord( -1 ),
-                      //                IRExpr_RdTmp(st->Ist.WrTmp.tmp),
-                      //                IRExpr_RdTmp(t),
-                                      mkIRExpr_HWord( sizeofIRType(data->Iex.Load.ty) )
-                                    ) 
-                    );
-               addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
+               addEvent( sbOut, RRCT_LOAD, sizeofIRType(data->Iex.Load.ty),
+                         0, data->Iex.Load.addr, (HWord)-1, NULL );
             }
 
             if(data->tag == Iex_Get && clo_trace_reg){
-               IRExpr* data = st->Ist.WrTmp.data;
-               di = unsafeIRDirty_0_N( 
-                       2, "trace_reg_get", 
-                       VG_(fnptr_to_fnentry)( &trace_reg_get ),
-                       mkIRExprVec_2( mkIRExpr_HWord( (HWord)data->Iex.Get.offset ),
-                                      mkIRExpr_HWord( -1 )
-                                    ) 
-                    );
-                  
-               addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
+               addEvent( sbOut, RRCT_GET, data->Iex.Get.offset, 
+                         0, NULL, (HWord)-1, NULL );
             }
          }
 
@@ -443,55 +888,28 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
          case Ist_Store:
             if(clo_trace_mem){
                IRExpr* data  = st->Ist.Store.data;
-               if(typeOfIRExpr(tyenv, data) == type){
-                  di = unsafeIRDirty_0_N( 
-                          3, "trace_mem_store", 
-                          VG_(fnptr_to_fnentry)( &trace_mem_store ),
-                          mkIRExprVec_3( mkIRExpr_HWord( (HWord)st->Ist.Store.addr ),
-                                         data,
-                                         mkIRExpr_HWord( sizeofIRType(typeOfIRExpr(tyenv, data)) )
-                                       ) 
-                       );
-                  /* add in the original instruction second */
-                  addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
-                  addStmtToIRSB( sbOut, st );
-               }
-               else{
-                  di = unsafeIRDirty_0_N( 
-                          3, "trace_mem_store", 
-                          VG_(fnptr_to_fnentry)( &trace_mem_store ),
-                          mkIRExprVec_3( mkIRExpr_HWord( (HWord)st->Ist.Store.addr ),
-                                         mkIRExpr_HWord( -1 ),
-                                         mkIRExpr_HWord( sizeofIRType(typeOfIRExpr(tyenv, data)) )
-                                       ) 
-                       );
-                  /* add in the original instruction first */
-                  addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
-                  addStmtToIRSB( sbOut, st );
-               }
+               if(typeOfIRExpr(tyenv, data) == type)
+                  addEvent( sbOut, RRCT_STORE, sizeofIRType(type),
+                            0, st->Ist.Store.addr, 0, data );
+               else
+                  addEvent( sbOut, RRCT_STORE, sizeofIRType(typeOfIRExpr(tyenv, data)),
+                            0, st->Ist.Store.addr, (HWord)-1, NULL );
             }
-            else
-               addStmtToIRSB( sbOut, st );
+            addStmtToIRSB( sbOut, st );
             break;
 
          case Ist_Put:
             /* general register Put */
+            /* Add in the original instruction first. */
+            addStmtToIRSB( sbOut, st );
             if(clo_trace_reg){
                if(typeOfIRExpr(tyenv, st->Ist.Put.data) == type)
-                  di = unsafeIRDirty_0_N( 2, "trace_reg_put", &trace_reg_put, 
-                              mkIRExprVec_2(mkIRExpr_HWord(st->Ist.Put.offset),
-                                    st->Ist.Put.data));
+                  addEvent( sbOut, RRCT_PUT, st->Ist.Put.offset,
+                            0, NULL, 0, st->Ist.Put.data );
                else
-                  di = unsafeIRDirty_0_N( 2, "trace_reg_put", &trace_reg_put,
-                              mkIRExprVec_2(mkIRExpr_HWord(st->Ist.Put.offset),
-                                    mkIRExpr_HWord(-1)));
-               /* Add in the original instruction first. */
-               addStmtToIRSB( sbOut, st );
-               addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
+                  addEvent( sbOut, RRCT_PUT, st->Ist.Put.offset,
+                            0, NULL, (HWord)-1, NULL );
             }
-            else
-               addStmtToIRSB( sbOut, st );
-
             break;
 
          case Ist_Dirty: {
@@ -505,28 +923,10 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
                   tl_assert(d->mAddr != NULL);
                   tl_assert(d->mSize != 0);
                   dsize = d->mSize;
-                  if (d->mFx == Ifx_Read || d->mFx == Ifx_Modify){
-                     di = unsafeIRDirty_0_N( 
-                             3, "trace_mem_load", 
-                             VG_(fnptr_to_fnentry)( &trace_mem_load ),
-                             mkIRExprVec_3( mkIRExpr_HWord( (HWord)d->mAddr ),
-                                            mkIRExpr_HWord( (HWord)-1 ),
-                                            mkIRExpr_HWord( dsize )
-                                          ) 
-                          );
-                     addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
-                  }
-                  if (d->mFx == Ifx_Write || d->mFx == Ifx_Modify){
-                     di = unsafeIRDirty_0_N( 
-                             3, "trace_mem_store", 
-                             VG_(fnptr_to_fnentry)( &trace_mem_store ),
-                             mkIRExprVec_3( mkIRExpr_HWord( (HWord)d->mAddr ),
-                                            mkIRExpr_HWord( (HWord)-1 ),
-                                            mkIRExpr_HWord( dsize )
-                                          ) 
-                          );
-                     addStmtToIRSB( sbOut, IRStmt_Dirty(di) );
-                  }
+                  if (d->mFx == Ifx_Read || d->mFx == Ifx_Modify)
+                     addEvent( sbOut, RRCT_LOAD, dsize, 0, d->mAddr, (HWord)-1, NULL );
+                  if (d->mFx == Ifx_Write || d->mFx == Ifx_Modify)
+                     addEvent( sbOut, RRCT_STORE, dsize, 0, d->mAddr, (HWord)-1, NULL );
                } else {
                   tl_assert(d->mAddr == NULL);
                   tl_assert(d->mSize == 0);
@@ -538,6 +938,8 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
          }
 
          case Ist_Exit:         
+            /* the events so far happen whether the exit is taken or not */
+            flushEvents( sbOut );
             addStmtToIRSB( sbOut, st );      // Original statement
             break;
 
@@ -545,7 +947,9 @@ IRSB* rrcheck_instrument ( VgCallbackClosure* closure,
             tl_assert(0);
       }
    }
-   
+
+   /* at the final exit */
+   flushEvents( sbOut );
    return sbOut;
 }
 
@@ -574,13 +978,37 @@ static void rrcheck_fini(Int exitcode)
       VG_(message)(Vg_UserMsg, "number of mismatched register gets: %ld", n_get_mismatch);
       VG_(message)(Vg_UserMsg, "number of mismatched register puts: %ld", n_put_mismatch);
    }
+   if(hash_interval > 0 && n_sb > 0)
+      end_hash_window(n_sb);
+   if(hash_interval > 0 && VG_(clo_record_replay) == REPLAYONLY && clo_check_from_sb == 0)
+      VG_(message)(Vg_UserMsg, "number of mismatched hash windows: %llu", n_hash_mismatch);
    if(VG_(clo_record_replay) == RECORDONLY) {
       VG_(message)(Vg_UserMsg, "Execution trace log is saved into %s.\n", rrcheck_out_file);
    }
 
-   if(fd != -1) {
-      VG_(close) (fd);
-   }
+   close_trace(&trace);
+   close_trace(&detail);
+}
+
+/* 
+ * Called when a translation is removed from the translation cache: free
+ * its groups. Note that vge.base[0] is the address it was made for.
+ */
+static void rrcheck_discard_superblock_info(Addr64 orig_addr64, 
+                                            VexGuestExtents vge)
+{
+   SBEvents* sbe;
+   Addr      orig_addr = (Addr)vge.base[0];
+   Word      i;
+
+   tl_assert(vge.n_used > 0);
+   sbe = VG_(OSetGen_Remove)(sb_events_table, &orig_addr);
+   if(sbe == NULL)
+      return;
+   for(i = 0; i < VG_(sizeXA)(sbe->groups); i++)
+      VG_(free)(*(Event**)VG_(indexXA)(sbe->groups, i));
+   VG_(deleteXA)(sbe->groups);
+   VG_(OSetGen_FreeNode)(sb_events_table, sbe);
 }
 
 static void rrcheck_pre_clo_init(void)
@@ -599,9 +1027,13 @@ static void rrcheck_pre_clo_init(void)
    VG_(needs_command_line_options)(rrcheck_process_cmd_line_option,
                                    rrcheck_print_usage,
                                    rrcheck_print_debug_usage);
+   VG_(needs_superblock_discards)(rrcheck_discard_superblock_info);
 
+   sb_events_table = VG_(OSetGen_Create)(/*keyOff*/0, NULL,
+                                         VG_(malloc), "rrcheck.sb_events",
+                                         VG_(free));
 
-   /* No needs, no core events to track */
+   /* No core events to track */
 }
 
 VG_DETERMINE_INTERFACE_VERSION(rrcheck_pre_clo_init)
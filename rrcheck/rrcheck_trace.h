@@ -0,0 +1,90 @@
+
+/*--------------------------------------------------------------------*/
+/*--- rrcheck: the execution trace format           rrcheck_trace.h ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of rrcheck, a Valgrind tool that detects replay
+   divergence
+
+   Copyright (C) 2008
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+#ifndef __RRCHECK_TRACE_H
+#define __RRCHECK_TRACE_H
+
+/*
+ * The execution trace is shared by the tool, which writes it in record and
+ * checks against it in replay, and by rrcheck_dump, which prints it as text.
+ * So only plain C is used here.
+ *
+ * The trace starts with a 16-byte header: the magic "RRCT", the version,
+ * the size in bytes of a guest word (4 or 8), two zero bytes, and the 
+ * 8-byte hash interval. Records follow back to back, in the byte order of
+ * the host. Each starts with its kind byte; W is a guest word:
+ *
+ *   RRCT_SB    'B'  W addr                    a superblock is entered
+ *   RRCT_INSTR 'I'  W addr, 1 byte size       an instruction is executed
+ *   RRCT_LOAD  'L'  W addr, W value, 2 bytes size
+ *   RRCT_STORE 'S'  W addr, W value, 2 bytes size
+ *   RRCT_PUT   'P'  2 bytes offset, W value   a guest register is written
+ *   RRCT_GET   'G'  2 bytes offset, W value   a guest register is read
+ *   RRCT_HASH  'H'  8 bytes hash, 8 bytes last superblock, 8 bytes offset
+ *
+ * With a hash interval of 0, the trace holds all the records. Otherwise 
+ * it only holds an RRCT_HASH record for every window of that many 
+ * superblock entries: the FNV-1a hash of the window's records, the number
+ * of the last superblock entry in it (counted from 1), and where the 
+ * records of the window start in the detail file, "<trace>.detail". That
+ * file holds all the records, after the same header.
+ *
+ * A value of all ones stands for one that is not traced.
+ */
+
+#define RRCT_MAGIC        "RRCT"
+#define RRCT_VERSION      2
+#define RRCT_HEADER_SIZE  16
+
+#define RRCT_SB           'B'
+#define RRCT_INSTR        'I'
+#define RRCT_LOAD         'L'
+#define RRCT_STORE        'S'
+#define RRCT_PUT          'P'
+#define RRCT_GET          'G'
+#define RRCT_HASH         'H'
+
+/* size in bytes of a record of kind, 0 for an unknown kind */
+#define RRCT_RECORD_SIZE(kind, wordsz)                           \
+   ((kind) == RRCT_SB    ? 1 + (wordsz) :                        \
+    (kind) == RRCT_INSTR ? 1 + (wordsz) + 1 :                    \
+    (kind) == RRCT_LOAD || (kind) == RRCT_STORE                  \
+                         ? 1 + 2 * (wordsz) + 2 :                \
+    (kind) == RRCT_PUT || (kind) == RRCT_GET                     \
+                         ? 1 + 2 + (wordsz) :                    \
+    (kind) == RRCT_HASH  ? 1 + 3 * 8 : 0)
+
+/* the largest record */
+#define RRCT_MAX_RECORD_SIZE  (1 + 3 * 8)
+
+#endif   // __RRCHECK_TRACE_H
+
+/*--------------------------------------------------------------------*/
+/*--- end                                                          ---*/
+/*--------------------------------------------------------------------*/